@@ -0,0 +1,91 @@
+/* adler32.hpp
+
+   Adler-32, the checksum of the zlib format (RFC 1950).
+
+   The checksum is two sums modulo 65521: s1, the sum of the bytes (plus
+   one), and s2, the sum of the successive values of s1. Both are kept in 32
+   bits and only reduced every NMAX bytes, the most that can be added without
+   overflow (the same bound zlib uses). With SSE2, each block of NMAX bytes is
+   summed 16 bytes at a time: PSADBW adds up the bytes for s1, and PMADDWD
+   multiplies them by their weights (16 down to 1) for s2.
+*/
+
+#ifndef ADLER32_HPP
+#define ADLER32_HPP
+
+#include <cstddef>
+#include <cstdint>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace adler32 {
+
+using u8 = std::uint8_t;
+using u32 = std::uint32_t;
+
+const u32 BASE = 65521;
+const size_t NMAX = 5552;
+
+/* The Adler-32 of an empty message, i.e. the initial value */
+const u32 INITIAL = 1;
+
+inline void update_scalar(u32& s1, u32& s2, const u8* data, size_t size){
+    for(size_t i = 0; i < size; i++){
+        s1 += data[i];
+        s2 += s1;
+    }
+}
+
+#if defined(__SSE2__)
+inline u32 horizontal_sum(__m128i v){
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(v);
+}
+
+/* Add blocks of 16 bytes to the sums (size must be a multiple of 16, and at most NMAX) */
+inline void update_sse2(u32& s1, u32& s2, const u8* data, size_t size){
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weights_lo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+    const __m128i weights_hi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+    __m128i v_s1 = zero;       //byte sums
+    __m128i v_prefix = zero;   //sum of v_s1 before each block of 16
+    __m128i v_s2 = zero;       //weighted byte sums
+    s2 += s1 * (u32)size;
+    for(size_t i = 0; i < size; i += 16){
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(data + i));
+        v_prefix = _mm_add_epi32(v_prefix, v_s1);
+        v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes, zero));
+        v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpacklo_epi8(bytes, zero), weights_lo));
+        v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpackhi_epi8(bytes, zero), weights_hi));
+    }
+    s1 += horizontal_sum(v_s1);
+    s2 += 16 * horizontal_sum(v_prefix) + horizontal_sum(v_s2);
+}
+#endif
+
+/* Continue a running Adler-32 over size more bytes */
+inline u32 update(u32 adler, const u8* data, size_t size){
+    u32 s1 = adler & 0xffff;
+    u32 s2 = adler >> 16;
+    while (size > 0){
+        size_t n = size < NMAX ? size : NMAX;
+        size -= n;
+#if defined(__SSE2__)
+        size_t vector_bytes = n & ~(size_t)15;
+        update_sse2(s1, s2, data, vector_bytes);
+        data += vector_bytes;
+        n -= vector_bytes;
+#endif
+        update_scalar(s1, s2, data, n);
+        data += n;
+        s1 %= BASE;
+        s2 %= BASE;
+    }
+    return s1 | (s2 << 16);
+}
+
+}
+
+#endif
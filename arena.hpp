@@ -0,0 +1,127 @@
+/* arena.hpp
+
+   A bump allocator over one block of memory obtained up front, for working
+   state which lives as long as its owner and is reused from one stream to
+   the next (see deflate::Compressor). Handing out memory is a pointer
+   increment, nothing is freed piece by piece, and reset() makes the whole
+   block available again at once.
+
+   Only trivially destructible types may be allocated, since no destructors
+   are ever run. The memory is not initialised.
+
+   An arena made with huge_pages set is mapped on its own, aligned to and
+   rounded up to 2 MiB, and marked with madvise(MADV_HUGEPAGE) so that
+   transparent huge pages back it where the kernel allows (THP "always" or
+   "madvise"): randomly accessed tables then need one TLB entry per 2 MiB
+   instead of one per 4 KiB. Otherwise the advice is ignored and the arena
+   works as usual.
+*/
+
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <sys/mman.h>
+
+namespace arena {
+
+/* Every allocation starts on a cache line, so arrays carved side by side do not share lines */
+const size_t ALIGNMENT = 64;
+
+const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+/* The memory an arena of this capacity takes from the system */
+constexpr size_t footprint(size_t capacity, bool huge_pages){
+    return huge_pages ? (capacity + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE : capacity + ALIGNMENT;
+}
+
+class Arena {
+public:
+    /* Throws std::bad_alloc if the memory cannot be had */
+    explicit Arena(size_t capacity, bool huge_pages = false): block{nullptr, Release{footprint(capacity, huge_pages), huge_pages}},
+        total{capacity} {
+        if (huge_pages){
+            block.reset(map_huge(block.get_deleter().size));
+            base = block.get();
+        } else {
+            block.reset(new unsigned char[capacity + ALIGNMENT]);
+            base = block.get() + (ALIGNMENT - (uintptr_t)block.get() % ALIGNMENT) % ALIGNMENT;
+        }
+    }
+
+    /* Room for count objects of type T. Throws std::bad_alloc if the arena is exhausted. */
+    template<typename T>
+    T* allocate(size_t count){
+        static_assert(std::is_trivially_destructible<T>::value, "arena memory is never destroyed");
+        static_assert(alignof(T) <= ALIGNMENT, "over-aligned type");
+        size_t bytes = space_for<T>(count);
+        if (bytes > total - in_use)
+            throw std::bad_alloc();
+        T* p = reinterpret_cast<T*>(base + in_use);
+        in_use += bytes;
+        return p;
+    }
+
+    /* Forget every allocation (the memory itself is kept) */
+    void reset(){
+        in_use = 0;
+    }
+
+    size_t used() const {
+        return in_use;
+    }
+
+    size_t capacity() const {
+        return total;
+    }
+
+    bool huge_pages() const {
+        return block.get_deleter().mapped;
+    }
+
+    /* Bytes needed to allocate count objects of type T, for sizing an arena */
+    template<typename T>
+    static constexpr size_t space_for(size_t count){
+        return (count * sizeof(T) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    }
+
+private:
+    struct Release {
+        size_t size;
+        bool mapped;
+        void operator()(unsigned char* p) const {
+            if (mapped)
+                munmap(p, size);
+            else
+                delete[] p;
+        }
+    };
+
+    /* size bytes (a multiple of HUGE_PAGE_SIZE) starting on a huge page:
+       map a huge page more than needed, and unmap what lies either side */
+    static unsigned char* map_huge(size_t size){
+        void* p = mmap(nullptr, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            throw std::bad_alloc();
+        unsigned char* start = (unsigned char*)p;
+        size_t before = (HUGE_PAGE_SIZE - (uintptr_t)start % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+        if (before > 0)
+            munmap(start, before);
+        munmap(start + before + size, HUGE_PAGE_SIZE - before);
+        madvise(start + before, size, MADV_HUGEPAGE); //only advice, so failure is no error
+        return start + before;
+    }
+
+    std::unique_ptr<unsigned char[], Release> block;
+    unsigned char* base;
+    size_t total;
+    size_t in_use {0};
+};
+
+}
+
+#endif
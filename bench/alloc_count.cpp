@@ -0,0 +1,132 @@
+/* alloc_count.cpp
+
+   Counts the heap allocations deflate::Compressor makes. The global
+   operator new is replaced with one which counts calls and live bytes, and
+   a single compressor is run over a series of streams (plain, with flushes,
+   in zlib format with a preset dictionary). Once the compressor and its
+   output vector have been through one stream, later streams should
+   allocate nothing. Then compressors with a range of window bits and memory
+   levels, at the default compression level and at level 9 (whose optimal
+   parser takes more arena), are each run over a stream, and the heap they hold (beyond their
+   pending output) is checked against Compressor::memory_bound(). The
+   program prints the figures and exits with status 1 if either check fails.
+
+   Usage: ./alloc_count [streams]
+*/
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <new>
+#include <string>
+#include <vector>
+#include "deflate.hpp"
+
+static std::atomic<size_t> allocations {0};
+static std::atomic<size_t> live_bytes {0};
+
+//Each block starts with a header recording its size
+const size_t HEADER = 16;
+
+//Neither is inlined, or GCC sees the header arithmetic through them and warns about it
+__attribute__((noinline)) void* operator new(size_t size){
+    allocations++;
+    live_bytes += size;
+    if (unsigned char* p = (unsigned char*)std::malloc(size + HEADER)){
+        *(size_t*)p = size;
+        return p + HEADER;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    if (!p)
+        return;
+    unsigned char* block = (unsigned char*)p - HEADER;
+    live_bytes -= *(size_t*)block;
+    std::free(block);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    operator delete(p);
+}
+
+std::vector<u8> read_file(const char* path){
+    std::ifstream f {path, std::ios::binary};
+    return {std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>()};
+}
+
+/* Allocations made by one reset/compress/finish round over data, fed in pieces of 64 KiB */
+size_t one_stream(deflate::Compressor& compressor, std::vector<u8> const& data, bool flushes){
+    size_t before = allocations;
+    compressor.reset();
+    for(size_t pos = 0; pos < data.size(); pos += 1 << 16){
+        compressor.compress(data.data() + pos, std::min<size_t>(1 << 16, data.size() - pos));
+        if (flushes)
+            compressor.flush(deflate::Flush::Sync);
+    }
+    compressor.finish();
+    compressor.output_bytes().clear();
+    return allocations - before;
+}
+
+int main(int argc, char** argv){
+    size_t streams = argc > 1 ? std::stoul(argv[1]) : 5;
+    auto data = read_file("test_data/calgary_corpus/book2");
+    auto dict = read_file("test_data/calgary_corpus/paper2");
+    if (data.empty() || dict.empty()){
+        std::fprintf(stderr, "run from the repository root (needs test_data)\n");
+        return 1;
+    }
+
+    bool ok = true;
+    auto run = [&](const char* name, deflate::Compressor& compressor, bool flushes){
+        std::printf("%-22s first stream %4zu allocations, then", name, one_stream(compressor, data, flushes));
+        for(size_t i = 1; i < streams; i++){
+            size_t n = one_stream(compressor, data, flushes);
+            std::printf(" %zu", n);
+            ok = ok && n == 0;
+        }
+        std::printf("\n");
+    };
+
+    size_t before = allocations;
+    deflate::Compressor compressor;
+    std::printf("%-22s %zu allocations\n", "construction", allocations - before);
+    run("gzip", compressor, false);
+    run("gzip, sync flushes", compressor, true);
+
+    deflate::Compressor zlib_compressor;
+    zlib_compressor.set_format(deflate::Format::Zlib);
+    zlib_compressor.set_dictionary(dict.data(), dict.size());
+    run("zlib with dictionary", zlib_compressor, false);
+
+    deflate::Compressor optimal_compressor;
+    optimal_compressor.set_level(deflate::MAX_LEVEL);
+    run("level 9", optimal_compressor, false);
+    if (!ok)
+        std::printf("FAILED: steady state streams allocated\n");
+
+    std::printf("\nwindow bits  mem level  level  memory_bound()  held after a stream\n");
+    for(int level: {deflate::DEFAULT_LEVEL, deflate::MAX_LEVEL}){
+        for(int window_bits: {9, 12, 15}){
+            for(int mem_level: {1, 5, 9}){
+                size_t before = live_bytes;
+                auto c = new deflate::Compressor {window_bits, mem_level};
+                c->set_level(level);
+                one_stream(*c, data, false);
+                size_t held = live_bytes - before - c->output_bytes().capacity();
+                size_t bound = deflate::Compressor::memory_bound(window_bits, mem_level, false, level);
+                std::printf("%11d  %9d  %5d  %14zu  %19zu%s\n", window_bits, mem_level, level, bound, held, held > bound ? "  OVER" : "");
+                ok = ok && held <= bound;
+                delete c;
+            }
+        }
+    }
+    if (!ok){
+        std::printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
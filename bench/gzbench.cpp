@@ -0,0 +1,356 @@
+/* gzbench.cpp
+
+   Throughput and ratio over the bundled corpora. Every file under
+   test_data/ is compressed in-process with each compressor configuration
+   (and, when it is installed, with the system gzip at -1, -6 and -9 as a
+   baseline), then decompressed again and checked. Each run is repeated and
+   the median time is reported, as compression and decompression MB/s
+   (MB = 10^6 bytes of uncompressed data), the ratio (original size over
+   compressed size), and the peak resident set size of the run.
+
+   In-process runs get their peak RSS by resetting the kernel's high water
+   mark (/proc/self/clear_refs) before each run and reading VmHWM after it,
+   so the figure includes the benchmark's own copy of the corpus. gzip runs
+   are separate processes; their time includes starting the process, and
+   their peak RSS is the child's own.
+
+   A table goes to stdout, one row per configuration and file plus a total
+   per configuration; --csv and --json write the same rows to files.
+
+   With --perf, each configuration then compresses the whole corpus once
+   more with compress_stats counting, and a second table breaks its time
+   down by stage (match finding, Huffman codes and headers, emitting
+   symbols, checksum), with hardware events per MB of input from
+   perf_event_open where the machine offers them ("-" where it does not).
+
+   Usage: ./gzbench [--repeat N] [--dir DIR] [--csv FILE] [--json FILE] [--no-gzip] [--perf]
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "deflate.hpp"
+#include "inflate.hpp"
+
+extern char** environ;
+
+using Clock = std::chrono::steady_clock;
+
+/* A compressor configuration to measure */
+struct Config {
+    std::string name;
+    int window_bits;
+    int mem_level;
+    int level;
+};
+
+const std::vector<Config> CONFIGS {
+    {"gzcomp", deflate::MAX_WINDOW_BITS, deflate::MAX_MEM_LEVEL, deflate::DEFAULT_LEVEL},
+    {"gzcomp -1", deflate::MAX_WINDOW_BITS, deflate::MAX_MEM_LEVEL, 1},
+    {"gzcomp -6", deflate::MAX_WINDOW_BITS, deflate::MAX_MEM_LEVEL, 6},
+    {"gzcomp -9", deflate::MAX_WINDOW_BITS, deflate::MAX_MEM_LEVEL, 9},
+    {"gzcomp --mem-level 1", deflate::MAX_WINDOW_BITS, 1, deflate::DEFAULT_LEVEL},
+    {"gzcomp --window-bits 9 --mem-level 1", 9, 1, deflate::DEFAULT_LEVEL},
+};
+
+const std::vector<int> GZIP_LEVELS {1, 6, 9};
+
+struct Row {
+    std::string config;
+    std::string file;
+    u64 size;
+    u64 compressed;
+    double compress_seconds;    //median of the repeats
+    double decompress_seconds;
+    u64 peak_rss_kib;
+};
+
+struct Corpus {
+    std::string path;
+    std::vector<u8> data;
+};
+
+double median(std::vector<double> v){
+    std::sort(v.begin(), v.end());
+    return v[v.size() / 2];
+}
+
+void reset_peak_rss(){
+    std::ofstream clear {"/proc/self/clear_refs"};
+    clear << "5";
+}
+
+u64 peak_rss_kib(){
+    std::ifstream status {"/proc/self/status"};
+    std::string line;
+    while (std::getline(status, line)){
+        if (line.compare(0, 6, "VmHWM:") == 0)
+            return std::stoull(line.substr(6));
+    }
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+Row run_gzcomp(Config const& config, Corpus const& file, int repeat){
+    Row row {config.name, file.path, file.data.size(), 0, 0, 0, 0};
+    reset_peak_rss();
+    deflate::Compressor compressor {config.window_bits, config.mem_level};
+    compressor.set_level(config.level);
+    std::vector<u8> compressed;
+    std::vector<u8> decompressed;
+    decompressed.reserve(file.data.size());
+    std::vector<double> compress_times, decompress_times;
+    for(int r = 0; r < repeat; r++){
+        auto t0 = Clock::now();
+        compressor.reset();
+        compressor.compress(file.data.data(), file.data.size());
+        compressor.finish();
+        auto t1 = Clock::now();
+        compressed.swap(compressor.output_bytes());
+        compress_times.push_back(std::chrono::duration<double>(t1 - t0).count());
+
+        decompressed.clear();
+        t0 = Clock::now();
+        inflate::gunzip(compressed.data(), compressed.size(), [&](const u8* bytes, size_t n){
+            decompressed.insert(decompressed.end(), bytes, bytes + n);
+        });
+        t1 = Clock::now();
+        decompress_times.push_back(std::chrono::duration<double>(t1 - t0).count());
+        if (decompressed != file.data){
+            std::fprintf(stderr, "gzbench: %s does not round trip with %s\n", file.path.c_str(), config.name.c_str());
+            std::exit(1);
+        }
+    }
+    row.compressed = compressed.size();
+    row.compress_seconds = median(compress_times);
+    row.decompress_seconds = median(decompress_times);
+    row.peak_rss_kib = peak_rss_kib();
+    return row;
+}
+
+/* Run argv with stdin from in_path and stdout to out_path. Returns the
+   wall time, or a negative number if it failed, and the child's peak RSS. */
+double run_process(std::vector<std::string> const& args, std::string const& in_path, std::string const& out_path, u64& rss_kib){
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, in_path.c_str(), O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    std::vector<char*> argv;
+    for(auto const& a: args)
+        argv.push_back((char*)a.c_str());
+    argv.push_back(nullptr);
+
+    auto t0 = Clock::now();
+    pid_t pid;
+    int err = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0)
+        return -1;
+    int status;
+    rusage usage;
+    wait4(pid, &status, 0, &usage);
+    auto t1 = Clock::now();
+    rss_kib = usage.ru_maxrss;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    return std::chrono::duration<double>(t1 - t0).count();
+}
+
+bool gzip_available(){
+    u64 rss;
+    return run_process({"gzip", "--version"}, "/dev/null", "/dev/null", rss) >= 0;
+}
+
+Row run_gzip(int level, Corpus const& file, int repeat, std::string const& temp_dir){
+    Row row {"gzip -" + std::to_string(level), file.path, file.data.size(), 0, 0, 0, 0};
+    std::string prefix = temp_dir + "/gzbench." + std::to_string(getpid());
+    std::string compressed = prefix + ".gz";
+    std::string decompressed = prefix + ".out";
+    std::vector<double> compress_times, decompress_times;
+    for(int r = 0; r < repeat; r++){
+        u64 rss = 0;
+        double t = run_process({"gzip", "-c", "-" + std::to_string(level)}, file.path, compressed, rss);
+        row.peak_rss_kib = std::max(row.peak_rss_kib, rss);
+        compress_times.push_back(t);
+        t = run_process({"gzip", "-dc"}, compressed, decompressed, rss);
+        row.peak_rss_kib = std::max(row.peak_rss_kib, rss);
+        decompress_times.push_back(t);
+        if (compress_times.back() < 0 || decompress_times.back() < 0){
+            std::fprintf(stderr, "gzbench: gzip failed on %s\n", file.path.c_str());
+            std::exit(1);
+        }
+    }
+    row.compressed = std::filesystem::file_size(compressed);
+    row.compress_seconds = median(compress_times);
+    row.decompress_seconds = median(decompress_times);
+    std::filesystem::remove(compressed);
+    std::filesystem::remove(decompressed);
+    return row;
+}
+
+/* Compress every file with config, counting per stage, and print the breakdown */
+void print_stages(Config const& config, std::vector<Corpus> const& files){
+    compress_stats::Stats stats;
+    bool have_events = stats.count_events();
+    deflate::Compressor compressor {config.window_bits, config.mem_level};
+    compressor.set_level(config.level);
+    compressor.set_stats(&stats);
+    for(auto const& file: files){
+        compressor.reset();
+        compressor.compress(file.data.data(), file.data.size());
+        compressor.finish();
+    }
+    double mb = stats.bytes_in / 1e6;
+    std::printf("%-38s %-14s %10s", config.name.c_str(), "stage", "ms/MB");
+    for(auto name: perf_counters::NAMES)
+        std::printf(" %14s", (std::string{name} + "/MB").c_str());
+    std::printf("\n");
+    for(int s = compress_stats::MATCH_FINDING; s < compress_stats::NUM_STAGES; s++){
+        std::printf("%-38s %-14s %10.3f", "", compress_stats::STAGE_NAMES[s], 1000 * stats.seconds[s] / mb);
+        for(int c = 0; c < perf_counters::NUM_COUNTERS; c++){
+            if (have_events && stats.event_available((perf_counters::Counter)c))
+                std::printf(" %14.0f", stats.events[s][c] / mb);
+            else
+                std::printf(" %14s", "-");
+        }
+        std::printf("\n");
+    }
+}
+
+/* One row per configuration adding up all of its files */
+std::vector<Row> totals(std::vector<Row> const& rows){
+    std::vector<Row> result;
+    for(auto const& row: rows){
+        auto it = std::find_if(result.begin(), result.end(), [&](Row const& r){ return r.config == row.config; });
+        if (it == result.end()){
+            result.push_back({row.config, "TOTAL", 0, 0, 0, 0, 0});
+            it = result.end() - 1;
+        }
+        it->size += row.size;
+        it->compressed += row.compressed;
+        it->compress_seconds += row.compress_seconds;
+        it->decompress_seconds += row.decompress_seconds;
+        it->peak_rss_kib = std::max(it->peak_rss_kib, row.peak_rss_kib);
+    }
+    return result;
+}
+
+double mb_per_s(u64 bytes, double seconds){
+    return seconds > 0 ? bytes / seconds / 1e6 : 0;
+}
+
+void print_table(std::vector<Row> const& rows){
+    std::printf("%-38s %-40s %10s %10s %7s %10s %10s %10s\n",
+        "config", "file", "bytes", "compressed", "ratio", "comp MB/s", "decomp MB/s", "peak KiB");
+    for(auto const& r: rows){
+        std::printf("%-38s %-40s %10llu %10llu %7.3f %10.2f %11.2f %10llu\n",
+            r.config.c_str(), r.file.c_str(), (unsigned long long)r.size, (unsigned long long)r.compressed,
+            (double)r.size / r.compressed, mb_per_s(r.size, r.compress_seconds),
+            mb_per_s(r.size, r.decompress_seconds), (unsigned long long)r.peak_rss_kib);
+    }
+}
+
+void write_csv(std::string const& path, std::vector<Row> const& rows){
+    std::ofstream out {path};
+    out << "config,file,bytes,compressed,ratio,compress_mb_s,decompress_mb_s,peak_rss_kib\n";
+    for(auto const& r: rows){
+        out << '"' << r.config << "\",\"" << r.file << "\"," << r.size << ',' << r.compressed << ','
+            << (double)r.size / r.compressed << ',' << mb_per_s(r.size, r.compress_seconds) << ','
+            << mb_per_s(r.size, r.decompress_seconds) << ',' << r.peak_rss_kib << '\n';
+    }
+}
+
+void write_json(std::string const& path, std::vector<Row> const& rows){
+    std::ofstream out {path};
+    out << "[\n";
+    for(size_t i = 0; i < rows.size(); i++){
+        auto const& r = rows[i];
+        out << "  {\"config\": \"" << r.config << "\", \"file\": \"" << r.file << "\", \"bytes\": " << r.size
+            << ", \"compressed\": " << r.compressed << ", \"ratio\": " << (double)r.size / r.compressed
+            << ", \"compress_mb_s\": " << mb_per_s(r.size, r.compress_seconds)
+            << ", \"decompress_mb_s\": " << mb_per_s(r.size, r.decompress_seconds)
+            << ", \"peak_rss_kib\": " << r.peak_rss_kib << "}" << (i + 1 < rows.size() ? "," : "") << "\n";
+    }
+    out << "]\n";
+}
+
+int main(int argc, char** argv){
+    int repeat = 3;
+    std::string dir = "test_data";
+    std::string csv_file, json_file;
+    bool use_gzip = true;
+    bool perf = false;
+    for(int i = 1; i < argc; i++){
+        std::string arg {argv[i]};
+        bool has_value = i + 1 < argc;
+        if (arg == "--repeat" && has_value){
+            repeat = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--dir" && has_value){
+            dir = argv[++i];
+        } else if (arg == "--csv" && has_value){
+            csv_file = argv[++i];
+        } else if (arg == "--json" && has_value){
+            json_file = argv[++i];
+        } else if (arg == "--no-gzip"){
+            use_gzip = false;
+        } else if (arg == "--perf"){
+            perf = true;
+        } else {
+            std::fprintf(stderr, "Usage: %s [--repeat N] [--dir DIR] [--csv FILE] [--json FILE] [--no-gzip] [--perf]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::vector<Corpus> files;
+    std::error_code error;
+    for(auto const& entry: std::filesystem::recursive_directory_iterator(dir, error)){
+        if (!entry.is_regular_file() || entry.file_size() == 0)
+            continue;
+        std::ifstream in {entry.path(), std::ios::binary};
+        files.push_back({entry.path().string(), {std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()}});
+    }
+    if (files.empty()){
+        std::fprintf(stderr, "gzbench: no files under %s (run from the repository root)\n", dir.c_str());
+        return 1;
+    }
+    std::sort(files.begin(), files.end(), [](Corpus const& a, Corpus const& b){ return a.path < b.path; });
+
+    std::vector<Row> rows;
+    for(auto const& config: CONFIGS){
+        for(auto const& file: files)
+            rows.push_back(run_gzcomp(config, file, repeat));
+    }
+    if (use_gzip && gzip_available()){
+        std::string temp_dir = std::filesystem::temp_directory_path().string();
+        for(int level: GZIP_LEVELS){
+            for(auto const& file: files)
+                rows.push_back(run_gzip(level, file, repeat, temp_dir));
+        }
+    }
+    auto total = totals(rows);
+    rows.insert(rows.end(), total.begin(), total.end());
+
+    print_table(rows);
+    if (!csv_file.empty())
+        write_csv(csv_file, rows);
+    if (!json_file.empty())
+        write_json(json_file, rows);
+    if (perf){
+        for(auto const& config: CONFIGS){
+            std::printf("\n");
+            print_stages(config, files);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,125 @@
+/* hugebench.cpp
+
+   Compression with and without transparent huge pages behind the
+   compressor's working memory (Compressor::set_huge_pages(), gzcomp
+   --huge-pages). Every file under test_data/ is compressed in turn by one
+   compressor per configuration, repeat times, and for each setting the
+   benchmark prints the median throughput over the whole corpus, the data
+   TLB read misses per MB of input (from perf_event_open; "-" where the
+   machine does not count them), and how much of the process's anonymous
+   memory the kernel actually backed with huge pages while the compressor
+   was alive, which is 0 if THP is disabled ("never" in
+   /sys/kernel/mm/transparent_hugepage/enabled).
+
+   The window and hash tables at the defaults come to about 3.5 MiB, which
+   is where the match finder's random accesses spill out of the TLB; with
+   --mem-level 1 everything fits in far fewer 4 KiB pages, so there is
+   little to gain.
+
+   Usage: ./hugebench [--repeat N] [--dir DIR]
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "deflate.hpp"
+#include "perf_counters.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+struct Config {
+    std::string name;
+    int window_bits;
+    int mem_level;
+};
+
+const std::vector<Config> CONFIGS {
+    {"gzcomp", deflate::MAX_WINDOW_BITS, deflate::MAX_MEM_LEVEL},
+    {"gzcomp --mem-level 1", deflate::MAX_WINDOW_BITS, 1},
+};
+
+double median(std::vector<double> v){
+    std::sort(v.begin(), v.end());
+    return v[v.size() / 2];
+}
+
+/* AnonHugePages of the whole process, in KiB */
+u64 huge_page_kib(){
+    std::ifstream rollup {"/proc/self/smaps_rollup"};
+    std::string line;
+    while (std::getline(rollup, line)){
+        if (line.compare(0, 14, "AnonHugePages:") == 0)
+            return std::stoull(line.substr(14));
+    }
+    return 0;
+}
+
+int main(int argc, char** argv){
+    int repeat = 5;
+    std::string dir = "test_data";
+    for(int i = 1; i < argc; i++){
+        std::string arg = argv[i];
+        if (arg == "--repeat" && i + 1 < argc){
+            repeat = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--dir" && i + 1 < argc){
+            dir = argv[++i];
+        } else {
+            std::fprintf(stderr, "Usage: %s [--repeat N] [--dir DIR]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::vector<std::vector<u8>> files;
+    u64 total = 0;
+    std::error_code error;
+    for(auto const& entry: std::filesystem::recursive_directory_iterator(dir, error)){
+        if (!entry.is_regular_file() || entry.file_size() == 0)
+            continue;
+        std::ifstream in {entry.path(), std::ios::binary};
+        files.push_back({std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()});
+        total += files.back().size();
+    }
+    if (files.empty()){
+        std::fprintf(stderr, "hugebench: no files under %s (run from the repository root)\n", dir.c_str());
+        return 1;
+    }
+
+    perf_counters::Counters counters;
+    std::printf("%-24s %-11s %10s %16s %16s\n", "configuration", "huge pages", "MB/s", "dtlb_misses/MB", "THP KiB");
+    for(auto const& config: CONFIGS){
+        for(bool huge: {false, true}){
+            u64 kib_before = huge_page_kib();
+            deflate::Compressor compressor {config.window_bits, config.mem_level};
+            compressor.set_huge_pages(huge);
+            std::vector<double> times;
+            u64 misses = 0;
+            u64 kib = 0;
+            for(int r = 0; r < repeat; r++){
+                auto events = counters.read();
+                auto t0 = Clock::now();
+                for(auto const& file: files){
+                    compressor.reset();
+                    compressor.compress(file.data(), file.size());
+                    compressor.finish();
+                    compressor.output_bytes().clear();
+                }
+                auto t1 = Clock::now();
+                misses += counters.read()[perf_counters::DTLB_MISSES] - events[perf_counters::DTLB_MISSES];
+                times.push_back(std::chrono::duration<double>(t1 - t0).count());
+                kib = std::max(kib, huge_page_kib());
+            }
+            double mb = total / 1e6;
+            std::printf("%-24s %-11s %10.2f", config.name.c_str(), huge ? "yes" : "no", mb / median(times));
+            if (counters.available(perf_counters::DTLB_MISSES))
+                std::printf(" %16.0f", misses / (mb * repeat));
+            else
+                std::printf(" %16s", "-");
+            std::printf(" %16llu\n", (unsigned long long)(kib > kib_before ? kib - kib_before : 0));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,95 @@
+/* loadgen.cpp
+
+   Load generator for gzcomp --serve. Opens CONNECTIONS connections, each
+   on its own thread, and sends REQUESTS compression requests of SIZE bytes
+   (cut from the test corpus) on each, one at a time. Every response is
+   decompressed and checked. Prints the request rate and the latency
+   percentiles over all requests.
+
+   Usage: ./loadgen SOCKET [CONNECTIONS] [REQUESTS] [SIZE]
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+#include "server.hpp"
+#include "inflate.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+int main(int argc, char** argv){
+    if (argc < 2){
+        std::fprintf(stderr, "Usage: %s SOCKET [CONNECTIONS] [REQUESTS] [SIZE]\n", argv[0]);
+        return 1;
+    }
+    std::string path = argv[1];
+    unsigned connections = argc > 2 ? std::stoul(argv[2]) : 4;
+    size_t requests = argc > 3 ? std::stoul(argv[3]) : 10000;
+    size_t size = argc > 4 ? std::stoul(argv[4]) : 1024;
+
+    std::vector<u8> corpus;
+    for(const char* f: {"test_data/calgary_corpus/paper1", "test_data/calgary_corpus/progc",
+                        "test_data/canterbury_corpus/cp.html", "test_data/calgary_corpus/bib"}){
+        std::ifstream in {f, std::ios::binary};
+        corpus.insert(corpus.end(), std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    if (corpus.size() <= size){
+        std::fprintf(stderr, "run from the repository root (needs test_data), with SIZE under %zu\n", corpus.size());
+        return 1;
+    }
+
+    std::vector<std::vector<double>> latencies(connections);
+    std::vector<std::string> errors(connections);
+    auto start = Clock::now();
+    std::vector<std::thread> pool;
+    for(unsigned c = 0; c < connections; c++){
+        pool.emplace_back([&, c]{
+            try {
+                int sock = server::connect_to(path);
+                std::vector<u8> check;
+                for(size_t i = 0; i < requests; i++){
+                    const u8* msg = corpus.data() + ((c * requests + i) * 7919) % (corpus.size() - size);
+                    auto t0 = Clock::now();
+                    auto result = server::call(sock, server::OP_COMPRESS, deflate::Format::Gzip, msg, size);
+                    auto t1 = Clock::now();
+                    latencies[c].push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+                    check.clear();
+                    inflate::gunzip(result.data(), result.size(), [&](const u8* bytes, size_t n){
+                        check.insert(check.end(), bytes, bytes + n);
+                    });
+                    if (check.size() != size || !std::equal(check.begin(), check.end(), msg))
+                        throw server::ServerError("response does not decompress to the request");
+                }
+                close(sock);
+            } catch (std::runtime_error const& e){
+                errors[c] = e.what();
+            }
+        });
+    }
+    for(auto& t: pool)
+        t.join();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    for(auto const& e: errors){
+        if (!e.empty()){
+            std::fprintf(stderr, "loadgen: %s\n", e.c_str());
+            return 1;
+        }
+    }
+    std::vector<double> all;
+    for(auto const& l: latencies)
+        all.insert(all.end(), l.begin(), l.end());
+    std::sort(all.begin(), all.end());
+    auto pct = [&](double p){
+        return all[std::min(all.size() - 1, (size_t)(p * all.size()))];
+    };
+    std::printf("%zu requests of %zu bytes on %u connections in %.2f s: %.0f requests/s\n",
+        all.size(), size, connections, seconds, all.size() / seconds);
+    std::printf("latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+        pct(0.5), pct(0.9), pct(0.99), pct(0.999), all.back());
+    return 0;
+}
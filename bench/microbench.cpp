@@ -0,0 +1,227 @@
+/* microbench.cpp
+
+   Per-stage timings of the compressor, each on a fixed synthetic input so
+   that a regression in one kernel shows up on its own:
+
+     match finder     Compressor::compress() in raw format with no block
+                      ending, which is the parse loop alone (hashing, chain
+                      walks, match comparison and symbol counting)
+     huffman build    HuffmanCodes + enforceMaxLength + construct_canonical_code
+                      for a literal/length table
+     cl symbols       write_cl_symbol_stream over literal/length and distance code lengths
+     emit fixed       write_block with the fixed code: almost all of it is
+                      the loop emitting the block's symbols
+     emit dynamic     write_block with a dynamic code, header included
+     push_bits        OutputBitStream::push_bits with random widths
+     crc32            crc32::update
+     match LEVEL      the match finder again, and crc32 with the kernel
+     crc32 LEVEL      bound for it, at each level of cpu_dispatch.hpp this
+                      CPU supports (the rows above use the best of them)
+
+   Each stage is run SAMPLES times after a warm-up run, and the mean time
+   per unit (byte, call or symbol), its standard deviation and the fastest
+   sample are printed.
+
+   Usage: ./microbench [samples]
+*/
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+#include "deflate.hpp"
+#include "crc32.hpp"
+#include "cpu_dispatch.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+/* xorshift64, so every run sees the same inputs */
+struct Random {
+    u64 state {0x9e3779b97f4a7c15ull};
+    u64 next(){
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+    u32 below(u32 n){
+        return next() % n;
+    }
+};
+
+/* Text-like input: words from a small vocabulary, with Zipf-like frequencies */
+std::vector<u8> make_text(size_t size){
+    Random random;
+    std::vector<std::string> words;
+    for(int i = 0; i < 2000; i++){
+        std::string w;
+        for(u32 n = 2 + random.below(8); n > 0; n--)
+            w += (char)('a' + random.below(26));
+        words.push_back(w);
+    }
+    std::vector<u8> text;
+    while (text.size() < size){
+        //min of two uniform picks favours the low ranks
+        auto& w = words[std::min(random.below(words.size()), random.below(words.size()))];
+        text.insert(text.end(), w.begin(), w.end());
+        text.push_back(random.below(12) == 0 ? '\n' : ' ');
+    }
+    text.resize(size);
+    return text;
+}
+
+/* A block's worth of symbols: mostly literals, with some back-references */
+void make_symbols(size_t count, std::vector<deflate::Symbol>& symbols, deflate::SymbolCounts& counts){
+    Random random;
+    counts = deflate::SymbolCounts{};
+    symbols.clear();
+    while (symbols.size() < count){
+        if (random.below(4) == 0){
+            auto length = deflate::length_symbol(3 + random.below(random.below(256) + 1));
+            auto distance = deflate::distance_symbol(1 + random.below(random.below(32768) + 1));
+            symbols.push_back(length);
+            symbols.push_back(distance);
+            counts.symbolCounts[length.value]++;
+            counts.distCounts[distance.value]++;
+        } else {
+            u32 literal = 32 + random.below(random.below(95) + 1);
+            symbols.push_back(deflate::Symbol{literal, 0, 0, false});
+            counts.symbolCounts[literal]++;
+        }
+    }
+}
+
+/* Time SAMPLES runs of f, each of which processes units units, and print the result */
+void measure(const char* name, const char* unit, double units, int samples, std::function<void()> const& f){
+    f(); //warm up
+    std::vector<double> per_unit;
+    for(int i = 0; i < samples; i++){
+        auto t0 = Clock::now();
+        f();
+        auto t1 = Clock::now();
+        per_unit.push_back(std::chrono::duration<double, std::nano>(t1 - t0).count() / units);
+    }
+    double mean = 0;
+    for(double v: per_unit)
+        mean += v;
+    mean /= samples;
+    double variance = 0;
+    for(double v: per_unit)
+        variance += (v - mean) * (v - mean);
+    double stddev = std::sqrt(variance / samples);
+    double best = *std::min_element(per_unit.begin(), per_unit.end());
+    std::printf("%-16s %10.3f ns/%-6s +- %8.3f (%4.1f%%)  min %10.3f\n",
+        name, mean, unit, stddev, 100 * stddev / mean, best);
+}
+
+/* Keeps results alive so the optimiser cannot drop the work */
+volatile u64 sink;
+
+int main(int argc, char** argv){
+    int samples = argc > 1 ? std::max(2, std::atoi(argv[1])) : 20;
+
+    const size_t TEXT_SIZE = 1 << 18;
+    auto text = make_text(TEXT_SIZE);
+    deflate::Compressor compressor;
+    compressor.set_format(deflate::Format::Raw);
+    measure("match finder", "byte", TEXT_SIZE, samples, [&]{
+        compressor.reset();
+        compressor.compress(text.data(), text.size());
+        sink = compressor.total_in();
+    });
+
+    std::vector<deflate::Symbol> symbols;
+    deflate::SymbolCounts counts;
+    make_symbols(1 << 16, symbols, counts);
+
+    measure("huffman build", "call", 1000, samples, [&]{
+        for(int i = 0; i < 1000; i++){
+            int freq[deflate::SS_TABLE_SIZE];
+            std::copy(counts.symbolCounts, counts.symbolCounts + deflate::SS_TABLE_SIZE, freq);
+            freq[256] = 1;
+            std::array<u32, deflate::SS_TABLE_SIZE> lengths {};
+            deflate::HuffmanCodes(freq, deflate::SS_TABLE_SIZE, lengths.data());
+            deflate::enforceMaxLength(lengths.data(), deflate::SS_TABLE_SIZE, deflate::MAX_CODE_LENGTH);
+            sink = deflate::construct_canonical_code(lengths)[0];
+        }
+    });
+
+    std::array<u32, deflate::SS_TABLE_SIZE> ll_lengths {};
+    std::array<u32, deflate::DIST_TABLE_SIZE> dist_lengths {};
+    {
+        int freq[deflate::SS_TABLE_SIZE];
+        std::copy(counts.symbolCounts, counts.symbolCounts + deflate::SS_TABLE_SIZE, freq);
+        freq[256] = 1;
+        deflate::HuffmanCodes(freq, deflate::SS_TABLE_SIZE, ll_lengths.data());
+        deflate::enforceMaxLength(ll_lengths.data(), deflate::SS_TABLE_SIZE, deflate::MAX_CODE_LENGTH);
+        deflate::HuffmanCodes(counts.distCounts, deflate::DIST_TABLE_SIZE, dist_lengths.data());
+        deflate::enforceMaxLength(dist_lengths.data(), deflate::DIST_TABLE_SIZE, deflate::MAX_CODE_LENGTH);
+    }
+    measure("cl symbols", "call", 1000, samples, [&]{
+        for(int i = 0; i < 1000; i++){
+            deflate::CLSymbolBuffer cl;
+            int cl_counts[deflate::CL_TABLE_SIZE] = {};
+            deflate::write_cl_symbol_stream(ll_lengths.data(), deflate::SS_TABLE_SIZE, cl, cl_counts);
+            deflate::write_cl_symbol_stream(dist_lengths.data(), deflate::DIST_TABLE_SIZE, cl, cl_counts);
+            sink = cl_counts[0];
+        }
+    });
+
+    std::vector<u8> out;
+    out.reserve(1 << 20);
+    for(int type: {1, 2}){
+        measure(type == 1 ? "emit fixed" : "emit dynamic", "symbol", symbols.size(), samples, [&]{
+            out.clear();
+            OutputBitStream stream {out};
+            deflate::SymbolCounts block_counts = counts;
+            deflate::write_block(stream, symbols.data(), symbols.size(), block_counts, true, type);
+            stream.flush_to_byte();
+            sink = out.size();
+        });
+    }
+
+    std::vector<u32> values(1 << 16), widths(1 << 16);
+    Random random;
+    for(size_t i = 0; i < values.size(); i++){
+        widths[i] = 1 + random.below(16);
+        values[i] = random.next() & ((1u << widths[i]) - 1);
+    }
+    measure("push_bits", "call", values.size(), samples, [&]{
+        out.clear();
+        OutputBitStream stream {out};
+        for(size_t i = 0; i < values.size(); i++)
+            stream.push_bits(values[i], widths[i]);
+        stream.flush_to_byte();
+        sink = out.size();
+    });
+
+    std::vector<u8> crc_data = make_text(1 << 22);
+    measure("crc32", "byte", crc_data.size(), samples, [&]{
+        sink = crc32::update(0, crc_data.data(), crc_data.size());
+    });
+
+    for(int i = 0; i < cpu::NUM_LEVELS; i++){
+        auto level = (cpu::Level)i;
+        if (!cpu::supported(level))
+            continue;
+        cpu::select(level);
+        std::string name = std::string{"match "} + cpu::name(level);
+        measure(name.c_str(), "byte", TEXT_SIZE, samples, [&]{
+            compressor.reset();
+            compressor.compress(text.data(), text.size());
+            sink = compressor.total_in();
+        });
+    }
+    for(int i = 0; i < cpu::NUM_LEVELS; i++){
+        auto level = (cpu::Level)i;
+        if (!cpu::supported(level))
+            continue;
+        auto crc32_update = cpu::bind(level).crc32;
+        std::string name = std::string{"crc32 "} + cpu::name(level);
+        measure(name.c_str(), "byte", crc_data.size(), samples, [&]{
+            sink = crc32_update(0, crc_data.data(), crc_data.size());
+        });
+    }
+    return 0;
+}
@@ -0,0 +1,256 @@
+/* pipebench.cpp
+
+   The cost of getting compressed output into a pipe, with write() (--io
+   sync) against vmsplice() (--io splice). A pipeline::Pipeline compresses
+   a synthetic input held in memory (a memfd, so reading it costs the same
+   either way) to a pipe, which a child process reads and throws away as
+   fast as it can, and the benchmark reports the wall time, the rate of
+   compressed output, and the user and system CPU time of the compressing
+   process (all three of its threads).
+
+   The input is random letters from a small alphabet: no matches worth
+   finding, so the parser runs at full speed and the output is about three
+   quarters of the input, which is as fast as this compressor produces
+   output. The saving from vmsplice is in system time, and it grows with
+   the output rate, so the fastest configuration shows it best.
+
+   A second table leaves the compressor out: the same pipe and reader,
+   fed 256 KiB chunks of the input as fast as write() or vmsplice() will
+   take them, which is what the two cost at rates the compressor does not
+   reach yet. Its vmsplice() loop reuses a chunk's buffer only once the
+   reader has taken it, as the pipeline does.
+
+   The child also counts the bytes it receives and their CRC-32, and a run
+   whose output differs from the write() run's is reported as a failure:
+   a buffer reused before the pipe's reader had taken it would show up
+   here.
+
+   Usage: ./pipebench [--size MB] [--repeat N]
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "crc32.hpp"
+#include "pipeline.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+struct Config {
+    std::string name;
+    int window_bits;
+    int mem_level;
+};
+
+const std::vector<Config> CONFIGS {
+    {"--window-bits 9 --mem-level 1", 9, 1},
+    {"defaults", deflate::MAX_WINDOW_BITS, deflate::MAX_MEM_LEVEL},
+};
+
+/* What the reading end of the pipe saw */
+struct Received {
+    u64 bytes;
+    u32 crc;
+};
+
+struct Run {
+    double seconds;
+    double user_seconds;
+    double sys_seconds;
+    Received received;
+};
+
+/* A memfd holding size bytes of random letters from a 32 letter alphabet */
+int make_input(size_t size){
+    int fd = memfd_create("pipebench", 0);
+    if (fd < 0){
+        std::perror("pipebench: memfd_create");
+        std::exit(1);
+    }
+    std::vector<char> data(size);
+    u64 state = 0x9e3779b97f4a7c15ull;
+    for(char& c: data){
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        c = 'A' + (state >> 59);
+    }
+    if (write(fd, data.data(), size) != (ssize_t)size){
+        std::perror("pipebench: write");
+        std::exit(1);
+    }
+    return fd;
+}
+
+/* Start a child which drains read_fd and sends back what it got on result_fd */
+pid_t start_reader(int read_fd, int write_fd, int result_fd){
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+    close(write_fd);
+    std::vector<char> buffer(1 << 16);
+    Received r {0, 0};
+    while (true){
+        ssize_t n = read(read_fd, buffer.data(), buffer.size());
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        r.bytes += n;
+        r.crc = crc32::update(r.crc, buffer.data(), n);
+    }
+    _exit(write(result_fd, &r, sizeof(r)) == sizeof(r) ? 0 : 1);
+}
+
+/* Send size bytes from input_fd to fd in chunks, copying or splicing, and
+   recycle four buffers the way the pipeline does */
+void transfer(int input_fd, size_t size, int fd, bool splice){
+    const size_t CHUNK = 1 << 18;
+    std::vector<u8> buffers[4];
+    u64 ends[4] {};
+    u64 sent = 0;
+    for(size_t i = 0; sent < size; i = (i + 1) % 4){
+        std::vector<u8>& b = buffers[i];
+        while (splice && ends[i] != 0){
+            int queued;
+            if (ioctl(fd, FIONREAD, &queued) == 0 && sent - queued >= ends[i])
+                break;
+            std::this_thread::sleep_for(std::chrono::microseconds(20));
+        }
+        b.resize(std::min<size_t>(CHUNK, size - sent));
+        if (pread(input_fd, b.data(), b.size(), sent) != (ssize_t)b.size()){
+            std::perror("pipebench: pread");
+            std::exit(1);
+        }
+        size_t done = 0;
+        while (done < b.size()){
+            iovec v {b.data() + done, b.size() - done};
+            ssize_t n = splice ? vmsplice(fd, &v, 1, 0) : write(fd, v.iov_base, v.iov_len);
+            if (n < 0 && errno != EINTR){
+                std::perror("pipebench: sending to the pipe");
+                std::exit(1);
+            }
+            if (n > 0)
+                done += n;
+        }
+        sent += b.size();
+        ends[i] = sent;
+    }
+    //The buffers are freed on return, so wait until the pipe no longer holds their pages
+    int queued;
+    while (splice && ioctl(fd, FIONREAD, &queued) == 0 && queued > 0)
+        std::this_thread::sleep_for(std::chrono::microseconds(20));
+}
+
+double seconds(timeval const& t){
+    return t.tv_sec + t.tv_usec / 1e6;
+}
+
+/* Time send(write_fd) while a child drains the pipe */
+template<typename Send>
+Run run(Send const& send){
+    int data[2], result[2];
+    if (pipe(data) != 0 || pipe(result) != 0){
+        std::perror("pipebench: pipe");
+        std::exit(1);
+    }
+    pid_t pid = start_reader(data[0], data[1], result[1]);
+    close(data[0]);
+    close(result[1]);
+
+    rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    auto t0 = Clock::now();
+    send(data[1]);
+    close(data[1]);
+    Run r;
+    bool ok = read(result[0], &r.received, sizeof(r.received)) == sizeof(r.received);
+    auto t1 = Clock::now();
+    getrusage(RUSAGE_SELF, &after);
+    int status;
+    waitpid(pid, &status, 0);
+    close(result[0]);
+    if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+        std::fprintf(stderr, "pipebench: the pipe's reader failed\n");
+        std::exit(1);
+    }
+    r.seconds = std::chrono::duration<double>(t1 - t0).count();
+    r.user_seconds = seconds(after.ru_utime) - seconds(before.ru_utime);
+    r.sys_seconds = seconds(after.ru_stime) - seconds(before.ru_stime);
+    return r;
+}
+
+double median(std::vector<double> v){
+    std::sort(v.begin(), v.end());
+    return v[v.size() / 2];
+}
+
+int main(int argc, char** argv){
+    size_t size_mb = 64;
+    int repeat = 3;
+    for(int i = 1; i < argc; i++){
+        std::string arg = argv[i];
+        if (arg == "--size" && i + 1 < argc){
+            size_mb = std::stoul(argv[++i]);
+        } else if (arg == "--repeat" && i + 1 < argc){
+            repeat = std::max(1, std::stoi(argv[++i]));
+        } else {
+            std::fprintf(stderr, "usage: %s [--size MB] [--repeat N]\n", argv[0]);
+            return 1;
+        }
+    }
+    int input_fd = make_input(size_mb << 20);
+
+    //Run send both ways, repeat times each, and print the medians; false if the output differs
+    auto measure = [&](std::string const& name, auto const& send){
+        Received expected {};
+        for(bool splice: {false, true}){
+            std::vector<double> wall, user, sys;
+            for(int i = 0; i < repeat; i++){
+                Run r = run([&](int fd){ send(fd, splice); });
+                if (!splice && i == 0){
+                    expected = r.received;
+                } else if (r.received.bytes != expected.bytes || r.received.crc != expected.crc){
+                    std::fprintf(stderr, "pipebench: the output of %s differs between runs\n", name.c_str());
+                    return false;
+                }
+                wall.push_back(r.seconds);
+                user.push_back(r.user_seconds);
+                sys.push_back(r.sys_seconds);
+            }
+            std::printf("%-32s %-8s %9.3f %10.1f %9.3f %9.3f\n", name.c_str(), splice ? "vmsplice" : "write",
+                median(wall), expected.bytes / 1e6 / median(wall), median(user), median(sys));
+        }
+        return true;
+    };
+
+    std::printf("%-32s %-8s %9s %10s %9s %9s\n", "compressing", "output", "seconds", "out MB/s", "user s", "sys s");
+    for(auto const& config: CONFIGS){
+        bool same = measure(config.name, [&](int fd, bool splice){
+            deflate::Compressor compressor {config.window_bits, config.mem_level};
+            pipeline::Pipeline pipeline {splice ? pipeline::Io::Splice : pipeline::Io::Sync};
+            lseek(input_fd, 0, SEEK_SET);
+            pipeline.compress(compressor, input_fd, fd);
+        });
+        if (!same)
+            return 1;
+    }
+    std::printf("\n%-32s %-8s %9s %10s %9s %9s\n", "transfer only", "output", "seconds", "out MB/s", "user s", "sys s");
+    for(size_t mb: {size_mb, 8 * size_mb}){
+        bool same = measure(std::to_string(mb) + " MB", [&](int fd, bool splice){
+            for(size_t done = 0; done < mb; done += size_mb)
+                transfer(input_fd, size_mb << 20, fd, splice);
+        });
+        if (!same)
+            return 1;
+    }
+    return 0;
+}
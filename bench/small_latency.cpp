@@ -0,0 +1,79 @@
+/* small_latency.cpp
+
+   Latency of compressing one small message: small_deflate::compress()
+   against a reset/compress/finish round of deflate::Compressor, for several
+   message sizes cut from the test corpus. Prints the median, 99th
+   percentile and mean time per message in nanoseconds.
+
+   Usage: ./small_latency [messages per size]
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "small_deflate.hpp"
+#include "deflate.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+std::vector<u8> read_file(const char* path){
+    std::ifstream f {path, std::ios::binary};
+    return {std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>()};
+}
+
+void report(const char* name, size_t size, std::vector<double>& ns, size_t compressed){
+    std::sort(ns.begin(), ns.end());
+    double mean = 0;
+    for(double v: ns)
+        mean += v;
+    mean /= ns.size();
+    std::printf("%-12s %6zu B  p50 %9.0f ns  p99 %9.0f ns  mean %9.0f ns  ratio %.2f\n",
+        name, size, ns[ns.size() / 2], ns[ns.size() * 99 / 100], mean, (double)size / compressed);
+}
+
+int main(int argc, char** argv){
+    size_t count = argc > 1 ? std::stoul(argv[1]) : 2000;
+    std::vector<u8> corpus;
+    for(const char* f: {"test_data/calgary_corpus/paper1", "test_data/calgary_corpus/progc",
+                        "test_data/canterbury_corpus/cp.html", "test_data/calgary_corpus/bib"}){
+        auto bytes = read_file(f);
+        corpus.insert(corpus.end(), bytes.begin(), bytes.end());
+    }
+    if (corpus.size() < 8192){
+        std::fprintf(stderr, "run from the repository root (needs test_data)\n");
+        return 1;
+    }
+
+    std::vector<u8> out(small_deflate::bound(small_deflate::MAX_INPUT));
+    deflate::Compressor compressor;
+    for(size_t size: {200, 1024, 4096}){
+        std::vector<double> fast, full;
+        size_t fast_bytes = 0;
+        size_t full_bytes = 0;
+        //One loop per compressor, so neither evicts the other's working set from the caches
+        for(size_t i = 0; i < count; i++){
+            const u8* msg = corpus.data() + (i * 7919) % (corpus.size() - size);
+            auto t0 = Clock::now();
+            size_t n = small_deflate::compress(msg, size, out.data(), out.size());
+            auto t1 = Clock::now();
+            fast.push_back(std::chrono::duration<double, std::nano>(t1 - t0).count());
+            fast_bytes += n;
+        }
+        for(size_t i = 0; i < count; i++){
+            const u8* msg = corpus.data() + (i * 7919) % (corpus.size() - size);
+            auto t0 = Clock::now();
+            compressor.reset();
+            compressor.compress(msg, size);
+            compressor.finish();
+            auto t1 = Clock::now();
+            full.push_back(std::chrono::duration<double, std::nano>(t1 - t0).count());
+            full_bytes += compressor.output_bytes().size();
+        }
+        report("small_deflate", size, fast, fast_bytes / count);
+        report("Compressor", size, full, full_bytes / count);
+    }
+    return 0;
+}
@@ -0,0 +1,118 @@
+/* bgzf.hpp
+
+   BGZF ("Blocked GNU Zip Format", as used by htslib/samtools/tabix) output.
+
+   BGZF is an ordinary multi-member gzip file where each member holds at most
+   64 KiB of input and compresses to at most 64 KiB, and records its own
+   compressed size in a "BC" extra field in the header. Readers can jump
+   straight to any member, and since members are independent they can be
+   compressed and decompressed in parallel. The file ends with a fixed empty
+   member as an EOF marker.
+
+   Each member is produced by a deflate::Compressor, then its plain 10 byte
+   gzip header is replaced by the 18 byte BGZF header. If the compressed
+   member would not fit in 64 KiB, the input is stored instead.
+*/
+
+#ifndef BGZF_HPP
+#define BGZF_HPP
+
+#include <vector>
+#include "deflate.hpp"
+
+namespace bgzf {
+
+/* Input bytes per member. Like htslib, leave room so that a stored member still fits in 64 KiB. */
+const size_t BLOCK_INPUT_SIZE = 0xff00;
+const size_t MAX_BLOCK_SIZE = 65536;
+
+const size_t GZIP_HEADER_SIZE = 10;
+const size_t BGZF_HEADER_SIZE = 18;
+const size_t TRAILER_SIZE = 8;
+
+/* The empty member that marks the end of a BGZF file */
+const u8 EOF_MARKER[28] = {
+    0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43, 0x02, 0x00,
+    0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+/* Append a BGZF member header for a member of block_size bytes in total */
+inline void push_header(std::vector<u8>& out, size_t block_size){
+    u16 bsize = block_size - 1;
+    const u8 header[BGZF_HEADER_SIZE] = {
+        0x1f, 0x8b, //Magic Number
+        0x08, //Compression (0x08 = DEFLATE)
+        0x04, //Flags (FEXTRA)
+        0x00, 0x00, 0x00, 0x00, //MTIME
+        0x00, //Extra flags
+        0xff, //OS (unknown, as htslib writes)
+        0x06, 0x00, //XLEN
+        'B', 'C', 0x02, 0x00, //Subfield "BC" of length 2
+        (u8)(bsize & 0xff), (u8)(bsize >> 8) //BSIZE (total member size - 1)
+    };
+    out.insert(out.end(), header, header + BGZF_HEADER_SIZE);
+}
+
+class BgzfWriter {
+public:
+    /* Feed more input; every full 0xff00 bytes becomes one member in output_bytes() */
+    void write(const u8* data, size_t size){
+        while (size > 0){
+            size_t n = std::min(size, BLOCK_INPUT_SIZE - pending.size());
+            pending.insert(pending.end(), data, data + n);
+            data += n;
+            size -= n;
+            if (pending.size() == BLOCK_INPUT_SIZE){
+                compress_block(pending.data(), pending.size(), out_bytes);
+                pending.clear();
+            }
+        }
+    }
+
+    /* Write out the last partial member and the EOF marker */
+    void finish(){
+        if (!pending.empty())
+            compress_block(pending.data(), pending.size(), out_bytes);
+        pending.clear();
+        out_bytes.insert(out_bytes.end(), EOF_MARKER, EOF_MARKER + sizeof(EOF_MARKER));
+    }
+
+    /* Compressed bytes produced so far. The caller may write them out and clear the vector at any time. */
+    std::vector<u8>& output_bytes(){
+        return out_bytes;
+    }
+
+    /* Compress one member (size <= BLOCK_INPUT_SIZE) independently of everything else, appending it to out */
+    void compress_block(const u8* data, size_t size, std::vector<u8>& out){
+        compressor.reset();
+        compressor.compress(data, size);
+        compressor.finish();
+        auto const& member = compressor.output_bytes();
+        size_t body = member.size() - GZIP_HEADER_SIZE;
+        if (BGZF_HEADER_SIZE + body <= MAX_BLOCK_SIZE){
+            push_header(out, BGZF_HEADER_SIZE + body);
+            out.insert(out.end(), member.begin() + GZIP_HEADER_SIZE, member.end());
+            return;
+        }
+
+        //Incompressible input: store it
+        std::vector<u8> stored;
+        {
+            OutputBitStream stream {stored};
+            deflate::write_stored_block(stream, data, size, true);
+            stream.push_u32(compressor.crc32());
+            stream.push_u32(size);
+        }
+        push_header(out, BGZF_HEADER_SIZE + stored.size());
+        out.insert(out.end(), stored.begin(), stored.end());
+    }
+
+private:
+    deflate::Compressor compressor;
+    std::vector<u8> pending;
+    std::vector<u8> out_bytes;
+};
+
+}
+
+#endif
@@ -0,0 +1,206 @@
+/* compress_stats.hpp
+
+   Counters describing what the compressor did with its input, for tuning
+   its parameters on real data (gzcomp --stats). A Compressor given a Stats
+   with set_stats() runs a separate instantiation of its parse loop which
+   updates the counters; without one, the counting code is not compiled
+   into the loop at all.
+
+   The counters cover the match finder (positions hashed, lookups, and how
+   many chain candidates each lookup examined), the parse (literals and
+   matches, with histograms of match length and distance code), every block
+   written (its type, symbols, and header and payload bits), and the time
+   spent in each stage: match finding (the parse), building a block's
+   Huffman codes and header, emitting its symbols, and computing the
+   checksum. With count_events(), each stage also gets the hardware events
+   it caused (see perf_counters.hpp), which are reported per MB of input.
+   A compressor with a target rate also says how much of the input it
+   compressed at each effort, and how often it changed effort.
+   write_json() prints them all as one JSON object.
+*/
+
+#ifndef COMPRESS_STATS_HPP
+#define COMPRESS_STATS_HPP
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "deflate_tables.hpp"
+#include "perf_counters.hpp"
+
+namespace compress_stats {
+
+using u32 = std::uint32_t;
+using u64 = std::uint64_t;
+
+/* Where the compressor's time goes. Time outside the other stages (copying
+   output, and the caller's own work between calls) is charged to OTHER,
+   which is not reported. */
+enum Stage { OTHER, MATCH_FINDING, HUFFMAN, EMIT, CHECKSUM, NUM_STAGES };
+
+const char* const STAGE_NAMES[NUM_STAGES] {"other", "match_finding", "huffman", "emit", "checksum"};
+
+/* Candidate counts are bucketed by powers of two: 0, 1, 2-3, 4-7, ... */
+const u32 CANDIDATE_BUCKETS = 18;
+
+struct Block {
+    u32 type;           //1 = fixed Huffman codes, 2 = dynamic
+    u64 symbols;        //literals, lengths and distances
+    u64 header_bits;    //block type and (for type 2) the code description
+    u64 payload_bits;   //the symbols and end of block code
+};
+
+struct Stats {
+    u64 bytes_in {0};
+    u64 positions_hashed {0};
+    u64 lookups {0};
+    u64 candidates {0};
+    std::array<u64, CANDIDATE_BUCKETS> candidates_per_lookup {};
+    u64 literals {0};
+    u64 matches {0};
+    std::array<u64, deflate_tables::MAX_MATCH + 1> match_lengths {};
+    std::array<u64, deflate_tables::NUM_DIST_CODES> distance_codes {};
+    std::vector<Block> blocks;
+    std::vector<u64> effort_bytes;  //with a target (Compressor::set_target_mbps), the input compressed at each effort
+    u64 effort_changes {0};
+    std::array<double, NUM_STAGES> seconds {};
+    std::array<perf_counters::Values, NUM_STAGES> events {};
+
+    /* Also count hardware events per stage, from now on. Returns false if
+       none of the counters can be read on this machine. */
+    bool count_events(){
+        counters = std::make_unique<perf_counters::Counters>();
+        last_events = counters->read();
+        return counters->any_available();
+    }
+
+    /* Whether counter c is being counted (after count_events()) */
+    bool event_available(perf_counters::Counter c) const {
+        return counters && counters->available(c);
+    }
+
+    /* Charge everything since the last switch to the current stage, and
+       move on to stage s. Returns the stage left, for switching back. */
+    Stage enter(Stage s){
+        auto now = Clock::now();
+        seconds[stage] += std::chrono::duration<double>(now - last_time).count();
+        last_time = now;
+        if (counters){
+            auto now_events = counters->read();
+            for(int c = 0; c < perf_counters::NUM_COUNTERS; c++)
+                events[stage][c] += now_events[c] - last_events[c];
+            last_events = now_events;
+        }
+        Stage left = stage;
+        stage = s;
+        return left;
+    }
+
+    void count_lookup(u32 examined){
+        lookups++;
+        candidates += examined;
+        u32 bucket = examined == 0 ? 0 : 32 - __builtin_clz(examined);
+        candidates_per_lookup[bucket < CANDIDATE_BUCKETS ? bucket : CANDIDATE_BUCKETS - 1]++;
+    }
+
+    void write_json(std::ostream& out) const {
+        u64 header_bits = 0;
+        u64 payload_bits = 0;
+        for(auto const& b: blocks){
+            header_bits += b.header_bits;
+            payload_bits += b.payload_bits;
+        }
+        out << "{\n";
+        out << "  \"bytes_in\": " << bytes_in << ",\n";
+        out << "  \"positions_hashed\": " << positions_hashed << ",\n";
+        out << "  \"lookups\": " << lookups << ",\n";
+        out << "  \"candidates_examined\": " << candidates << ",\n";
+        out << "  \"candidates_per_lookup\": {";
+        bool first = true;
+        for(u32 i = 0; i < CANDIDATE_BUCKETS; i++){
+            if (candidates_per_lookup[i] == 0)
+                continue;
+            std::string range = i <= 1 ? std::to_string(i) : std::to_string(1u << (i - 1)) + "-"
+                + (i + 1 < CANDIDATE_BUCKETS ? std::to_string((1u << i) - 1) : "");
+            out << (first ? "" : ", ") << "\"" << range << "\": " << candidates_per_lookup[i];
+            first = false;
+        }
+        out << "},\n";
+        out << "  \"literals\": " << literals << ",\n";
+        out << "  \"matches\": " << matches << ",\n";
+        out << "  \"match_lengths\": {";
+        first = true;
+        for(u32 length = deflate_tables::MIN_MATCH; length <= deflate_tables::MAX_MATCH; length++){
+            if (match_lengths[length] == 0)
+                continue;
+            out << (first ? "" : ", ") << "\"" << length << "\": " << match_lengths[length];
+            first = false;
+        }
+        out << "},\n";
+        out << "  \"match_distances\": {";
+        first = true;
+        for(u32 code = 0; code < deflate_tables::NUM_DIST_CODES; code++){
+            if (distance_codes[code] == 0)
+                continue;
+            u32 low = deflate_tables::dist_base[code];
+            u32 high = low + (1u << deflate_tables::dist_extra[code]) - 1;
+            out << (first ? "" : ", ") << "\"" << low << (high > low ? "-" + std::to_string(high) : "") << "\": " << distance_codes[code];
+            first = false;
+        }
+        out << "},\n";
+        out << "  \"block_count\": " << blocks.size() << ",\n";
+        out << "  \"header_bits\": " << header_bits << ",\n";
+        out << "  \"payload_bits\": " << payload_bits << ",\n";
+        out << "  \"blocks\": [";
+        for(size_t i = 0; i < blocks.size(); i++){
+            auto const& b = blocks[i];
+            out << (i ? "," : "") << "\n    {\"type\": " << b.type << ", \"symbols\": " << b.symbols
+                << ", \"header_bits\": " << b.header_bits << ", \"payload_bits\": " << b.payload_bits << "}";
+        }
+        out << (blocks.empty() ? "" : "\n  ") << "],\n";
+        out << "  \"seconds\": {";
+        for(int s = MATCH_FINDING; s < NUM_STAGES; s++)
+            out << (s == MATCH_FINDING ? "" : ", ") << "\"" << STAGE_NAMES[s] << "\": " << seconds[s];
+        out << "}";
+        if (counters){
+            //null for the counters this machine does not have
+            double mb = bytes_in / 1e6;
+            out << ",\n  \"events_per_mb\": {";
+            for(int s = MATCH_FINDING; s < NUM_STAGES; s++){
+                out << (s == MATCH_FINDING ? "" : ",") << "\n    \"" << STAGE_NAMES[s] << "\": {";
+                for(int c = 0; c < perf_counters::NUM_COUNTERS; c++){
+                    out << (c ? ", " : "") << "\"" << perf_counters::NAMES[c] << "\": ";
+                    if (event_available((perf_counters::Counter)c) && mb > 0)
+                        out << (u64)(events[s][c] / mb + 0.5);
+                    else
+                        out << "null";
+                }
+                out << "}";
+            }
+            out << "\n  }";
+        }
+        if (!effort_bytes.empty()){
+            out << ",\n  \"effort_changes\": " << effort_changes << ",\n  \"effort_bytes\": [";
+            for(size_t i = 0; i < effort_bytes.size(); i++)
+                out << (i ? ", " : "") << effort_bytes[i];
+            out << "]";
+        }
+        out << "\n}\n";
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    std::unique_ptr<perf_counters::Counters> counters;
+    Stage stage {OTHER};
+    Clock::time_point last_time {Clock::now()};
+    perf_counters::Values last_events {};
+};
+
+}
+
+#endif
@@ -0,0 +1,216 @@
+/* cpu_dispatch.hpp
+
+   Picking the SIMD kernels for the CPU the program runs on. The binary is
+   built for the baseline instruction set, and the kernels which gain from
+   wider vectors are compiled a second (and third...) time for the newer
+   ones with target attributes. detect() asks CPUID, through GCC's
+   __builtin_cpu_supports(), which of the levels below the machine (and the
+   kernel, for the AVX register state) supports, and kernels() binds a table
+   of function pointers to the best of them the first time it is called.
+   select() rebinds it to a lower level, which is what gzcomp --cpu does, so
+   that every path can be tested and timed on one machine.
+
+     generic   plain C++, the same code as before there was a choice
+     sse4      SSE4.2 and PCLMULQDQ: 16 byte match comparison, CRC-32 by
+               carry-less multiplication
+     avx2      AVX2: 32 byte match comparison
+     avx512    AVX-512BW: 64 byte match comparison with masked loads for
+               the tail, and CRC-32 with the 512 bit VPCLMULQDQ where the
+               CPU has it
+
+   Every kernel gives exactly the same result at every level, so the
+   compressed output does not depend on the machine. That is also why the
+   hash of the match finder is not here: a hash made of a CRC instruction
+   would change which positions collide, and with them the output.
+
+   The table is set up before any threads are started and only read after
+   that. Callers in a hot loop copy the pointer they need rather than going
+   through kernels() every time.
+*/
+
+#ifndef CPU_DISPATCH_HPP
+#define CPU_DISPATCH_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include "crc32.hpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CPU_DISPATCH_X86 1
+#endif
+
+namespace cpu {
+
+using u8 = std::uint8_t;
+using u32 = std::uint32_t;
+using u64 = std::uint64_t;
+
+enum class Level { Generic, SSE4, AVX2, AVX512 };
+
+const int NUM_LEVELS = 4;
+const char* const NAMES[NUM_LEVELS] {"generic", "sse4", "avx2", "avx512"};
+
+inline const char* name(Level level){
+    return NAMES[(int)level];
+}
+
+/* The level called name, false if there is none */
+inline bool parse(std::string const& name, Level& level){
+    for(int i = 0; i < NUM_LEVELS; i++){
+        if (name == NAMES[i]){
+            level = (Level)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool supported(Level level){
+#ifdef CPU_DISPATCH_X86
+    __builtin_cpu_init();
+    switch (level){
+    case Level::AVX512:
+        if (!__builtin_cpu_supports("avx512f") || !__builtin_cpu_supports("avx512bw"))
+            return false;
+        [[fallthrough]];
+    case Level::AVX2:
+        if (!__builtin_cpu_supports("avx2"))
+            return false;
+        [[fallthrough]];
+    case Level::SSE4:
+        return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+    case Level::Generic:
+        return true;
+    }
+    return false;
+#else
+    return level == Level::Generic;
+#endif
+}
+
+/* The highest level this machine supports */
+inline Level detect(){
+    for(int i = NUM_LEVELS - 1; i > 0; i--){
+        if (supported((Level)i))
+            return (Level)i;
+    }
+    return Level::Generic;
+}
+
+/* Length of the common prefix of a and b, up to limit bytes, from n on */
+inline u32 match_length_from(const u8* a, const u8* b, u32 n, u32 limit){
+    while (n + 8 <= limit){
+        u64 x, y;
+        std::memcpy(&x, a + n, 8);
+        std::memcpy(&y, b + n, 8);
+        if (x != y)
+            return n + (__builtin_ctzll(x ^ y) >> 3);
+        n += 8;
+    }
+    while (n < limit && a[n] == b[n])
+        n++;
+    return n;
+}
+
+inline u32 match_length_generic(const u8* a, const u8* b, u32 limit){
+    return match_length_from(a, b, 0, limit);
+}
+
+#ifdef CPU_DISPATCH_X86
+
+__attribute__((target("sse4.2")))
+inline u32 match_length_sse4(const u8* a, const u8* b, u32 limit){
+    u32 n = 0;
+    for(; n + 16 <= limit; n += 16){
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + n));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + n));
+        u32 equal = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+        if (equal != 0xffff)
+            return n + __builtin_ctz(~equal);
+    }
+    return match_length_from(a, b, n, limit);
+}
+
+__attribute__((target("avx2")))
+inline u32 match_length_avx2(const u8* a, const u8* b, u32 limit){
+    u32 n = 0;
+    for(; n + 32 <= limit; n += 32){
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + n));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b + n));
+        u32 equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (equal != 0xffffffff)
+            return n + __builtin_ctz(~equal);
+    }
+    return match_length_from(a, b, n, limit);
+}
+
+/* The tail is compared with masked loads, which do not touch the bytes
+   past limit, so there is no scalar loop at all */
+__attribute__((target("avx512f,avx512bw")))
+inline u32 match_length_avx512(const u8* a, const u8* b, u32 limit){
+    u32 n = 0;
+    for(; n + 64 <= limit; n += 64){
+        u64 differ = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(a + n), _mm512_loadu_si512(b + n));
+        if (differ)
+            return n + __builtin_ctzll(differ);
+    }
+    if (n < limit){
+        __mmask64 rest = ((u64)1 << (limit - n)) - 1;
+        u64 differ = _mm512_mask_cmpneq_epi8_mask(rest, _mm512_maskz_loadu_epi8(rest, a + n), _mm512_maskz_loadu_epi8(rest, b + n));
+        if (differ)
+            return n + __builtin_ctzll(differ);
+    }
+    return limit;
+}
+
+#endif
+
+/* The kernels of one level */
+struct Kernels {
+    Level level;
+    u32 (*match_length)(const u8* a, const u8* b, u32 limit);
+    u32 (*crc32)(u32 crc, const void* data, size_t size);
+};
+
+inline Kernels bind(Level level){
+    Kernels k {level, match_length_generic, crc32::update};
+#ifdef CPU_DISPATCH_X86
+    switch (level){
+    case Level::AVX512:
+        k.match_length = match_length_avx512;
+        k.crc32 = __builtin_cpu_supports("vpclmulqdq") ? crc32::update_vpclmul : crc32::update_clmul;
+        break;
+    case Level::AVX2:
+        k.match_length = match_length_avx2;
+        k.crc32 = crc32::update_clmul;
+        break;
+    case Level::SSE4:
+        k.match_length = match_length_sse4;
+        k.crc32 = crc32::update_clmul;
+        break;
+    case Level::Generic:
+        break;
+    }
+#endif
+    return k;
+}
+
+/* The kernels in use: the best the CPU has, unless select() said otherwise */
+inline Kernels& kernels(){
+    static Kernels k = bind(detect());
+    return k;
+}
+
+/* Use the kernels of level from now on. Throws if the CPU lacks it. */
+inline void select(Level level){
+    if (!supported(level))
+        throw std::runtime_error{std::string{"this CPU does not support --cpu "} + name(level)};
+    kernels() = bind(level);
+}
+
+}
+
+#endif
@@ -0,0 +1,239 @@
+/* crc32.hpp
+
+   CRC-32 (the gzip checksum) with tables generated at compile time.
+
+   update() uses "slicing by 8": eight 256 entry tables, where table k gives
+   the CRC contribution of a byte followed by k zero bytes, so eight input
+   bytes are folded into the CRC per step with eight independent lookups
+   instead of eight dependent ones.
+
+   update_clmul() and update_vpclmul() get the same result with carry-less
+   multiplication (PCLMULQDQ, and its 512 bit form from AVX-512), by the
+   folding method of Gopal et al., "Fast CRC Computation for Generic
+   Polynomials Using PCLMULQDQ Instruction" (Intel, 2009): the data is
+   folded 64 or 256 bytes at a time into four independent 128 bit (or 512
+   bit) remainders, which are folded into one and reduced to 32 bits at the
+   end. Whatever does not fill a whole 16 bytes goes through the tables.
+   They are only compiled for x86, and only safe to call on a CPU which has
+   the instructions; cpu_dispatch.hpp decides which one runs.
+
+   crc32::combine() computes the CRC of the concatenation A+B from crc(A),
+   crc(B) and the length of B, without touching the data (the method used by
+   zlib: multiplying crc(A) by x^(8*len(B)) modulo the CRC polynomial). This
+   lets pieces of a stream be checksummed independently, e.g. on different
+   threads, and the results be stitched together afterwards.
+*/
+
+#ifndef CRC32_HPP
+#define CRC32_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_CLMUL 1
+#endif
+
+namespace crc32 {
+
+using u32 = std::uint32_t;
+using u64 = std::uint64_t;
+
+const u32 POLY = 0xedb88320; //reflected CRC-32 polynomial
+
+using Tables = std::array<std::array<u32, 256>, 8>;
+
+constexpr Tables make_tables(){
+    Tables t {};
+    for(u32 i = 0; i < 256; i++){
+        u32 c = i;
+        for(int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+        t[0][i] = c;
+    }
+    for(u32 i = 0; i < 256; i++)
+        for(int k = 1; k < 8; k++)
+            t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+    return t;
+}
+inline constexpr Tables tables = make_tables();
+
+/* The table loop, on the CRC register itself (the complement of the CRC) */
+inline u32 update_tables(u32 crc, const std::uint8_t* p, size_t size){
+    while (size >= 8){
+        u32 lo, hi;
+        std::memcpy(&lo, p, 4);
+        std::memcpy(&hi, p + 4, 4);
+        lo ^= crc; //(assumes a little endian host)
+        crc = tables[7][lo & 0xff] ^ tables[6][(lo >> 8) & 0xff] ^ tables[5][(lo >> 16) & 0xff] ^ tables[4][lo >> 24]
+            ^ tables[3][hi & 0xff] ^ tables[2][(hi >> 8) & 0xff] ^ tables[1][(hi >> 16) & 0xff] ^ tables[0][hi >> 24];
+        p += 8;
+        size -= 8;
+    }
+    while (size--)
+        crc = (crc >> 8) ^ tables[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+/* Continue a running CRC over size more bytes */
+inline u32 update(u32 crc, const void* data, size_t size){
+    return ~update_tables(~crc, (const std::uint8_t*)data, size);
+}
+
+#ifdef CRC32_CLMUL
+
+/* Folding constants: x^(D+32) and x^(D-32) modulo the polynomial, bit
+   reflected and shifted left by one, fold a 128 bit remainder forward by D
+   bits. K5 takes 64 bits down to 32 and BARRETT is the polynomial and its
+   quotient for the final reduction. */
+const u64 FOLD_2048[2] {0x11542778a, 0x1322d1430};
+const u64 FOLD_512[2] {0x154442bd4, 0x1c6e41596};
+const u64 FOLD_384[2] {0x03db1ecdc, 0x174359406};
+const u64 FOLD_256[2] {0x0f1da05aa, 0x15a546366};
+const u64 FOLD_128[2] {0x1751997d0, 0x0ccaa009e};
+const u64 K5 = 0x163cd6124;
+const u64 BARRETT[2] {0x1db710641, 0x1f7011641};
+
+/* One folding step: x moved forward by the distance k is for */
+__attribute__((target("sse4.1,pclmul")))
+inline __m128i fold_128(__m128i x, __m128i k){
+    return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11));
+}
+
+/* Fold the 16 byte blocks at p into the remainder x, reduce it to the CRC
+   register and finish the remaining bytes with the tables */
+__attribute__((target("sse4.1,pclmul")))
+inline u32 finish_clmul(__m128i x, const std::uint8_t* p, size_t size){
+    const __m128i k128 = _mm_set_epi64x(FOLD_128[1], FOLD_128[0]);
+    for(; size >= 16; p += 16, size -= 16)
+        x = _mm_xor_si128(fold_128(x, k128), _mm_loadu_si128((const __m128i*)p));
+
+    //128 bits to 64, then to 32 (with the 32 zero bits the CRC appends)
+    const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x = _mm_xor_si128(_mm_srli_si128(x, 8), _mm_clmulepi64_si128(x, k128, 0x10));
+    x = _mm_xor_si128(_mm_srli_si128(x, 4), _mm_clmulepi64_si128(_mm_and_si128(x, low32), _mm_cvtsi64_si128(K5), 0x00));
+
+    //Barrett reduction
+    const __m128i barrett = _mm_set_epi64x(BARRETT[1], BARRETT[0]);
+    __m128i t = _mm_clmulepi64_si128(_mm_and_si128(x, low32), barrett, 0x10);
+    t = _mm_clmulepi64_si128(_mm_and_si128(t, low32), barrett, 0x00);
+    u32 crc = _mm_extract_epi32(_mm_xor_si128(x, t), 1);
+    return update_tables(crc, p, size);
+}
+
+/* update() with PCLMULQDQ, four 128 bit remainders at a time */
+__attribute__((target("sse4.1,pclmul")))
+inline u32 update_clmul(u32 crc, const void* data, size_t size){
+    const std::uint8_t* p = (const std::uint8_t*)data;
+    if (size < 64)
+        return ~update_tables(~crc, p, size);
+    __m128i x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)p), _mm_cvtsi32_si128(~crc));
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(p + 16));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(p + 32));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(p + 48));
+    const __m128i k512 = _mm_set_epi64x(FOLD_512[1], FOLD_512[0]);
+    for(p += 64, size -= 64; size >= 64; p += 64, size -= 64){
+        x0 = _mm_xor_si128(fold_128(x0, k512), _mm_loadu_si128((const __m128i*)p));
+        x1 = _mm_xor_si128(fold_128(x1, k512), _mm_loadu_si128((const __m128i*)(p + 16)));
+        x2 = _mm_xor_si128(fold_128(x2, k512), _mm_loadu_si128((const __m128i*)(p + 32)));
+        x3 = _mm_xor_si128(fold_128(x3, k512), _mm_loadu_si128((const __m128i*)(p + 48)));
+    }
+    const __m128i k128 = _mm_set_epi64x(FOLD_128[1], FOLD_128[0]);
+    x1 = _mm_xor_si128(fold_128(x0, k128), x1);
+    x2 = _mm_xor_si128(fold_128(x1, k128), x2);
+    x3 = _mm_xor_si128(fold_128(x2, k128), x3);
+    return ~finish_clmul(x3, p, size);
+}
+
+/* The same for each of the four 128 bit lanes of x */
+__attribute__((target("avx512f,vpclmulqdq")))
+inline __m512i fold_512(__m512i x, __m512i k){
+    return _mm512_xor_si512(_mm512_clmulepi64_epi128(x, k, 0x00), _mm512_clmulepi64_epi128(x, k, 0x11));
+}
+
+/* update() with 512 bit carry-less multiplies (AVX-512 VPCLMULQDQ): four
+   512 bit remainders, 256 bytes at a time */
+__attribute__((target("avx512f,vpclmulqdq,pclmul")))
+inline u32 update_vpclmul(u32 crc, const void* data, size_t size){
+    const std::uint8_t* p = (const std::uint8_t*)data;
+    if (size < 256)
+        return update_clmul(crc, data, size);
+    __m512i x0 = _mm512_xor_si512(_mm512_loadu_si512(p), _mm512_castsi128_si512(_mm_cvtsi32_si128(~crc)));
+    __m512i x1 = _mm512_loadu_si512(p + 64);
+    __m512i x2 = _mm512_loadu_si512(p + 128);
+    __m512i x3 = _mm512_loadu_si512(p + 192);
+    const __m512i k2048 = _mm512_set_epi64(FOLD_2048[1], FOLD_2048[0], FOLD_2048[1], FOLD_2048[0], FOLD_2048[1], FOLD_2048[0], FOLD_2048[1], FOLD_2048[0]);
+    for(p += 256, size -= 256; size >= 256; p += 256, size -= 256){
+        x0 = _mm512_xor_si512(fold_512(x0, k2048), _mm512_loadu_si512(p));
+        x1 = _mm512_xor_si512(fold_512(x1, k2048), _mm512_loadu_si512(p + 64));
+        x2 = _mm512_xor_si512(fold_512(x2, k2048), _mm512_loadu_si512(p + 128));
+        x3 = _mm512_xor_si512(fold_512(x3, k2048), _mm512_loadu_si512(p + 192));
+    }
+    const __m512i k512 = _mm512_set_epi64(FOLD_512[1], FOLD_512[0], FOLD_512[1], FOLD_512[0], FOLD_512[1], FOLD_512[0], FOLD_512[1], FOLD_512[0]);
+    x1 = _mm512_xor_si512(fold_512(x0, k512), x1);
+    x2 = _mm512_xor_si512(fold_512(x1, k512), x2);
+    x3 = _mm512_xor_si512(fold_512(x2, k512), x3);
+    for(; size >= 64; p += 64, size -= 64)
+        x3 = _mm512_xor_si512(fold_512(x3, k512), _mm512_loadu_si512(p));
+
+    //The four 128 bit lanes are 48, 32, 16 and 0 bytes from the end
+    __m128i lanes[4];
+    _mm512_storeu_si512(lanes, x3);
+    __m128i x = lanes[3];
+    x = _mm_xor_si128(x, fold_128(lanes[0], _mm_set_epi64x(FOLD_384[1], FOLD_384[0])));
+    x = _mm_xor_si128(x, fold_128(lanes[1], _mm_set_epi64x(FOLD_256[1], FOLD_256[0])));
+    x = _mm_xor_si128(x, fold_128(lanes[2], _mm_set_epi64x(FOLD_128[1], FOLD_128[0])));
+    return ~finish_clmul(x, p, size);
+}
+
+#endif
+
+/* a*b modulo the polynomial, with both in reflected bit order */
+constexpr u32 multmodp(u32 a, u32 b){
+    u32 m = (u32)1 << 31;
+    u32 p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+    }
+    return p;
+}
+
+/* x2n_table[k] = x^(2^k) modulo the polynomial */
+constexpr std::array<u32, 32> make_x2n_table(){
+    std::array<u32, 32> t {};
+    u32 p = (u32)1 << 30; //x^1
+    t[0] = p;
+    for(int n = 1; n < 32; n++)
+        t[n] = p = multmodp(p, p);
+    return t;
+}
+constexpr std::array<u32, 32> x2n_table = make_x2n_table();
+
+/* x^(n * 2^k) modulo the polynomial */
+constexpr u32 x2nmodp(u64 n, unsigned k){
+    u32 p = (u32)1 << 31; //x^0 == 1
+    while (n) {
+        if (n & 1)
+            p = multmodp(x2n_table[k & 31], p);
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+/* CRC of A followed by B, given crc1 = crc(A), crc2 = crc(B) and len2 = length of B */
+constexpr u32 combine(u32 crc1, u32 crc2, u64 len2){
+    return multmodp(x2nmodp(len2, 3), crc1) ^ crc2;
+}
+
+}
+
+#endif
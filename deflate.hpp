@@ -0,0 +1,1654 @@
+/* deflate.hpp
+
+   The gzcomp compressor: an LZ77 parser over a sliding window with hash chains,
+   followed by dynamic Huffman coding of each block (RFC 1951), wrapped in a
+   gzip member (RFC 1952), a zlib stream (RFC 1950), or nothing at all.
+
+   The Compressor class is streaming. Input is fed in with compress() as it
+   arrives, and the compressed bytes accumulate in output(), which the caller
+   drains as it likes. finish() ends the stream.
+
+   (As in output_stream.hpp, everything is inline in this header.)
+*/
+
+#ifndef DEFLATE_HPP
+#define DEFLATE_HPP
+
+#include <iostream>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include "arena.hpp"
+#include "output_stream.hpp"
+#include "deflate_tables.hpp"
+#include "gzindex.hpp"
+#include "crc32.hpp"
+#include "cpu_dispatch.hpp"
+#include "adler32.hpp"
+#include "compress_stats.hpp"
+#include "trace.hpp"
+
+namespace deflate {
+
+// BELOW is huffman tree code from https://www.geeksforgeeks.org/huffman-coding-greedy-algo-3/ adapted for use here. 
+// I use it to compute just the lengths. The nodes and the heap live on the stack rather than the free store.
+
+// A Huffman tree node 
+struct MinHeapNode { 
+
+	// One of the input characters 
+	int data; 
+
+	// Frequency of the character 
+	unsigned freq; 
+
+	// Left and right child 
+	MinHeapNode *left, *right; 
+
+	MinHeapNode() = default;
+
+	MinHeapNode(int data, unsigned freq) 
+
+	{ 
+
+		left = right = NULL; 
+		this->data = data; 
+		this->freq = freq; 
+	} 
+}; 
+
+//At most SS_TABLE_SIZE leaves, so fewer internal nodes than that
+const int MAX_HUFFMAN_SYMBOLS = 286;
+
+// For comparison of 
+// two heap nodes (needed in min heap) 
+struct compare { 
+
+	bool operator()(MinHeapNode* l, MinHeapNode* r) 
+
+	{ 
+		return (l->freq > r->freq); 
+	} 
+}; 
+
+// Prints huffman codes from 
+// the root of Huffman Tree. 
+inline void printCodes(struct MinHeapNode* root, int height, u32* result) 
+{ 
+
+	if (!root) 
+		return; 
+
+
+	if (root->data != -1) {
+        if(height == 0){
+            result[root->data] = 1;
+        } else {
+            result[root->data] = height;
+        }
+	}
+		 
+
+	printCodes(root->left, height + 1, result); 
+	printCodes(root->right, height + 1, result); 
+} 
+
+// The main function that builds a Huffman Tree and 
+// print codes by traversing the built Huffman Tree 
+inline void HuffmanCodes(int freq[], int size, u32* result) 
+{ 
+	struct MinHeapNode *left, *right, *top; 
+
+	// Create a min heap & inserts all characters of data[] 
+	// (the heap operations are the ones std::priority_queue uses, so ties break the same way)
+	std::array<MinHeapNode, 2 * MAX_HUFFMAN_SYMBOLS> nodes;
+	int used_nodes = 0;
+	std::array<MinHeapNode*, MAX_HUFFMAN_SYMBOLS> minHeap;
+	int heap_size = 0;
+	auto push = [&](MinHeapNode* node){
+		minHeap[heap_size++] = node;
+		std::push_heap(minHeap.begin(), minHeap.begin() + heap_size, compare());
+	};
+	auto pop = [&]{
+		std::pop_heap(minHeap.begin(), minHeap.begin() + heap_size, compare());
+		return minHeap[--heap_size];
+	};
+
+	assert(size <= MAX_HUFFMAN_SYMBOLS);
+	for (int i = 0; i < size; ++i) {
+        if(freq[i] != 0){
+            nodes[used_nodes] = MinHeapNode(i, freq[i]);
+            push(&nodes[used_nodes++]);
+        }
+    } 
+
+	// Iterate while size of heap doesn't become 1 
+	while (heap_size != 1) { 
+
+		// Extract the two minimum 
+		// freq items from min heap 
+		left = pop(); 
+
+		right = pop(); 
+
+		// Create a new internal node with 
+		// frequency equal to the sum of the 
+		// two nodes frequencies. Make the 
+		// two extracted node as left and right children 
+		// of this new node. Add this node 
+		// to the min heap '$' is a special value 
+		// for internal nodes, not used 
+		nodes[used_nodes] = MinHeapNode(-1, left->freq + right->freq); 
+		top = &nodes[used_nodes++]; 
+
+		top->left = left; 
+		top->right = right; 
+
+		push(top); 
+	} 
+
+	// Print Huffman codes using 
+	// the Huffman tree built above 
+	printCodes(minHeap[0], 0, result); 
+} 
+
+struct LenDist {
+    u32 length;
+    u32 distance;
+};
+
+const int THRESHOLD = 250;
+const int MAX_BLOCK_SIZE = 800000;
+const int MAX_CODE_LENGTH = 15;
+const int CL_TABLE_SIZE = 19;
+const int SS_TABLE_SIZE = 286;
+const int DIST_TABLE_SIZE = 30;
+const int MAX_BACKREF_DIST = 32768;
+
+//Ranges of Compressor::set_window_bits() and set_mem_level(), as in zlib
+const int MIN_WINDOW_BITS = 9;
+const int MAX_WINDOW_BITS = 15;
+const int MIN_MEM_LEVEL = 1;
+const int MAX_MEM_LEVEL = 9;
+
+
+//One literal, length or distance of the current block, packed into 32 bits
+struct Symbol {
+    u32 value : 9;
+    u32 offset : 13;
+    u32 offbits : 4;
+    u32 isLength : 1;
+};
+
+//Symbol frequencies for the block currently being built
+struct SymbolCounts {
+    int symbolCounts [SS_TABLE_SIZE];
+    int distCounts [DIST_TABLE_SIZE];
+    int clCounts [CL_TABLE_SIZE];
+};
+
+template<size_t N>
+inline std::array< u32, N > construct_canonical_code( std::array<u32, N> const & lengths ){
+
+    unsigned int size = lengths.size();
+    std::array< unsigned int, MAX_CODE_LENGTH+1 > length_counts {}; //Lengths must be less than 16 for DEFLATE
+    u32 max_length = 0;
+    for(auto i: lengths){
+        assert(i <= MAX_CODE_LENGTH);
+        length_counts.at(i)++;
+        max_length = std::max(i, max_length);
+    }
+    length_counts[0] = 0; //Disregard any codes with alleged zero length
+
+    std::array< u32, N > result_codes {};
+
+    //The algorithm below follows the pseudocode in RFC 1951
+    std::array< unsigned int, MAX_CODE_LENGTH+1 > next_code {};
+    {
+        //Step 1: Determine the first code for each length
+        unsigned int code = 0;
+        for(unsigned int i = 1; i <= max_length; i++){
+            code = (code+length_counts.at(i-1))<<1;
+            next_code.at(i) = code;
+        }
+    }
+    {
+        //Step 2: Assign the code for each symbol, with codes of the same length being
+        //        consecutive and ordered lexicographically by the symbol to which they are assigned.
+        for(unsigned int symbol = 0; symbol < size; symbol++){
+            unsigned int length = lengths.at(symbol);
+            if (length > 0) {
+                result_codes.at(symbol) = next_code.at(length)++;
+            }
+        }  
+    } 
+    return result_codes;
+}
+
+//gzip has a peculier but interesting way to represent the lengths and distances generated
+//by the algorithm. The mapping lives in compile-time tables (see deflate_tables.hpp).
+inline constexpr Symbol length_symbol(u32 length) {
+    u16 entry = deflate_tables::length_entry(length);
+    u32 code = deflate_tables::entry_code(entry);
+    return Symbol{deflate_tables::FIRST_LENGTH_SYMBOL + code, length - deflate_tables::length_base[code], deflate_tables::entry_extra_bits(entry), true};
+}
+
+inline constexpr Symbol distance_symbol(u32 distance) {
+    u16 entry = deflate_tables::dist_entry(distance);
+    u32 code = deflate_tables::entry_code(entry);
+    return Symbol{code, distance - deflate_tables::dist_base[code], deflate_tables::entry_extra_bits(entry), false};
+}
+
+//This function take a list of lengths generated by a huffman tree, and modifies it to 
+//enforce a maximum length while still maintaining the properties of the huffman code.
+inline void enforceMaxLength(u32* result, int size, u32 MAX_LENGTH){
+    while (1){
+        int index1 = -1;
+        int index2 = -1;
+        u32 maxlen = MAX_LENGTH;
+        for (int i = 0; i < size; i++) {
+            if (result[i] > maxlen){
+                index1 = i;
+                index2 = -1;
+                maxlen = result[i];
+            }
+            else if (result[i] == maxlen) {
+                index2 = i;
+            }
+        }
+        if (index1 == -1){
+            break;
+        }
+
+        //find node as close to limit as possible
+        int swapi = -1;
+        u32 level = 0;
+        for (int i = 0; i < size; i++) {
+            if(result[i] > level && result[i] < MAX_LENGTH) {
+                swapi = i;
+                level = result[i];
+            }
+        }
+        result[swapi]++;
+        result[index1] = result[swapi];
+        result[index2]--;
+    }
+}
+
+struct CLSymbol {
+    u32 value;
+    u32 offset;
+    u32 numbits;
+};
+
+//The code length symbols of one block header (at most one per code length)
+class CLSymbolBuffer {
+public:
+    void push_back(CLSymbol s){
+        assert(count < symbols.size());
+        symbols[count++] = s;
+    }
+    const CLSymbol* begin() const {
+        return symbols.data();
+    }
+    const CLSymbol* end() const {
+        return symbols.data() + count;
+    }
+private:
+    std::array<CLSymbol, SS_TABLE_SIZE + DIST_TABLE_SIZE> symbols;
+    size_t count {0};
+};
+
+inline void write_non_zero_cl(CLSymbolBuffer& clsymbols, int* clCounts, u32 count, u32 const & last_seen) {
+    while(count >= 6) {
+        clsymbols.push_back(CLSymbol{16, 3, 2});
+        clCounts[16]++;
+        count = count - 6;
+    }
+    if (count >= 3) {
+        u32 num = count - 3;
+        clsymbols.push_back(CLSymbol{16, num, 2});
+        clCounts[16]++;
+        count = 0;
+    }
+    while(count > 0) {
+        clsymbols.push_back(CLSymbol{last_seen, 0, 0});
+        clCounts[last_seen]++;
+        count--;
+    }
+}
+
+inline void write_zero_cl(CLSymbolBuffer& clsymbols, int* clCounts, u32 count) {
+    if (count >= 11) {
+        clsymbols.push_back(CLSymbol{18, count - 11, 7});
+        clCounts[18]++;
+        count = 0;
+    }
+    if (count >= 3) {
+        u32 num = count - 3;
+        clsymbols.push_back(CLSymbol{17, num, 3});
+        clCounts[17]++;
+        count = 0;
+    }
+    while(count > 0){
+        clsymbols.push_back(CLSymbol{0, 0, 0});
+        clCounts[0]++;
+        count--;
+    }
+}
+
+inline void write_cl_symbol_stream(const u32* code_lengths, int size, CLSymbolBuffer& clsymbols, int* clCounts){
+    //compute CL stream
+        u32 last_seen = 16;
+        u32 count = 0;
+        int i = 0;
+        while(i < size) {
+            while(i < size && code_lengths[i] == 0) {
+                if (last_seen != 0){
+                    write_non_zero_cl(clsymbols, clCounts, count, last_seen);
+                    count = 0;
+                    last_seen = 0;
+                }
+                count++;
+                if(count == 138) {
+                    clsymbols.push_back(CLSymbol{18, 138 - 11, 7});
+                    clCounts[18]++;
+                    count = 0;
+                }
+                i++;
+            }
+            while(i < size && code_lengths[i] != 0) {
+                //std::cout << "curr:" << code_lengths[i] << "\n";
+                if(last_seen == 0) {
+                    write_zero_cl(clsymbols, clCounts, count);
+                    clsymbols.push_back(CLSymbol{code_lengths[i], 0, 0});
+                    clCounts[code_lengths[i]]++;
+                    count = 0;
+                    last_seen = code_lengths[i];
+                } else if (last_seen != code_lengths[i]){
+                    write_non_zero_cl(clsymbols, clCounts, count, last_seen);
+                    clsymbols.push_back(CLSymbol{code_lengths[i], 0, 0});
+                    clCounts[code_lengths[i]]++;
+                    count = 0;
+                    last_seen = code_lengths[i];
+                } else {
+                    count++;
+                }
+                i++;
+            }
+        }
+        if(count > 0) {
+            if(last_seen == 0) {
+                write_zero_cl(clsymbols, clCounts, count);
+            } else {
+                write_non_zero_cl(clsymbols, clCounts, count, last_seen);
+            }
+        }
+}
+
+//Block type 0: the data is copied through as is, after byte alignment (at most 65535 bytes per block)
+inline void write_stored_block(OutputBitStream& stream, const u8* data, u16 size, bool is_last){
+    stream.push_bit(is_last?1:0);
+    stream.push_bits(0, 2);
+    stream.flush_to_byte();
+    stream.push_u16(size);
+    stream.push_u16(~size);
+    for(u32 i = 0; i < size; i++)
+        stream.push_byte(data[i]);
+}
+
+/* Write one block of type 1 (fixed codes) or 2 (dynamic codes), calling
+   at_header_end() between the block's header (with its codes) and its symbols */
+template<typename AtHeaderEnd>
+inline void write_block(OutputBitStream& stream, const Symbol* output, size_t output_size, SymbolCounts& counts, bool is_last, int type, AtHeaderEnd const& at_header_end){
+    stream.push_bit(is_last?1:0); //1 = last block
+
+    //We will construct placeholder LL and distance codes (the dynamic code leaves 286 and 287 unused)
+    std::array<u32, 288> ll_code_lengths {};
+    std::array<u32, DIST_TABLE_SIZE> dist_code_lengths {};
+
+    if (type == 1) {
+        stream.push_bits(1, 2); //Two bit block type (in this case, block type 1)
+        //Construct a basic code with 0 - 225 having length 8 and 226 - 285 having length 9
+        //(This will satisfy the Kraft-McMillan inequality exactly, and thereby fool gzip's
+        // detection process for suboptimal codes)
+        for(unsigned int i = 0; i <= 143; i++)
+            ll_code_lengths[i] = 8;
+        for(unsigned int i = 144; i <= 255; i++)
+            ll_code_lengths[i] = 9;
+        for(unsigned int i = 256; i <= 279; i++)
+            ll_code_lengths[i] = 7;
+        for(unsigned int i = 280; i <= 287; i++)
+            ll_code_lengths[i] = 8;
+
+        //Construct a distance code similarly, with 0 - 1 having length 4 and 2 - 29 having length 5
+        //(This is irrelevant since we don't actually use distance codes in this example)
+        for(unsigned int i = 0; i <= 29; i++)
+            dist_code_lengths[i] = 5;
+    } else {
+        //type 2
+        stream.push_bits(2, 2); //Two bit block type (in this case, block type 2)
+        
+        counts.symbolCounts[256]++; //end of file symbol occurs once
+        HuffmanCodes(counts.symbolCounts, SS_TABLE_SIZE, ll_code_lengths.data());
+        enforceMaxLength(ll_code_lengths.data(), SS_TABLE_SIZE, MAX_CODE_LENGTH);
+
+
+        //A block made only of literals still needs one distance code, and the tree builder needs at least one symbol
+        bool any_distance = false;
+        for(int i = 0; i < DIST_TABLE_SIZE; i++)
+            any_distance = any_distance || counts.distCounts[i] != 0;
+        if (!any_distance)
+            counts.distCounts[0]++;
+        HuffmanCodes(counts.distCounts, DIST_TABLE_SIZE, dist_code_lengths.data());
+        enforceMaxLength(dist_code_lengths.data(), DIST_TABLE_SIZE, MAX_CODE_LENGTH);
+
+        int numSym = ll_code_lengths.size();
+        for(int i = ll_code_lengths.size() -1; i >= 0 && ll_code_lengths.at(i) == 0; i--) {
+            numSym--;
+        }
+
+        unsigned int HLIT = numSym - 257;
+
+        int numDistSym = dist_code_lengths.size();
+        for(int i = dist_code_lengths.size() -1; i >= 0 && dist_code_lengths.at(i) == 0; i--) {
+            numDistSym--;
+        }
+
+        CLSymbolBuffer clsymbols;
+        write_cl_symbol_stream(ll_code_lengths.data(), numSym, clsymbols, counts.clCounts);
+        write_cl_symbol_stream(dist_code_lengths.data(), numDistSym, clsymbols, counts.clCounts);
+
+        std::array<u32, CL_TABLE_SIZE> cl_code_lengths {};
+        HuffmanCodes(counts.clCounts, CL_TABLE_SIZE, cl_code_lengths.data());
+        enforceMaxLength(cl_code_lengths.data(), CL_TABLE_SIZE, 7);
+
+        auto cl_code = construct_canonical_code(cl_code_lengths);
+
+        //Variables are named as in RFC 1951
+        assert(numSym >= 257); //There needs to be at least one use of symbol 256, so the ll_code_lengths table must have at least 257 elements
+
+        unsigned int HDIST = 0;
+        if (dist_code_lengths.size() == 0){
+            //Even if no distance codes are used, we are required to encode at least one.
+        }else{
+            HDIST = numDistSym - 1;
+        }
+        
+        static constexpr std::array<u32, CL_TABLE_SIZE> cl_permutation {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+        unsigned int HCLEN = 19; 
+        int numClSym = cl_permutation.size();
+        for (unsigned int i = cl_permutation.size() - 1; i >= 0 && cl_code_lengths.at(cl_permutation.at(i)) == 0; i--){
+            numClSym--;
+        }
+        HCLEN = numClSym - 4;
+
+        //Push HLIT, HDIST and HCLEN. These are all numbers so Rule #1 applies
+        stream.push_bits(HLIT, 5);
+        stream.push_bits(HDIST,5);
+        stream.push_bits(HCLEN,4);
+
+        //The lengths are written in a strange order, dictated by RFC 1951
+        //(This seems like a sadistic twist of the knife, but there is some amount of weird logic behind the ordering)
+
+        //Now push each CL code length in 3 bits (the lengths are numbers, so Rule #1 applies)
+        for (unsigned int i = 0; i < HCLEN+4; i++)
+            stream.push_bits(cl_code_lengths.at(cl_permutation.at(i)),3); 
+
+        for(auto it = clsymbols.begin(); it != clsymbols.end(); it++) {
+            auto code = cl_code[(*it).value];
+            auto bits = cl_code_lengths[(*it).value];
+
+            for(int i = bits-1; i >= 0; i--)
+                stream.push_bit((code>>(unsigned int)i)&1);
+            
+            if((*it).numbits != 0) {
+                stream.push_bits((*it).offset, (*it).numbits);
+            }
+        }
+    }
+
+    at_header_end();
+
+    auto ll_code = construct_canonical_code(ll_code_lengths);
+    auto dist_code = construct_canonical_code(dist_code_lengths);
+
+    bool dist = false;
+    for(auto iter = output; iter != output + output_size; iter++){
+        if((*iter).isLength) {
+            dist = true;
+            Symbol l = (*iter);
+            //write symbol
+            u32 bits = ll_code_lengths.at(l.value);
+            u32 code = ll_code.at(l.value);
+            for(int i = bits-1; i >= 0; i--)
+                stream.push_bit((code>>(unsigned int)i)&1);
+            //write offset
+            bits = l.offbits;
+            code = l.offset;
+            stream.push_bits(code, bits);
+        } else if (dist) {
+            dist = false;
+            
+            Symbol l = (*iter);
+            //write symbol
+            u32 bits = dist_code_lengths.at(l.value);
+            u32 code = dist_code.at(l.value);
+                
+            for(int i = bits-1; i >= 0; i--)
+                stream.push_bit((code>>(unsigned int)i)&1);
+            //write offset
+            bits = l.offbits;
+            code = l.offset;
+            stream.push_bits(code, bits);
+            
+        } else {
+            //write symbol
+            Symbol l = (*iter);
+            
+            u32 bits = ll_code_lengths.at(l.value);
+
+            u32 code = ll_code.at(l.value);
+
+            for(int i = bits-1; i >= 0; i--)
+                stream.push_bit((code>>(unsigned int)i)&1);
+        }
+    }
+
+    //Throw in a 256 (EOB marker)
+    
+    u32 symbol = 256;
+    u32 bits = ll_code_lengths.at(symbol);
+    u32 code = ll_code.at(symbol);
+    for(int i = bits-1; i >= 0; i--)
+        stream.push_bit((code>>(unsigned int)i)&1);
+}
+
+inline void write_block(OutputBitStream& stream, const Symbol* output, size_t output_size, SymbolCounts& counts, bool is_last, int type){
+    write_block(stream, output, output_size, counts, is_last, type, []{});
+}
+
+enum class Flush { Sync, Full };
+
+/* The wrapper around the DEFLATE data */
+enum class Format { Gzip, Zlib, Raw };
+
+/* How the parser chooses between a literal and a match. Each strategy is
+   its own instantiation of the parse loop, picked once per stream. */
+enum class Strategy {
+    Greedy,     //take the longest match at each position
+    Lazy,       //hold a match back one position in case the next one is longer (zlib's deflate_slow)
+    Optimal     //collect every match length over a segment, then take the cheapest path through it
+};
+
+/* The parser settings of a compression level */
+struct LevelParams {
+    Strategy strategy;
+    u32 max_chain;      //chain candidates examined per lookup (at least 1)
+    u32 nice_length;    //stop looking once a match is this long
+    u32 good_length;    //Lazy: examine a quarter of the chain when the held back match is this long
+    u32 max_lazy;       //Lazy: look no further once the held back match is this long
+    u32 max_insert;     //Greedy: hash the positions inside a match only if it is this long at most
+    u32 accelerate;     //Greedy: after a run of k literals, skip k >> accelerate positions unsearched (0: never)
+};
+
+//Range of Compressor::set_level()
+const int DEFAULT_LEVEL = 0;
+const int MAX_LEVEL = 9;
+
+//Level 0 (not stored blocks, as in zlib) is the parse gzcomp has always
+//done: greedy, walking every chain until a match reaches THRESHOLD. Levels 1
+//to 8 start from zlib's settings for its fast and slow (lazy) parsers, moved
+//where needed so that no level's output is larger than the level below it on
+//test_data (validate.sh checks this): level 3 walks half zlib's chain, level
+//4 a longer one with a longer held back match, and level 7 a shorter one.
+const LevelParams LEVELS[MAX_LEVEL + 1] {
+    {Strategy::Greedy, ~0u, THRESHOLD, 0, 0, deflate_tables::MAX_MATCH, 0},
+    {Strategy::Greedy, 4, 8, 0, 0, 4, 0},
+    {Strategy::Greedy, 8, 16, 0, 0, 5, 0},
+    {Strategy::Greedy, 16, 32, 0, 0, 6, 0},
+    {Strategy::Lazy, 24, 16, 8, 8, 0, 0},
+    {Strategy::Lazy, 32, 32, 8, 16, 0, 0},
+    {Strategy::Lazy, 128, 128, 8, 16, 0, 0},
+    {Strategy::Lazy, 160, 258, 8, 32, 0, 0},
+    {Strategy::Lazy, 1024, 258, 32, 128, 0, 0},
+    {Strategy::Optimal, 512, 128, 0, 0, 0, 0},
+};
+
+//The efforts Compressor::set_target_mbps() moves between, fastest first:
+//two greedy parses which look at one or two candidates and skip ahead
+//through runs of literals (as LZ4's acceleration does), then levels 1 to 8.
+//Level 9 is left out: it is too slow to be worth adapting to, and it would
+//need the optimal parser's buffers on hand all the time.
+const int NUM_EFFORTS = 10;
+const LevelParams EFFORTS[NUM_EFFORTS] {
+    {Strategy::Greedy, 1, 8, 0, 0, 0, 3},
+    {Strategy::Greedy, 2, 8, 0, 0, 3, 5},
+    LEVELS[1], LEVELS[2], LEVELS[3], LEVELS[4], LEVELS[5], LEVELS[6], LEVELS[7], LEVELS[8],
+};
+
+/* The compressor's working memory (history window, match finder tables and
+   the symbols of the current block) is carved out of one arena when it is
+   constructed, and reused for every stream after that: starting a new stream
+   only moves the point before which the history is ignored, so nothing is
+   allocated or cleared per stream or per byte. Its size is set by the window
+   bits and memory level (see memory_bound()). */
+class Compressor {
+public:
+    Compressor(): Compressor(MAX_WINDOW_BITS, MAX_MEM_LEVEL) {}
+
+    /* A compressor laid out for the given window bits and memory level from
+       the start (see set_window_bits() and set_mem_level()) */
+    Compressor(int window_bits, int mem_level): stream{out_bytes}, window_bits{checked_window_bits(window_bits)},
+        mem_level{checked_mem_level(mem_level)}, memory{arena_size(window_bits, mem_level, false)} {
+        allocate_memory();
+        reset();
+    }
+
+    /* Start a new stream (a gzip member by default), forgetting all history
+       except the preset dictionary. The header is placed in output() straight away. */
+    void reset(){
+        params = target_mbps > 0 ? EFFORTS[effort_index] : LEVELS[level];
+        parser = parser_for<false>(params.strategy);
+        counting_parser = parser_for<true>(params.strategy);
+        match_length = cpu::kernels().match_length;
+        crc32_update = cpu::kernels().crc32;
+        if (window_size != 1u << window_bits || hash_bits != hash_bits_for(mem_level) || memory.huge_pages() != huge_pages
+            || (segment_cost != nullptr) != (params.strategy == Strategy::Optimal))
+            allocate_memory();
+        lookahead = 0;
+        match_available = false;
+        prev_length = 0;
+        misses = 0;
+        segment_length = 0;
+        skip = 0;
+        current = pushed;
+        history_start = pushed;
+        output_size = 0;
+        counts = SymbolCounts{};
+        crc = 0;
+        adler = adler32::INITIAL;
+        bytes_in = 0;
+        position = 0;
+        adapt_bytes = 0;
+        adapt_seconds = 0;
+        busy_seconds = 0;
+        busy_bytes = 0;
+        backed_up = false;
+        output_mbps = 0;
+        credit = 0;
+        block_seconds = 0;
+        block_position = 0;
+        out_bytes.clear();
+        stream.reset();
+        index.points.clear();
+        next_checkpoint = 0;
+
+        if (format == Format::Gzip){
+            //Push a basic gzip header
+            stream.push_bytes( 0x1f, 0x8b, //Magic Number
+                0x08, //Compression (0x08 = DEFLATE)
+                0x00, //Flags
+                0x00, 0x00, 0x00, 0x00, //MTIME (little endian)
+                0x00, //Extra flags
+                0x03 //OS (Linux)
+            );
+        } else if (format == Format::Zlib){
+            u32 cmf = 0x08 | (window_bits - 8) << 4; //DEFLATE, and CINFO: the window size
+            u32 flg = 2 << 6; //FLEVEL: default
+            if (!dictionary.empty())
+                flg |= 0x20; //FDICT
+            flg += (31 - (cmf * 256 + flg) % 31) % 31; //FCHECK
+            stream.push_bytes(cmf, flg);
+            if (!dictionary.empty())
+                push_u32_msb_first(adler32::update(adler32::INITIAL, dictionary.data(), dictionary.size()));
+        }
+        load_dictionary();
+
+        if (checkpoint_interval > 0)
+            add_checkpoint();
+    }
+
+    /* Feed the next size bytes of input. Up to MAX_MATCH bytes are held back
+       as look ahead until more input (or finish()) arrives. */
+    void compress(const u8* data, size_t size){
+        if (target_mbps > 0)
+            compress_adapting(data, size);
+        else
+            feed(data, size);
+    }
+
+    /* Compress everything still buffered and end the stream with the final
+       block and the trailer */
+    void finish(){
+        process(nullptr, 0, true);
+        end_block(true);
+
+        //After the last block, restore byte alignment
+        stream.flush_to_byte();
+
+        if (format == Format::Gzip){
+            //Now close out the bitstream by writing the CRC and the total number of bytes stored.
+            stream.push_u32(crc);
+            stream.push_u32(bytes_in);
+        } else if (format == Format::Zlib){
+            push_u32_msb_first(adler);
+        }
+    }
+
+    /* Compress everything fed in so far and align the output to a byte
+       boundary with an empty stored block (zlib's Z_SYNC_FLUSH), so that a
+       decoder can produce all of the input so far from output_bytes(). A full
+       flush also forgets the history, so decoding can restart from here
+       (Z_FULL_FLUSH). */
+    void flush(Flush mode = Flush::Sync){
+        process(nullptr, 0, true);
+        end_block(false);
+        write_stored_block(stream, nullptr, 0, false);
+        if (mode == Flush::Full)
+            history_start = pushed;
+    }
+
+    /* Compressed bytes produced so far. The caller may write them out and clear the vector at any time. */
+    std::vector<u8>& output_bytes(){
+        return out_bytes;
+    }
+
+    /* Record a random access checkpoint (see gzindex.hpp) roughly every
+       interval bytes of input, or never if interval is 0. Takes effect at the next reset(). */
+    void set_checkpoint_interval(u64 interval){
+        checkpoint_interval = interval;
+    }
+
+    /* Choose the wrapper for the DEFLATE data. Takes effect at the next reset(). */
+    void set_format(Format f){
+        format = f;
+    }
+
+    /* Limit back-references to the last 2^bits bytes of input, for bits from
+       9 to 15 (zlib's windowBits), which also sets the size of the history
+       window. A zlib header records the window size, so that a decoder knows
+       how much history it needs. Takes effect at the next reset(). */
+    void set_window_bits(int bits){
+        window_bits = checked_window_bits(bits);
+    }
+
+    /* How much memory the match finder and the block buffer get, from 1 to 9
+       (zlib's memLevel): 2^(level + 7) hash chains, and blocks of up to
+       2^(level + 11) symbols (MAX_BLOCK_SIZE at most). Lower levels find
+       fewer matches and end blocks sooner. The default is 9, where the hash
+       is exact on the two characters it looks at. Takes effect at the next reset(). */
+    void set_mem_level(int level){
+        mem_level = checked_mem_level(level);
+    }
+
+    /* Trade speed for compression, from 1 (fastest) to 9 (smallest output).
+       Levels 1 to 3 parse greedily with short chains, 4 to 8 lazily, and 9
+       optimally (see LEVELS), which also takes about 40 KiB more memory.
+       DEFAULT_LEVEL (0) is gzcomp's original parse, which finds long
+       matches but spends a long time on it. Takes effect at the next reset(). */
+    void set_level(int l){
+        if (l < DEFAULT_LEVEL || l > MAX_LEVEL)
+            throw std::invalid_argument("level must be from 0 (the default) to 9");
+        level = l;
+    }
+
+    /* Rather than keep to one level, move between the efforts of EFFORTS as
+       the stream goes so as to compress mbps MB of input per second (of
+       time spent in compress(), so per thread), with the smallest output
+       that allows. The input is timed ADAPT_INTERVAL bytes at a time, and
+       after each interval the effort goes down a step for each interval
+       compression is behind the target, or up one if it is more than an
+       interval ahead (see adapt()). The lead is carried from one interval
+       to the next, so the rate comes out at the target on average even
+       when no one effort is that fast. A
+       target above what the fastest effort manages just runs that one.
+       0 (the default) keeps to the level. Takes effect at the next reset(). */
+    void set_target_mbps(double mbps){
+        if (!(mbps >= 0))
+            throw std::invalid_argument("the target must be a positive number of MB/s");
+        target_mbps = mbps;
+    }
+
+    /* Tell a compressor with a target that its caller has just spent
+       seconds waiting for the compressed output to be taken. If that is over
+       a tenth of the time since the last such call, the output (a pipe, the
+       network, a disk) is the bottleneck, and compressing faster would only
+       wait longer: the effort goes up a step, which makes less output too
+       (as zstd --adapt does), and until the output has kept up for a while,
+       the target is lowered to the rate of input the output let through. */
+    void add_output_wait(double seconds){
+        double wall = busy_seconds + seconds;
+        if (seconds > wall / 10 && busy_bytes > 0){
+            backed_up = true;
+            output_mbps = busy_bytes / wall / 1e6;
+            backed_up_at = intervals;
+        }
+        busy_seconds = 0;
+        busy_bytes = 0;
+    }
+
+    /* The target of set_target_mbps(), 0 if none */
+    double target() const {
+        return target_mbps;
+    }
+
+    /* The effort in use with a target: an index into EFFORTS */
+    int effort() const {
+        return effort_index;
+    }
+
+    /* Back the working memory with transparent huge pages where the kernel
+       allows (see arena.hpp), so the match finder's random accesses to the
+       window and hash tables miss the TLB less. This rounds the arena up to
+       2 MiB. Off by default. Takes effect at the next reset(). */
+    void set_huge_pages(bool on){
+        huge_pages = on;
+    }
+
+    /* The most memory a Compressor with these settings occupies: the object
+       itself and its arena. Not included are the preset dictionary, the
+       random access index, and compressed bytes the caller has not yet taken
+       out of output_bytes(). */
+    static constexpr size_t memory_bound(int window_bits = MAX_WINDOW_BITS, int mem_level = MAX_MEM_LEVEL, bool huge_pages = false,
+        int level = DEFAULT_LEVEL){
+        bool optimal = LEVELS[level].strategy == Strategy::Optimal;
+        return sizeof(Compressor) + arena::footprint(arena_size(window_bits, mem_level, optimal), huge_pages);
+    }
+
+    /* Preload the history (and the match finder) with the last 32 KiB of
+       dict (or the window size, if less) before every stream, so that the input can refer back into it.
+       The decoder must be given the same dictionary: a zlib stream records
+       its Adler-32 in the header, while a gzip member has no way to say it
+       needs one. Takes effect at the next reset(). */
+    void set_dictionary(const u8* dict, size_t size){
+        dictionary.assign(dict, dict + size);
+    }
+
+    /* The checkpoints recorded so far in this stream */
+    gzindex::Index const& checkpoints() const {
+        return index;
+    }
+
+    u64 total_in() const {
+        return bytes_in;
+    }
+
+    /* CRC-32 of the input so far */
+    u32 crc32() const {
+        return crc;
+    }
+
+    /* Add what the compressor does from now on to *s (see compress_stats.hpp),
+       or stop counting if s is null. Counting costs nothing when it is off. */
+    void set_stats(compress_stats::Stats* s){
+        stats = s;
+    }
+
+private:
+    //A step of the optimal parser's path, into the position it is stored at
+    struct Step {
+        u16 length; //1 for a literal
+        u16 distance;
+    };
+    //Positions the optimal parser decides at once, and the most a segment
+    //can run on to reach the end of the matches which start inside it
+    static const u32 SEGMENT = 1 << 12;
+    static const u32 MAX_SEGMENT = SEGMENT + deflate_tables::MAX_MATCH;
+
+    static int checked_window_bits(int bits){
+        if (bits < MIN_WINDOW_BITS || bits > MAX_WINDOW_BITS)
+            throw std::invalid_argument("window bits must be from 9 to 15");
+        return bits;
+    }
+
+    static int checked_mem_level(int level){
+        if (level < MIN_MEM_LEVEL || level > MAX_MEM_LEVEL)
+            throw std::invalid_argument("memory level must be from 1 to 9");
+        return level;
+    }
+
+    static constexpr u32 hash_bits_for(int mem_level){
+        return mem_level + 7;
+    }
+
+    static constexpr size_t block_symbols_for(int mem_level){
+        return std::min<size_t>(MAX_BLOCK_SIZE, (size_t)1 << (mem_level + 11));
+    }
+
+    /* Arena space for the window (twice the window size, so it only slides
+       now and then), the hash chain heads, the chain links and the block,
+       plus the optimal parser's segment and prices if it is in use */
+    static constexpr size_t arena_size(int window_bits, int mem_level, bool optimal){
+        size_t size = arena::Arena::space_for<u8>((size_t)2 << window_bits)
+            + arena::Arena::space_for<u32>((size_t)1 << hash_bits_for(mem_level))
+            + arena::Arena::space_for<u32>((size_t)1 << window_bits)
+            + arena::Arena::space_for<Symbol>(block_symbols_for(mem_level) + 2);
+        if (optimal){
+            size += arena::Arena::space_for<u32>(MAX_SEGMENT + 1) + arena::Arena::space_for<Step>(MAX_SEGMENT + 1)
+                + arena::Arena::space_for<u8>(MAX_SEGMENT) + arena::Arena::space_for<u32>(256)
+                + arena::Arena::space_for<u32>(deflate_tables::MAX_MATCH + 1) + arena::Arena::space_for<u32>(DIST_TABLE_SIZE);
+        }
+        return size;
+    }
+
+    /* Lay out the working memory for the current settings, starting over with an empty history */
+    void allocate_memory(){
+        bool optimal = params.strategy == Strategy::Optimal;
+        size_t size = arena_size(window_bits, mem_level, optimal);
+        if (memory.capacity() != size || memory.huge_pages() != huge_pages)
+            memory = arena::Arena{size, huge_pages};
+        memory.reset();
+        window_size = 1u << window_bits;
+        hash_bits = hash_bits_for(mem_level);
+        block_symbols = block_symbols_for(mem_level);
+        window = memory.allocate<u8>(2 * window_size);
+        head = memory.allocate<u32>(1u << hash_bits);
+        prev = memory.allocate<u32>(window_size);
+        output = memory.allocate<Symbol>(block_symbols + 2);
+        segment_cost = optimal ? memory.allocate<u32>(MAX_SEGMENT + 1) : nullptr;
+        segment_step = optimal ? memory.allocate<Step>(MAX_SEGMENT + 1) : nullptr;
+        segment_bytes = optimal ? memory.allocate<u8>(MAX_SEGMENT) : nullptr;
+        literal_price = optimal ? memory.allocate<u32>(256) : nullptr;
+        length_price = optimal ? memory.allocate<u32>(deflate_tables::MAX_MATCH + 1) : nullptr;
+        distance_code_price = optimal ? memory.allocate<u32>(DIST_TABLE_SIZE) : nullptr;
+        std::fill(head, head + (1u << hash_bits), 0);
+        //Position 0 is never used, so an empty head entry is never inside the history
+        window_start = pushed = current = history_start = 1;
+    }
+
+    void push_u32_msb_first(u32 v){
+        stream.push_bytes(v >> 24, v >> 16, v >> 8, v);
+    }
+
+    /* Put the dictionary into the history, indexed like already encoded input */
+    void load_dictionary(){
+        size_t skip = dictionary.size() > window_size ? dictionary.size() - window_size : 0;
+        append(dictionary.data() + skip, dictionary.size() - skip);
+        for(; current + 2 < pushed; current++)
+            insert(current);
+        current = pushed;
+    }
+
+    u8* at(u32 pos){
+        return window + (pos - window_start);
+    }
+
+    /* The match finder is keyed on two characters, hashed down to hash_bits
+       bits below the top memory level */
+    u32 key_at(u32 pos){
+        const u8* p = at(pos);
+        u32 key = p[0] | (u32)p[1] << 8;
+        return hash_bits == 16 ? key : (key * 2654435761u) >> (32 - hash_bits);
+    }
+
+    /* Remember that the sequence starting at pos occurred */
+    void insert(u32 pos){
+        u32& h = head[key_at(pos)];
+        prev[pos & (window_size - 1)] = h;
+        h = pos;
+    }
+
+    /* The earliest position a back-reference may reach: the history is the
+       window size before the end of the buffered input, from the start of the stream at most */
+    u32 history_limit() const {
+        return std::max(history_start, pushed - std::min<u32>(pushed, window_size));
+    }
+
+    /* Add size (at most the window size) bytes to the end of the window, sliding it down first if it is full */
+    void append(const u8* data, size_t size){
+        if (pushed - window_start + size > 2 * window_size){
+            u32 keep_from = pushed - window_size;
+            std::memmove(window, at(keep_from), pushed - keep_from);
+            window_start = keep_from;
+            if (window_start >= REBASE_POSITION)
+                rebase();
+        }
+        std::memcpy(at(pushed), data, size);
+        pushed += size;
+    }
+
+    /* Renumber positions down by a multiple of the window size (which keeps
+       their slots in prev), before they can overflow 32 bits */
+    void rebase(){
+        u32 delta = (window_start - 1) / window_size * window_size;
+        auto shift = [&](u32 pos){
+            return pos > delta ? pos - delta : 0;
+        };
+        for(u32 i = 0; i < 1u << hash_bits; i++)
+            head[i] = shift(head[i]);
+        for(u32 i = 0; i < window_size; i++)
+            prev[i] = shift(prev[i]);
+        window_start -= delta;
+        pushed -= delta;
+        current -= delta;
+        history_start = shift(history_start);
+    }
+
+    /* compress() without a target: checksum the input and parse it */
+    void feed(const u8* data, size_t size){
+        auto left = stats ? stats->enter(compress_stats::CHECKSUM) : compress_stats::OTHER;
+        if (format == Format::Gzip)
+            crc = crc32_update(crc, data, size);
+        else if (format == Format::Zlib)
+            adler = adler32::update(adler, data, size);
+        bytes_in += size;
+        if (stats){
+            stats->enter(left);
+            stats->bytes_in += size;
+        }
+        process(data, size, false);
+    }
+
+    /* compress() with a target: feed the input an interval at a time, timing each */
+    void compress_adapting(const u8* data, size_t size){
+        using Clock = std::chrono::steady_clock;
+        while (size > 0){
+            size_t n = std::min<size_t>(size, ADAPT_INTERVAL - adapt_bytes);
+            auto start = Clock::now();
+            feed(data, n);
+            double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            adapt_seconds += seconds;
+            busy_seconds += seconds;
+            busy_bytes += n;
+            adapt_bytes += n;
+            data += n;
+            size -= n;
+            if (adapt_bytes == ADAPT_INTERVAL)
+                adapt();
+        }
+    }
+
+    /* At the end of an interval: up an effort if the output was backed up,
+       otherwise down one for each interval behind the target, or up one if
+       an interval ahead of it and the next effort up was fast enough when
+       last tried (or has not been tried for a while) */
+    void adapt(){
+        if (stats){
+            stats->effort_bytes.resize(NUM_EFFORTS);
+            stats->effort_bytes[effort_index] += adapt_bytes;
+        }
+        //Writing a block out is charged to the input it covers, at the rate
+        //of the last block, rather than all to the interval it ended in
+        double seconds = adapt_seconds - block_seconds + adapt_bytes * block_seconds_per_byte;
+        double mbps = target_mbps;
+        if (output_mbps > 0 && intervals - backed_up_at < STALE_INTERVALS)
+            mbps = std::min(mbps, output_mbps);
+        double interval = ADAPT_INTERVAL / (mbps * 1e6); //what an interval should take
+        double& estimate = effort_seconds[effort_index];
+        estimate = estimate > 0 && intervals - effort_measured[effort_index] < STALE_INTERVALS ? (estimate + seconds) / 2 : seconds;
+        effort_measured[effort_index] = intervals++;
+        int next = effort_index;
+        if (backed_up){
+            backed_up = false;
+            credit = 0;
+            next++;
+        } else {
+            credit = std::clamp(credit + interval - seconds, -4 * interval, 4 * interval);
+            if (credit < 0){
+                next -= (int)std::ceil(-credit / interval);
+            } else if (credit > interval && next + 1 < NUM_EFFORTS){
+                bool stale = effort_seconds[next + 1] == 0 || intervals - effort_measured[next + 1] >= STALE_INTERVALS;
+                if (stale || effort_seconds[next + 1] <= interval)
+                    next++;
+            }
+        }
+        set_effort(std::clamp(next, 0, NUM_EFFORTS - 1));
+        adapt_bytes = 0;
+        adapt_seconds = 0;
+        block_seconds = 0;
+    }
+
+    /* Switch to EFFORTS[e] between two calls of the parser. A lazy parse
+       may be holding a match back, which is encoded first if the next parse
+       is not lazy. */
+    void set_effort(int e){
+        if (e == effort_index)
+            return;
+        if (params.strategy == Strategy::Lazy && EFFORTS[e].strategy != Strategy::Lazy){
+            if (stats)
+                settle<Strategy::Lazy, true>();
+            else
+                settle<Strategy::Lazy, false>();
+        }
+        effort_index = e;
+        params = EFFORTS[e];
+        parser = parser_for<false>(params.strategy);
+        counting_parser = parser_for<true>(params.strategy);
+        if (stats)
+            stats->effort_changes++;
+    }
+
+    /* Run the LZSS parser over the buffered input. Unless flushing, parsing
+       pauses whenever the look ahead cannot be filled from data. */
+    void process(const u8* data, size_t size, bool flushing){
+        if (!stats){
+            (this->*parser)(data, size, flushing);
+            return;
+        }
+        auto left = stats->enter(compress_stats::MATCH_FINDING);
+        (this->*counting_parser)(data, size, flushing);
+        stats->enter(left);
+    }
+
+    using Parser = void (Compressor::*)(const u8*, size_t, bool);
+
+    template<bool COUNT>
+    static Parser parser_for(Strategy strategy){
+        switch (strategy){
+        case Strategy::Lazy:
+            return &Compressor::parse<Strategy::Lazy, COUNT>;
+        case Strategy::Optimal:
+            return &Compressor::parse<Strategy::Optimal, COUNT>;
+        default:
+            return &Compressor::parse<Strategy::Greedy, COUNT>;
+        }
+    }
+
+    /* The parse loop for strategy S, with the stats counters compiled in if
+       COUNT. The level's numbers are copied into locals once per call, and
+       everything that belongs to the other strategies is compiled out. */
+    template<Strategy S, bool COUNT>
+    void parse(const u8* data, size_t size, bool flushing){
+        const LevelParams p = params;
+        size_t next = 0;
+        while (1) {
+            //load the look aheads into the input buffer
+            if (lookahead < deflate_tables::MAX_MATCH && next < size) {
+                size_t n = std::min<size_t>(deflate_tables::MAX_MATCH - lookahead, size - next);
+                append(data + next, n);
+                next += n;
+                lookahead += n;
+            }
+            if (lookahead == 0 || (lookahead < deflate_tables::MAX_MATCH && !flushing))
+                break;
+
+            if constexpr (S == Strategy::Greedy)
+                greedy_step<COUNT>(p);
+            else if constexpr (S == Strategy::Lazy)
+                lazy_step<COUNT>(p);
+            else
+                optimal_step<COUNT>(p);
+
+            if (output_size > block_symbols)
+                end_block(false);
+            if (checkpoint_interval > 0 && position + undecided<S>() >= next_checkpoint){
+                settle<S, COUNT>();
+                add_checkpoint();
+            }
+        }
+        if (flushing)
+            settle<S, COUNT>();
+    }
+
+    /* Input bytes the parser has looked at but not yet encoded */
+    template<Strategy S>
+    u32 undecided() const {
+        if constexpr (S == Strategy::Lazy)
+            return match_available;
+        else if constexpr (S == Strategy::Optimal)
+            return segment_length;
+        else
+            return 0;
+    }
+
+    /* Encode whatever the parser has held back, so that the output covers exactly [.., current) */
+    template<Strategy S, bool COUNT>
+    void settle(){
+        if constexpr (S == Strategy::Lazy){
+            if (match_available){
+                if (prev_length >= 3){
+                    emit_match<COUNT>(prev_length, prev_distance);
+                    advance<COUNT>(prev_length - 1);
+                } else {
+                    emit_literal<COUNT>(*at(current - 1));
+                }
+                match_available = false;
+                prev_length = 0;
+            }
+        } else if constexpr (S == Strategy::Optimal){
+            if (segment_length > 0)
+                emit_segment<COUNT>();
+        }
+    }
+
+    template<bool COUNT>
+    void greedy_step(LevelParams const& p){
+        LenDist best = find_match<COUNT>(p.max_chain, p.nice_length);
+        if (best.length > 2) {
+            // we found a backreference, add the length and distance
+            emit_match<COUNT>(best.length, best.distance);
+            if (best.length <= p.max_insert){
+                advance<COUNT>(best.length);
+            } else {
+                //Only the start of a long match goes into the match finder
+                advance<COUNT>(1);
+                current += best.length - 1;
+                lookahead -= best.length - 1;
+            }
+            misses = 0;
+        } else {
+            //no good back reference, just add the value
+            emit_literal<COUNT>(*at(current));
+            advance<COUNT>(1);
+            if (p.accelerate > 0){
+                //The longer a run without matches, the more of it is passed over
+                //unsearched and unhashed (but no further than the block has room for)
+                u32 n = std::min<u32>({++misses >> p.accelerate, lookahead, (u32)(block_symbols + 1 - output_size)});
+                for(u32 i = 0; i < n; i++)
+                    emit_literal<COUNT>(at(current)[i]);
+                current += n;
+                lookahead -= n;
+            }
+        }
+    }
+
+    /* Look for a match at current, but encode the match found one position
+       back (at current - 1) first if it is at least as long */
+    template<bool COUNT>
+    void lazy_step(LevelParams const& p){
+        LenDist best {0, 0};
+        if (prev_length < p.max_lazy){
+            best = find_match<COUNT, true>(prev_length >= p.good_length ? std::max(p.max_chain >> 2, 1u) : p.max_chain, p.nice_length);
+            //Three bytes from far back cost about as much as three literals
+            if (best.length == 3 && best.distance > TOO_FAR)
+                best.length = 0;
+        }
+        if (prev_length >= 3 && best.length <= prev_length){
+            emit_match<COUNT>(prev_length, prev_distance);
+            advance<COUNT>(prev_length - 1); //its first position is already behind us
+            match_available = false;
+            prev_length = 0;
+        } else {
+            if (match_available)
+                emit_literal<COUNT>(*at(current - 1));
+            match_available = true;
+            prev_length = best.length;
+            prev_distance = best.distance;
+            advance<COUNT>(1);
+        }
+    }
+
+    /* Add the position at current to the segment: from the cheapest way of
+       reaching it, a literal leads one position on, and every match length
+       found here leads that far on. Once the segment is full, encode the
+       cheapest path through it. The segment does not end at SEGMENT but
+       where the last match starting before it ends, so those matches are
+       not cut short (which would leave odd lengths, in a run say); matches
+       starting past SEGMENT are cut short there instead. */
+    template<bool COUNT>
+    void optimal_step(LevelParams const& p){
+        u32 i = segment_length;
+        if (i == 0)
+            begin_segment();
+        u8 byte = *at(current);
+        segment_bytes[i] = byte;
+        u32 base = segment_cost[i];
+        relax(i + 1, base + literal_price[byte], Step{1, 0});
+        if (skip > 0){
+            //Inside a match of at least the nice length: the path is assumed to take it
+            skip--;
+        } else {
+            const u32 room = i < SEGMENT ? deflate_tables::MAX_MATCH : segment_end - i;
+            u32 shorter = 2;
+            LenDist best = find_matches<COUNT>(p.max_chain, p.nice_length, [&](u32 length, u32 distance){
+                //Lengths above the last match found need this match's (longer) distance
+                u32 price = base + distance_price(distance);
+                for(u32 l = shorter + 1; l <= std::min(length, room); l++)
+                    relax(i + l, price + length_price[l], Step{(u16)l, (u16)distance});
+                shorter = std::max(shorter, length);
+            });
+            if (i < SEGMENT && best.length >= deflate_tables::MIN_MATCH)
+                segment_end = std::max(segment_end, i + std::min(best.length, room));
+            if (best.length >= p.nice_length)
+                skip = best.length - 1;
+        }
+        advance<COUNT>(1);
+        if (++segment_length == segment_end)
+            emit_segment<COUNT>();
+    }
+
+    void relax(u32 k, u32 cost, Step step){
+        if (cost < segment_cost[k]){
+            segment_cost[k] = cost;
+            segment_step[k] = step;
+        }
+    }
+
+    /* Price the symbols (in sixteenths of a bit) by their frequency in the
+       block so far, or as the fixed code would while it has too few to go
+       on, and mark every position of the segment unreached */
+    void begin_segment(){
+        u32 lit_len_price[SS_TABLE_SIZE];
+        u32 dist_price[DIST_TABLE_SIZE];
+        u64 lit_len_total = 0, dist_total = 0;
+        for(int c: counts.symbolCounts)
+            lit_len_total += c;
+        for(int c: counts.distCounts)
+            dist_total += c;
+        if (lit_len_total < 1024){
+            for(u32 s = 0; s < SS_TABLE_SIZE; s++)
+                lit_len_price[s] = 16 * (s < 144 ? 8 : s < 256 ? 9 : s < 280 ? 7 : 8);
+            for(u32 d = 0; d < DIST_TABLE_SIZE; d++)
+                dist_price[d] = 16 * 5;
+        } else {
+            auto price = [](u64 count, u64 total){
+                double bits = std::log2((double)total / (count + 1));
+                return (u32)(16 * std::min(std::max(bits, 1.0), (double)MAX_CODE_LENGTH));
+            };
+            for(u32 s = 0; s < SS_TABLE_SIZE; s++)
+                lit_len_price[s] = price(counts.symbolCounts[s], lit_len_total + SS_TABLE_SIZE);
+            for(u32 d = 0; d < DIST_TABLE_SIZE; d++)
+                dist_price[d] = price(counts.distCounts[d], dist_total + DIST_TABLE_SIZE);
+        }
+        for(u32 b = 0; b < 256; b++)
+            literal_price[b] = lit_len_price[b];
+        for(u32 l = deflate_tables::MIN_MATCH; l <= deflate_tables::MAX_MATCH; l++){
+            Symbol s = length_symbol(l);
+            length_price[l] = lit_len_price[s.value] + 16 * s.offbits;
+        }
+        for(u32 d = 0; d < DIST_TABLE_SIZE; d++)
+            distance_code_price[d] = dist_price[d] + 16 * deflate_tables::dist_extra[d];
+        std::fill(segment_cost, segment_cost + MAX_SEGMENT + 1, ~0u);
+        segment_cost[0] = 0;
+        segment_end = SEGMENT;
+    }
+
+    u32 distance_price(u32 distance) const {
+        return distance_code_price[deflate_tables::entry_code(deflate_tables::dist_entry(distance))];
+    }
+
+    /* Encode the cheapest path through the segment, which ends at current */
+    template<bool COUNT>
+    void emit_segment(){
+        //Walk back from the end, noting where each step lands (the costs are no longer needed)
+        u32* ends = segment_cost;
+        u32 steps = 0;
+        for(u32 k = segment_length; k > 0; k -= segment_step[k].length)
+            ends[steps++] = k;
+        while (steps > 0){
+            u32 k = ends[--steps];
+            Step s = segment_step[k];
+            if (s.length == 1)
+                emit_literal<COUNT>(segment_bytes[k - 1]);
+            else
+                emit_match<COUNT>(s.length, s.distance);
+            if (output_size > block_symbols)
+                end_block(false);
+        }
+        segment_length = 0;
+        skip = 0;
+    }
+
+    template<bool COUNT>
+    void emit_match(u32 length, u32 distance){
+        Symbol s = length_symbol(length);
+        counts.symbolCounts[s.value]++;
+        output[output_size++] = s;
+
+        Symbol d = distance_symbol(distance);
+        counts.distCounts[d.value]++;
+        output[output_size++] = d;
+
+        if constexpr (COUNT){
+            stats->matches++;
+            stats->match_lengths[length]++;
+            stats->distance_codes[d.value]++;
+        }
+        position += length;
+    }
+
+    template<bool COUNT>
+    void emit_literal(u8 val){
+        counts.symbolCounts[val]++;
+        output[output_size++] = Symbol{val, 0, 0, false};
+        if constexpr (COUNT)
+            stats->literals++;
+        position++;
+    }
+
+    /* Step past n characters of the look ahead, remembering where each sequence started */
+    template<bool COUNT>
+    void advance(u32 n){
+        for(; n > 0; n--) {
+            if (lookahead >= 3){
+                insert(current);
+                if constexpr (COUNT)
+                    stats->positions_hashed++;
+            }
+            current++;
+            lookahead--;
+        }
+    }
+
+    template<bool COUNT, bool WEIGH = false>
+    LenDist find_match(u32 max_chain, u32 nice_length){
+        return find_matches<COUNT, WEIGH>(max_chain, nice_length, [](u32, u32){});
+    }
+
+    /* How much a match saves, roughly, in quarters of a literal: its length,
+       less the extra bits of its distance */
+    static int match_gain(u32 length, u32 distance){
+        return 4 * (int)length - (31 - __builtin_clz(distance));
+    }
+
+    /* Walk the places the first characters of the look ahead occurred, most
+       recent first, for a backreference that is good enough (nice_length),
+       or the best among max_chain candidates. With WEIGH, a longer match
+       further back only counts as better if its match_gain() is no less, so a deep
+       search does not trade a near match for a slightly longer far one
+       that costs more to encode. found(length, distance) is called for
+       each match better than any before it. */
+    template<bool COUNT, bool WEIGH = false, typename Found>
+    LenDist find_matches(u32 max_chain, u32 nice_length, Found const& found){
+        LenDist best {0, 0};
+        if (lookahead < 3)
+            return best;
+        const u32 limit = history_limit();
+        const u8* cur = at(current);
+        u32 currBest = 0;
+        u32 currBestCount = 0;
+        [[maybe_unused]] u32 examined = 0;
+        for(u32 candidate = head[key_at(current)]; candidate >= limit; candidate = prev[candidate & (window_size - 1)]) {
+            if constexpr (COUNT)
+                examined++;
+            //A candidate which differs at the best length so far cannot be longer
+            const u8* past = at(candidate);
+            if (currBestCount > 0 && currBestCount < lookahead && past[currBestCount] != cur[currBestCount]){
+                if (--max_chain == 0)
+                    break;
+                continue;
+            }
+            u32 count = match_length(past, cur, lookahead);
+            if(count > currBestCount && (!WEIGH || currBestCount == 0
+                || match_gain(count, current - candidate) >= match_gain(currBestCount, current - currBest))) {
+                currBest = candidate;
+                currBestCount = count;
+                found(count, current - candidate);
+                if(currBestCount >= nice_length){
+                    break;
+                }
+            }
+            if (--max_chain == 0)
+                break;
+        }
+        if constexpr (COUNT)
+            stats->count_lookup(examined);
+        if (currBestCount == 0)
+            return best;
+        return LenDist{currBestCount, current - currBest};
+    }
+
+    /* Write out the symbols collected so far as one block */
+    void end_block(bool last){
+        if (output_size == 0 && !last)
+            return;
+        trace::Scope scope {"write_block"};
+        auto left = stats ? stats->enter(compress_stats::HUFFMAN) : compress_stats::OTHER;
+        auto started = target_mbps > 0 ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+        u64 start = stream.bits_written();
+        u64 header_end = start;
+        int type = output_size < 200 ? 1 : 2; // not really worth it to write block type 2 for things less than 500 bytes in size
+        write_block(stream, output, output_size, counts, last, type, [&]{
+            header_end = stream.bits_written();
+            if (stats)
+                stats->enter(compress_stats::EMIT);
+        });
+        if (stats){
+            stats->enter(left);
+            stats->blocks.push_back({(u32)type, output_size, header_end - start, stream.bits_written() - header_end});
+        }
+        scope.set_bytes((stream.bits_written() - start) / 8);
+        if (target_mbps > 0){
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+            block_seconds += seconds;
+            if (position > block_position)
+                block_seconds_per_byte = seconds / (position - block_position);
+            block_position = position;
+        }
+        output_size = 0;
+        for(int x = 0; x < SS_TABLE_SIZE; x++) counts.symbolCounts[x] = 0;
+        for(int x = 0; x < DIST_TABLE_SIZE; x++) counts.distCounts[x] = 0;
+    }
+
+    /* End the current block so that a decoder can start at the next one, and
+       remember where that is along with the history it will need */
+    void add_checkpoint(){
+        end_block(false);
+        gzindex::Checkpoint point {position, stream.bits_written(), {}};
+        size_t history = std::min<size_t>(current - history_limit(), inflate::WINDOW_SIZE);
+        point.window.assign(at(current - history), at(current));
+        index.points.push_back(std::move(point));
+        next_checkpoint = position + checkpoint_interval;
+    }
+
+    std::vector<u8> out_bytes;
+    OutputBitStream stream;
+
+    //Positions are renumbered before they get anywhere near 2^32
+    static const u32 REBASE_POSITION = 1u << 31;
+
+    //The settings asked for, and the sizes the arena is laid out with
+    int window_bits {MAX_WINDOW_BITS};
+    int mem_level {MAX_MEM_LEVEL};
+    int level {DEFAULT_LEVEL};
+    double target_mbps {0};
+    u32 window_size {0};
+    u32 hash_bits {0};
+    size_t block_symbols {0};
+    bool huge_pages {false};
+    arena::Arena memory;
+
+    //Positions count input bytes (plus any dictionary) across all streams
+    //since the arena was laid out. window[0] holds position window_start, the look ahead
+    //is [current, pushed), and nothing before history_start belongs to this stream.
+    u8* window;
+    u32 window_start;
+    u32 pushed;
+    u32 current;
+    u32 history_start;
+    u32 lookahead;
+
+    //The match finder: head holds the latest position of each two character
+    //key, and prev the position before that with the same key (indexed
+    //modulo the window size), so each key's occurrences form a chain back through the history
+    u32* head;
+    u32* prev;
+
+    //The parser for the stream's level, with and without stats counting
+    LevelParams params;
+    Parser parser;
+    Parser counting_parser;
+
+    //The match comparison and CRC-32 kernels for this CPU (cpu_dispatch.hpp),
+    //taken from the table at reset() so the parse loop calls them directly
+    u32 (*match_length)(const u8* a, const u8* b, u32 limit);
+    u32 (*crc32_update)(u32 crc, const void* data, size_t size);
+
+    //Lazy parsing: whether the position before current is still to be
+    //encoded, and the match found there (prev_length below 3 if none)
+    bool match_available;
+    u32 prev_length;
+    u32 prev_distance;
+    static const u32 TOO_FAR = 4096;
+
+    //Greedy acceleration: literals in a row since the last match
+    u32 misses;
+
+    //set_target_mbps(): the effort in use (kept from one stream to the
+    //next), and for the interval under way, the input fed and the time it
+    //took; credit is how many seconds compression is ahead of the target
+    //overall. busy_seconds and busy_bytes are the time in compress() and the
+    //input fed since the caller last reported waiting on the output;
+    //backed_up says that it waited long enough that time to count as the
+    //bottleneck, which lowers the target to output_mbps for STALE_INTERVALS
+    //from backed_up_at. Blocks are timed on their own: the time spent
+    //writing them in this interval, and the last one's time per byte of
+    //input (from block_position on).
+    static const size_t ADAPT_INTERVAL = 1 << 17;
+    int effort_index {2};
+    //How long an interval took at each effort lately (0 if never), and
+    //when that was measured, counting intervals: past STALE_INTERVALS the
+    //input may have changed enough that it is worth trying again
+    static const u64 STALE_INTERVALS = 64;
+    std::array<double, NUM_EFFORTS> effort_seconds {};
+    std::array<u64, NUM_EFFORTS> effort_measured {};
+    u64 intervals {0};
+    size_t adapt_bytes;
+    double adapt_seconds;
+    double credit;
+    double busy_seconds;
+    size_t busy_bytes;
+    bool backed_up;
+    double output_mbps;
+    u64 backed_up_at;
+    double block_seconds;
+    double block_seconds_per_byte {0};
+    u64 block_position;
+
+    //Optimal parsing: for each of the segment_length positions since the
+    //segment began (and the one after), the cheapest known cost of reaching
+    //it in sixteenths of a bit and the step which does, plus the input
+    //bytes, and the prices of the symbols for this segment. skip counts
+    //positions still inside a match of the nice length, which are not looked up,
+    //and segment_end is where the segment is to end.
+    u32* segment_cost {nullptr};
+    Step* segment_step;
+    u8* segment_bytes;
+    u32* literal_price;
+    u32* length_price;
+    u32* distance_code_price;
+    u32 segment_length;
+    u32 segment_end;
+    u32 skip;
+
+    //The symbols of the current block
+    Symbol* output;
+    size_t output_size;
+    SymbolCounts counts;
+
+    //Keep a running CRC (or Adler-32) of the data we read.
+    u32 crc;
+    u32 adler;
+    u64 bytes_in;
+    u64 position; //number of input bytes encoded so far
+
+    Format format {Format::Gzip};
+    std::vector<u8> dictionary;
+
+    u64 checkpoint_interval {0};
+    u64 next_checkpoint;
+    gzindex::Index index;
+
+    compress_stats::Stats* stats {nullptr};
+};
+
+}
+
+#endif
@@ -0,0 +1,131 @@
+/* deflate_tables.hpp
+
+   Compile-time tables mapping match lengths and distances to the DEFLATE
+   length/distance symbols and their extra bits (RFC 1951, section 3.2.5).
+
+   Both lookup tables are generated by constexpr functions, so nothing has to
+   be initialized at startup and the whole set of tables fits in under 1 KiB.
+   Each lookup entry packs the code index in the low byte and the number of
+   extra bits in the high byte.
+
+   The distance table uses the same two-level trick as zlib's _dist_code:
+   distances 1..256 are looked up directly, and larger distances are looked up
+   by (distance-1) >> 7, which works because every code above 15 covers a
+   multiple of 128 distances.
+*/
+
+#ifndef DEFLATE_TABLES_HPP
+#define DEFLATE_TABLES_HPP
+
+#include <array>
+#include <cstdint>
+
+namespace deflate_tables {
+
+using u8 = std::uint8_t;
+using u16 = std::uint16_t;
+using u32 = std::uint32_t;
+
+constexpr u32 MIN_MATCH = 3;
+constexpr u32 MAX_MATCH = 258;
+constexpr u32 NUM_LENGTH_CODES = 29;
+constexpr u32 NUM_DIST_CODES = 30;
+constexpr u32 FIRST_LENGTH_SYMBOL = 257;
+
+/* Number of extra bits for each length code (257..285) and distance code (0..29) */
+constexpr std::array<u8, NUM_LENGTH_CODES> length_extra {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+constexpr std::array<u8, NUM_DIST_CODES> dist_extra {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/* Smallest length represented by each length code. Code 285 is special-cased
+   by the RFC to mean exactly 258 instead of continuing the pattern. */
+constexpr std::array<u16, NUM_LENGTH_CODES> make_length_base(){
+    std::array<u16, NUM_LENGTH_CODES> base {};
+    u32 length = MIN_MATCH;
+    for(u32 code = 0; code < NUM_LENGTH_CODES - 1; code++){
+        base[code] = length;
+        length += 1u << length_extra[code];
+    }
+    base[NUM_LENGTH_CODES - 1] = MAX_MATCH;
+    return base;
+}
+
+/* Smallest distance represented by each distance code */
+constexpr std::array<u16, NUM_DIST_CODES> make_dist_base(){
+    std::array<u16, NUM_DIST_CODES> base {};
+    u32 distance = 1;
+    for(u32 code = 0; code < NUM_DIST_CODES; code++){
+        base[code] = distance;
+        distance += 1u << dist_extra[code];
+    }
+    return base;
+}
+
+constexpr std::array<u16, NUM_LENGTH_CODES> length_base = make_length_base();
+constexpr std::array<u16, NUM_DIST_CODES> dist_base = make_dist_base();
+
+/* Indexed by (length - 3) */
+constexpr std::array<u16, MAX_MATCH - MIN_MATCH + 1> make_length_code(){
+    std::array<u16, MAX_MATCH - MIN_MATCH + 1> table {};
+    for(u32 code = 0; code < NUM_LENGTH_CODES - 1; code++){
+        for(u32 j = 0; j < (1u << length_extra[code]); j++)
+            table[length_base[code] - MIN_MATCH + j] = code | (length_extra[code] << 8);
+    }
+    //258 could also be encoded as 284 with all extra bits set, but gzip expects 285
+    table[MAX_MATCH - MIN_MATCH] = (NUM_LENGTH_CODES - 1);
+    return table;
+}
+
+/* First 256 entries are indexed by (distance - 1), the remaining 256 by 256 + ((distance - 1) >> 7) */
+constexpr std::array<u16, 512> make_dist_code(){
+    std::array<u16, 512> table {};
+    for(u32 code = 0; code < NUM_DIST_CODES; code++){
+        u32 first = dist_base[code] - 1;
+        u32 last = first + (1u << dist_extra[code]);
+        u16 entry = code | (dist_extra[code] << 8);
+        for(u32 d = first; d < last; d++){
+            if (d < 256)
+                table[d] = entry;
+            else if ((d & 127) == 0)
+                table[256 + (d >> 7)] = entry;
+        }
+    }
+    return table;
+}
+
+constexpr std::array<u16, MAX_MATCH - MIN_MATCH + 1> length_code = make_length_code();
+constexpr std::array<u16, 512> dist_code = make_dist_code();
+
+/* Unpack a table entry */
+constexpr u32 entry_code(u16 entry){
+    return entry & 0xff;
+}
+constexpr u32 entry_extra_bits(u16 entry){
+    return entry >> 8;
+}
+
+/* Look up the packed entry for a match length in [3, 258] */
+constexpr u16 length_entry(u32 length){
+    return length_code[length - MIN_MATCH];
+}
+
+/* Look up the packed entry for a distance in [1, 32768] */
+constexpr u16 dist_entry(u32 distance){
+    u32 d = distance - 1;
+    return d < 256 ? dist_code[d] : dist_code[256 + (d >> 7)];
+}
+
+static_assert(length_base[NUM_LENGTH_CODES - 2] == 227, "length bases do not match RFC 1951");
+static_assert(dist_base[NUM_DIST_CODES - 1] == 24577, "distance bases do not match RFC 1951");
+static_assert(entry_code(length_entry(258)) == 28 && entry_code(length_entry(257)) == 27, "length 258 must use code 285");
+static_assert(entry_code(dist_entry(32768)) == 29 && entry_extra_bits(dist_entry(32768)) == 13, "bad distance table");
+static_assert(entry_code(dist_entry(257)) == 16 && entry_code(dist_entry(256)) == 15, "bad distance table");
+
+}
+
+#endif
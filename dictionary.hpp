@@ -0,0 +1,129 @@
+/* dictionary.hpp
+
+   Training a preset dictionary (see Compressor::set_dictionary()) from
+   sample data, for compressing many small inputs which share a lot of
+   content, such as JSON messages with the same keys.
+
+   The method follows the COVER algorithm of zstd's dictionary builder. Every
+   8 byte substring is scored by the number of samples it occurs in. The
+   concatenated samples are cut into as many stretches ("epochs") as there
+   are segments in the dictionary, and from each stretch the 64 byte segment
+   whose substrings have the highest total score is taken. The substrings of
+   a chosen segment then score zero, so later picks favour content which is
+   not in the dictionary yet. The best segments go at the end of the
+   dictionary, where back-references to them are shortest.
+*/
+
+#ifndef DICTIONARY_HPP
+#define DICTIONARY_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace dictionary {
+
+using u8 = std::uint8_t;
+using u32 = std::uint32_t;
+using u64 = std::uint64_t;
+
+/* The compressor can only reach back 32 KiB */
+const size_t MAX_SIZE = 32768;
+/* Length of the substrings which are counted */
+const size_t DMER = 8;
+/* Length of the pieces the dictionary is made of */
+const size_t SEGMENT = 64;
+/* Samples longer than this are split, so that one big file counts as many samples */
+const size_t SAMPLE_SIZE = 16384;
+
+inline u64 dmer_at(const u8* p){
+    u64 v;
+    std::memcpy(&v, p, DMER);
+    return v;
+}
+
+/* Build a dictionary of at most size bytes from the samples */
+inline std::vector<u8> train(std::vector<std::vector<u8>> const& samples, size_t size = MAX_SIZE){
+    size = std::min(size, MAX_SIZE);
+
+    //All samples back to back, and the start of each sample
+    std::vector<u8> all;
+    std::vector<size_t> starts;
+    for(auto const& sample: samples){
+        for(size_t pos = 0; pos < sample.size(); pos += SAMPLE_SIZE){
+            starts.push_back(all.size());
+            all.insert(all.end(), sample.begin() + pos, sample.begin() + std::min(sample.size(), pos + SAMPLE_SIZE));
+        }
+    }
+    starts.push_back(all.size());
+    if (all.size() < SEGMENT)
+        return all;
+
+    //The number of samples each substring occurs in
+    struct Count {
+        u32 samples {0};
+        u32 last_sample {UINT32_MAX};
+    };
+    std::unordered_map<u64, Count> counts;
+    for(size_t s = 0; s + 1 < starts.size(); s++){
+        for(size_t pos = starts[s]; pos + DMER <= starts[s + 1]; pos++){
+            Count& c = counts[dmer_at(all.data() + pos)];
+            if (c.last_sample != s){
+                c.samples++;
+                c.last_sample = s;
+            }
+        }
+    }
+    //A substring which only occurs in one sample is of no use for the others
+    auto score = [&](size_t pos) -> u64 {
+        u32 n = counts[dmer_at(all.data() + pos)].samples;
+        return n >= 2 ? n : 0;
+    };
+
+    //Take the best segment from each epoch
+    size_t segments = std::max<size_t>(1, std::min(size / SEGMENT, all.size() / SEGMENT));
+    size_t epoch = all.size() / segments;
+    std::vector<std::pair<u64, size_t>> chosen; //(score, position)
+    for(size_t e = 0; e < segments; e++){
+        size_t begin = e * epoch;
+        size_t end = std::min(all.size(), begin + std::max(epoch, SEGMENT));
+        if (end - begin < SEGMENT)
+            continue;
+        //Slide a window of SEGMENT bytes, keeping the total score of the substrings in it
+        const size_t window = SEGMENT - DMER + 1;
+        u64 total = 0;
+        for(size_t i = 0; i < window; i++)
+            total += score(begin + i);
+        u64 best = total;
+        size_t best_pos = begin;
+        for(size_t pos = begin + 1; pos + SEGMENT <= end; pos++){
+            total += score(pos + window - 1);
+            total -= score(pos - 1);
+            if (total > best){
+                best = total;
+                best_pos = pos;
+            }
+        }
+        if (best == 0)
+            continue;
+        chosen.emplace_back(best, best_pos);
+        for(size_t i = 0; i < window; i++)
+            counts[dmer_at(all.data() + best_pos + i)].samples = 0;
+    }
+
+    //Weakest first, so the best segments are closest to the data
+    std::stable_sort(chosen.begin(), chosen.end(), [](auto const& a, auto const& b){
+        return a.first < b.first;
+    });
+    std::vector<u8> dict;
+    for(auto const& c: chosen)
+        dict.insert(dict.end(), all.begin() + c.second, all.begin() + c.second + SEGMENT);
+    return dict;
+}
+
+}
+
+#endif
@@ -3,714 +3,751 @@
    Dana Wiltsie - 06/15/2020
 */
 #include <iostream>
+#include <fstream>
 #include <vector>
-#include <array>
-#include <unordered_map>
 #include <string>
-#include <list>
-#include <iterator>
-#include <cassert>
-#include <map>
-#include <string>
-#include "output_stream.hpp"
-
-// To compute CRC32 values, we can use this library
-// from https://github.com/d-bahr/CRCpp
-#define CRCPP_USE_CPP11
-#include "CRC.h"
-
-#include <queue>
-
-// BELOW is huffman tree code from https://www.geeksforgeeks.org/huffman-coding-greedy-algo-3/ adapted for use here. 
-// I use it to compute just the lengths
-
-// A Huffman tree node 
-struct MinHeapNode { 
-
-	// One of the input characters 
-	int data; 
-
-	// Frequency of the character 
-	unsigned freq; 
-
-	// Left and right child 
-	MinHeapNode *left, *right; 
-
-	MinHeapNode(int data, unsigned freq) 
-
-	{ 
-
-		left = right = NULL; 
-		this->data = data; 
-		this->freq = freq; 
-	} 
-}; 
-
-// For comparison of 
-// two heap nodes (needed in min heap) 
-struct compare { 
-
-	bool operator()(MinHeapNode* l, MinHeapNode* r) 
-
-	{ 
-		return (l->freq > r->freq); 
-	} 
-}; 
-
-// Prints huffman codes from 
-// the root of Huffman Tree. 
-void printCodes(struct MinHeapNode* root, int height, std::vector<u32>& result) 
-{ 
-
-	if (!root) 
-		return; 
-
-
-	if (root->data != -1) {
-        if(height == 0){
-            result[root->data] = 1;
-        } else {
-            result[root->data] = height;
-        }
-	}
-		 
-
-	printCodes(root->left, height + 1, result); 
-	printCodes(root->right, height + 1, result); 
-} 
-
-// The main function that builds a Huffman Tree and 
-// print codes by traversing the built Huffman Tree 
-void HuffmanCodes(int freq[], int size, std::vector<u32>& result) 
-{ 
-	struct MinHeapNode *left, *right, *top; 
-
-	// Create a min heap & inserts all characters of data[] 
-	std::priority_queue<MinHeapNode*, std::vector<MinHeapNode*>, compare> minHeap; 
-
-	for (int i = 0; i < size; ++i) {
-        if(freq[i] != 0){
-            minHeap.push(new MinHeapNode(i, freq[i]));
-        }
-    } 
-
-	// Iterate while size of heap doesn't become 1 
-	while (minHeap.size() != 1) { 
-
-		// Extract the two minimum 
-		// freq items from min heap 
-		left = minHeap.top(); 
-		minHeap.pop(); 
-
-		right = minHeap.top(); 
-		minHeap.pop(); 
-
-		// Create a new internal node with 
-		// frequency equal to the sum of the 
-		// two nodes frequencies. Make the 
-		// two extracted node as left and right children 
-		// of this new node. Add this node 
-		// to the min heap '$' is a special value 
-		// for internal nodes, not used 
-		top = new MinHeapNode(-1, left->freq + right->freq); 
-
-		top->left = left; 
-		top->right = right; 
-
-		minHeap.push(top); 
-	} 
-
-	// Print Huffman codes using 
-	// the Huffman tree built above 
-	printCodes(minHeap.top(), 0, result); 
-} 
-
-//BELOW is the rest of the project
-
-struct LenDist {
-    u32 length;
-    u32 distance;
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <cstdio>
+#include <cerrno>
+#include <system_error>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "deflate.hpp"
+#include "inflate.hpp"
+#include "gzindex.hpp"
+#include "bgzf.hpp"
+#include "parallel_inflate.hpp"
+#include "speculative_inflate.hpp"
+#include "dictionary.hpp"
+#include "server.hpp"
+#include "pipeline.hpp"
+#include "trace.hpp"
+#include "cpu_dispatch.hpp"
+
+struct Options {
+    bool decompress {false};
+    bool bgzf {false};
+    unsigned threads {1};
+    std::string index_file {};
+    u64 index_span {1 << 20};
+    bool extract_range {false};
+    u64 range_offset {0};
+    u64 range_length {0};
+    u64 flush_ms {0};
+    u64 flush_bytes {0};
+    deflate::Flush flush_mode {deflate::Flush::Sync};
+    deflate::Format format {deflate::Format::Gzip};
+    std::string dictionary_file {};
+    std::vector<u8> dictionary {};
+    std::string serve_socket {};
+    std::string connect_socket {};
+    bool send_fd {false};
+    bool keep {false};
+    std::vector<std::string> files {};
+    int window_bits {deflate::MAX_WINDOW_BITS};
+    int mem_level {deflate::MAX_MEM_LEVEL};
+    bool huge_pages {false};
+    int level {deflate::DEFAULT_LEVEL};
+    double target_mbps {0};
+    bool memory_options {false};
+    bool stats {false};
+    bool perf_counters {false};
+    std::string trace_file {};
+    pipeline::Io io {pipeline::Io::Sync};
+    bool io_option {false};
+    cpu::Level cpu_level {cpu::Level::Generic};
+    bool cpu_option {false};
 };
 
-const int THRESHOLD = 250;
-const int MAX_BLOCK_SIZE = 800000;
-const int MAX_CODE_LENGTH = 15;
-const int CL_TABLE_SIZE = 19;
-const int SS_TABLE_SIZE = 286;
-const int DIST_TABLE_SIZE = 30;
-const int SYMBOLS_ARRAY_INIT_VAL = 300;
-const int DIST_SYMBOLS_ARRAY_INIT_VAL = 32770;
-const int MAX_BACKREF_DIST = 32768;
-
-
-struct Symbol {
-    u32 value;
-    u32 offset;
-    u32 offbits;
-    bool isLength;
-};
-
-Symbol symbols [SYMBOLS_ARRAY_INIT_VAL];
-int symbolCounts [SS_TABLE_SIZE];
-Symbol distSymbols [DIST_SYMBOLS_ARRAY_INIT_VAL];
-int distCounts [DIST_TABLE_SIZE];
-int clCounts [CL_TABLE_SIZE];
-
-std::vector< u32 > construct_canonical_code( std::vector<u32> const & lengths ){
-
-    unsigned int size = lengths.size();
-    std::vector< unsigned int > length_counts(MAX_CODE_LENGTH+1,0); //Lengths must be less than 16 for DEFLATE
-    u32 max_length = 0;
-    for(auto i: lengths){
-        assert(i <= MAX_CODE_LENGTH);
-        length_counts.at(i)++;
-        max_length = std::max(i, max_length);
+/* Compress to BGZF what read(buffer, size) returns (0 at the end of the
+   input), passing the output to write(data, size) */
+template<typename Read, typename Write>
+void compress_bgzf(Read const& read, Write const& write){
+    bgzf::BgzfWriter writer;
+    std::vector<char> chunk(1 << 16);
+    while (true){
+        size_t got = read(chunk.data(), chunk.size());
+        if (got == 0)
+            break;
+        writer.write((const u8*)chunk.data(), got);
+        auto& bytes = writer.output_bytes();
+        write(bytes.data(), bytes.size());
+        bytes.clear();
     }
-    length_counts[0] = 0; //Disregard any codes with alleged zero length
-
-    std::vector< u32 > result_codes(size,0);
+    writer.finish();
+    auto& bytes = writer.output_bytes();
+    write(bytes.data(), bytes.size());
+}
 
-    //The algorithm below follows the pseudocode in RFC 1951
-    std::vector< unsigned int > next_code(size,0);
-    {
-        //Step 1: Determine the first code for each length
-        unsigned int code = 0;
-        for(unsigned int i = 1; i <= max_length; i++){
-            code = (code+length_counts.at(i-1))<<1;
-            next_code.at(i) = code;
-        }
-    }
-    {
-        //Step 2: Assign the code for each symbol, with codes of the same length being
-        //        consecutive and ordered lexicographically by the symbol to which they are assigned.
-        for(unsigned int symbol = 0; symbol < size; symbol++){
-            unsigned int length = lengths.at(symbol);
-            if (length > 0) {
-                result_codes.at(symbol) = next_code.at(length)++;
-            }
-        }  
-    } 
-    return result_codes;
+void compress_bgzf(std::istream& in_stream, std::ostream& out_stream){
+    compress_bgzf([&](char* buffer, size_t size){
+        return (size_t)in_stream.rdbuf()->sgetn(buffer, size);
+    }, [&](const u8* data, size_t size){
+        out_stream.write((const char*)data, size);
+    });
+    out_stream.flush();
 }
 
-//gzip has a peculier but interesting way to represent the symbols and their distances generated
-//by the algorithm. Unfortuately this means that the code to genenerate such tables is a little ugly.
-void init_symbol_table() {
-    u32 offset_bits = 0;
-    int items_placed = 0;
-    u32 index = 3;
-    for(u32 i = 257; i <= 284; i++){
-        for(u32 j = 0; j < (u32)(1 << offset_bits); j++) {
-            symbols[index] = Symbol{i, j, offset_bits, true};    
-            index++;
+/* compress_bgzf() between two file descriptors. Throws std::system_error on a read or write error. */
+void compress_bgzf(int in_fd, int out_fd){
+    compress_bgzf([&](char* buffer, size_t size){
+        while (true){
+            ssize_t got = read(in_fd, buffer, size);
+            if (got >= 0)
+                return (size_t)got;
+            if (errno != EINTR)
+                throw std::system_error(errno, std::generic_category(), "read");
         }
-        items_placed++;
-        if (i >= 264 && items_placed >= 4) {
-            offset_bits++;
-            items_placed = 0;
+    }, [&](const u8* data, size_t size){
+        while (size > 0){
+            ssize_t n = write(out_fd, data, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                throw std::system_error(errno, std::generic_category(), "write");
+            data += n;
+            size -= n;
         }
-    }
-    symbols[258] = Symbol{285,0,0,true};
+    });
 }
 
-void init_distance_table() {
-    u32 offset_bits = 0;
-    int items_placed = 0;
-    u32 index = 1;
-    distSymbols[0] = Symbol{0, 0, 0, false};
-    for(u32 i = 0; i <= 29; i++){
-        for(u32 j = 0; j < (u32)(1 << offset_bits); j++) {
-            distSymbols[index] = Symbol{i, j, offset_bits, false};    
-            index++;
-        }
-        items_placed++;
-        if (i >= 3 && items_placed >= 2) {
-            offset_bits++;
-            items_placed = 0;
+/* Read whatever input is available, up to size bytes, waiting at most
+   timeout_ms for some to arrive (forever if timeout_ms is negative).
+   Returns the number of bytes read, 0 at the end of the input, or -1 on
+   timeout. Throws std::system_error if the input cannot be read. */
+ssize_t read_available(int fd, char* buffer, size_t size, int timeout_ms){
+    while (true){
+        pollfd p {fd, POLLIN, 0};
+        int ready = poll(&p, 1, timeout_ms);
+        if (ready == 0)
+            return -1;
+        if (ready < 0){
+            if (errno != EINTR)
+                throw std::system_error(errno, std::generic_category(), "poll");
+            continue;
         }
+        ssize_t got = read(fd, buffer, size);
+        if (got >= 0)
+            return got;
+        if (errno != EINTR && errno != EAGAIN)
+            throw std::system_error(errno, std::generic_category(), "read");
     }
 }
 
-//This function take a list of lengths generated by a huffman tree, and modifies it to 
-//enforce a maximum length while still maintaining the properties of the huffman code.
-void enforceMaxLength(std::vector<u32>& result, int size, u32 MAX_LENGTH){
-    while (1){
-        int index1 = -1;
-        int index2 = -1;
-        u32 maxlen = MAX_LENGTH;
-        for (int i = 0; i < size; i++) {
-            if (result[i] > maxlen){
-                index1 = i;
-                index2 = -1;
-                maxlen = result[i];
-            }
-            else if (result[i] == maxlen) {
-                index2 = i;
-            }
+/* Compress stdin with a flush whenever flush_bytes bytes have come in since
+   the last one, or when input has been waiting flush_ms milliseconds, so a
+   slow stream reaches the reader with bounded delay */
+void compress_streaming(deflate::Compressor& compressor, std::ostream& out_stream, Options const& options){
+    using Clock = std::chrono::steady_clock;
+    auto write_out = [&]{
+        auto& bytes = compressor.output_bytes();
+        trace::Scope scope {"write", bytes.size()};
+        out_stream.write((const char*)bytes.data(), bytes.size());
+        bytes.clear();
+    };
+    u64 since_flush = 0;
+    Clock::time_point deadline;
+    auto flush = [&]{
+        {
+            trace::Scope scope {"flush"};
+            compressor.flush(options.flush_mode);
+        }
+        write_out();
+        out_stream.flush();
+        since_flush = 0;
+    };
+
+    std::vector<char> chunk(1 << 16);
+    while (true){
+        int timeout = -1;
+        if (options.flush_ms > 0 && since_flush > 0){
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+            timeout = std::max<long long>(left, 0);
+        }
+        ssize_t got;
+        {
+            trace::Scope scope {"read"};
+            got = read_available(STDIN_FILENO, chunk.data(), chunk.size(), timeout);
+            scope.set_bytes(std::max<ssize_t>(got, 0));
         }
-        if (index1 == -1){
+        if (got == 0)
             break;
+        if (got < 0){
+            flush();
+            continue;
         }
-
-        //find node as close to limit as possible
-        int swapi = -1;
-        u32 level = 0;
-        for (int i = 0; i < size; i++) {
-            if(result[i] > level && result[i] < MAX_LENGTH) {
-                swapi = i;
-                level = result[i];
+        if (since_flush == 0)
+            deadline = Clock::now() + std::chrono::milliseconds(options.flush_ms);
+        const u8* data = (const u8*)chunk.data();
+        while (got > 0){
+            size_t n = got;
+            if (options.flush_bytes > 0)
+                n = std::min<u64>(n, options.flush_bytes - since_flush);
+            {
+                trace::Scope scope {"compress", n};
+                compressor.compress(data, n);
             }
+            data += n;
+            got -= n;
+            since_flush += n;
+            if (options.flush_bytes > 0 && since_flush >= options.flush_bytes)
+                flush();
         }
-        result[swapi]++;
-        result[index1] = result[swapi];
-        result[index2]--;
+        write_out();
+        if (options.flush_ms > 0 && since_flush > 0 && Clock::now() >= deadline)
+            flush();
     }
 }
 
-struct CLSymbol {
-    u32 value;
-    u32 offset;
-    u32 numbits;
-};
-
-void write_non_zero_cl(std::list<CLSymbol>& clsymbols, u32 count, u32 const & last_seen) {
-    while(count >= 6) {
-        clsymbols.push_back(CLSymbol{16, 3, 2});
-        clCounts[16]++;
-        count = count - 6;
-    }
-    if (count >= 3) {
-        u32 num = count - 3;
-        clsymbols.push_back(CLSymbol{16, num, 2});
-        clCounts[16]++;
-        count = 0;
-    }
-    while(count > 0) {
-        clsymbols.push_back(CLSymbol{last_seen, 0, 0});
-        clCounts[last_seen]++;
-        count--;
+void compress(std::istream& in_stream, std::ostream& out_stream, Options const& options){
+    if (options.bgzf)
+        return compress_bgzf(in_stream, out_stream);
+
+    deflate::Compressor compressor {options.window_bits, options.mem_level};
+    compressor.set_huge_pages(options.huge_pages);
+    compressor.set_level(options.level);
+    compressor.set_target_mbps(options.target_mbps);
+    compressor.set_format(options.format);
+    compressor.set_dictionary(options.dictionary.data(), options.dictionary.size());
+    if (!options.index_file.empty())
+        compressor.set_checkpoint_interval(options.index_span);
+    compress_stats::Stats stats;
+    if (options.perf_counters && !stats.count_events())
+        std::cerr << "gzcomp: hardware performance counters are not available here" << std::endl;
+    if (options.stats)
+        compressor.set_stats(&stats);
+    compressor.reset();
+
+    if (options.flush_ms > 0 || options.flush_bytes > 0){
+        compress_streaming(compressor, out_stream, options);
+        compressor.finish();
+        auto& bytes = compressor.output_bytes();
+        out_stream.write((const char*)bytes.data(), bytes.size());
+        out_stream.flush();
+    } else {
+        pipeline::Pipeline pipeline {options.io};
+        pipeline.compress(compressor, STDIN_FILENO, STDOUT_FILENO);
     }
-}
 
-void write_zero_cl(std::list<CLSymbol>& clsymbols, u32 count) {
-    if (count >= 11) {
-        clsymbols.push_back(CLSymbol{18, count - 11, 7});
-        clCounts[18]++;
-        count = 0;
-    }
-    if (count >= 3) {
-        u32 num = count - 3;
-        clsymbols.push_back(CLSymbol{17, num, 3});
-        clCounts[17]++;
-        count = 0;
-    }
-    while(count > 0){
-        clsymbols.push_back(CLSymbol{0, 0, 0});
-        clCounts[0]++;
-        count--;
+    if (!options.index_file.empty()){
+        std::ofstream index_stream {options.index_file, std::ios::binary};
+        compressor.checkpoints().write(index_stream);
     }
+    if (options.stats)
+        stats.write_json(std::cerr);
 }
 
-void write_cl_symbol_stream(std::vector<u32>& code_lengths, int size, std::list<CLSymbol>& clsymbols){
-    //compute CL stream
-        u32 last_seen = 16;
-        u32 count = 0;
-        int i = 0;
-        while(i < size) {
-            while(i < size && code_lengths[i] == 0) {
-                if (last_seen != 0){
-                    write_non_zero_cl(clsymbols, count, last_seen);
-                    count = 0;
-                    last_seen = 0;
-                }
-                count++;
-                if(count == 138) {
-                    clsymbols.push_back(CLSymbol{18, 138 - 11, 7});
-                    clCounts[18]++;
-                    count = 0;
-                }
-                i++;
+/* Compress each named file to file.gz next to it, removing the original
+   unless options.keep is set. The files are handed out largest first to
+   options.threads workers, so the biggest file starts right away instead of
+   being the last one left running, and each worker keeps one compressor and
+   its buffers for all the files it takes. Returns 0 if every file was
+   compressed, 1 otherwise (the other files are still done). */
+int compress_files(Options const& options){
+    std::mutex report_mutex;
+    bool failed = false;
+    auto report = [&](std::string const& file, std::string const& message){
+        std::lock_guard<std::mutex> lock {report_mutex};
+        std::cerr << "gzcomp: " << file << ": " << message << std::endl;
+        failed = true;
+    };
+
+    struct Job {
+        std::string path;
+        off_t size;
+        mode_t mode;
+    };
+    std::vector<Job> jobs;
+    std::set<std::pair<dev_t, ino_t>> seen;
+    for(auto const& file: options.files){
+        struct stat st;
+        if (stat(file.c_str(), &st) != 0){
+            report(file, "no such file");
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)){
+            report(file, "not a regular file, skipped");
+            continue;
+        }
+        if (file.size() > 3 && file.compare(file.size() - 3, 3, ".gz") == 0){
+            report(file, "already has .gz suffix, skipped");
+            continue;
+        }
+        //Two workers must never compress the same file (under one name or two) at once
+        if (!seen.insert({st.st_dev, st.st_ino}).second){
+            report(file, "given more than once, skipped");
+            continue;
+        }
+        jobs.push_back({file, st.st_size, st.st_mode});
+    }
+    std::stable_sort(jobs.begin(), jobs.end(), [](Job const& a, Job const& b){
+        return a.size > b.size;
+    });
+
+    std::atomic<size_t> next_job {0};
+    auto worker = [&]{
+        deflate::Compressor compressor {options.window_bits, options.mem_level};
+        compressor.set_huge_pages(options.huge_pages);
+        compressor.set_level(options.level);
+        compressor.set_target_mbps(options.target_mbps);
+        pipeline::Pipeline pipeline {options.io};
+        for(size_t i = next_job++; i < jobs.size(); i = next_job++){
+            Job const& job = jobs[i];
+            trace::Scope scope {"file", (u64)job.size};
+            std::string out_path = job.path + ".gz";
+            int in_fd = open(job.path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (in_fd < 0){
+                report(job.path, "cannot open");
+                continue;
             }
-            while(i < size && code_lengths[i] != 0) {
-                //std::cout << "curr:" << code_lengths[i] << "\n";
-                if(last_seen == 0) {
-                    write_zero_cl(clsymbols, count);
-                    clsymbols.push_back(CLSymbol{code_lengths[i], 0, 0});
-                    clCounts[code_lengths[i]]++;
-                    count = 0;
-                    last_seen = code_lengths[i];
-                } else if (last_seen != code_lengths[i]){
-                    write_non_zero_cl(clsymbols, count, last_seen);
-                    clsymbols.push_back(CLSymbol{code_lengths[i], 0, 0});
-                    clCounts[code_lengths[i]]++;
-                    count = 0;
-                    last_seen = code_lengths[i];
+            //O_EXCL, so that an existing file is never overwritten, even one created since the check
+            int out_fd = open(out_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (out_fd < 0){
+                report(job.path, errno == EEXIST ? out_path + " already exists, skipped" : "cannot create " + out_path);
+                close(in_fd);
+                continue;
+            }
+            std::string error;
+            try {
+                if (options.bgzf){
+                    compress_bgzf(in_fd, out_fd);
                 } else {
-                    count++;
+                    compressor.reset();
+                    pipeline.compress(compressor, in_fd, out_fd);
                 }
-                i++;
+            } catch (std::system_error const& e){
+                error = e.what();
             }
-        }
-        if(count > 0) {
-            if(last_seen == 0) {
-                write_zero_cl(clsymbols, count);
-            } else {
-                write_non_zero_cl(clsymbols, count, last_seen);
+            close(in_fd);
+            if (close(out_fd) != 0 && error.empty())
+                error = "error while writing " + out_path;
+            if (!error.empty()){
+                report(job.path, error);
+                std::remove(out_path.c_str());
+                continue;
             }
+            chmod(out_path.c_str(), job.mode & 07777);
+            if (!options.keep)
+                std::remove(job.path.c_str());
         }
+    };
+    unsigned threads = std::max<size_t>(1, std::min<size_t>(options.threads, jobs.size()));
+    std::vector<std::thread> pool;
+    for(unsigned t = 1; t < threads; t++)
+        pool.emplace_back([&]{
+            trace::name_thread("worker");
+            worker();
+        });
+    worker();
+    for(auto& t: pool)
+        t.join();
+    return failed ? 1 : 0;
 }
 
-void write_block(OutputBitStream& stream, std::list<Symbol>& output, bool is_last, int type){
-    stream.push_bit(is_last?1:0); //1 = last block
-
-    //We will construct placeholder LL and distance codes
-    std::vector<u32> ll_code_lengths {};
-    std::vector<u32> dist_code_lengths {};
-
-    if (type == 1) {
-        stream.push_bits(1, 2); //Two bit block type (in this case, block type 1)
-        //Construct a basic code with 0 - 225 having length 8 and 226 - 285 having length 9
-        //(This will satisfy the Kraft-McMillan inequality exactly, and thereby fool gzip's
-        // detection process for suboptimal codes)
-        for(unsigned int i = 0; i <= 143; i++)
-            ll_code_lengths.push_back(8);
-        for(unsigned int i = 144; i <= 255; i++)
-            ll_code_lengths.push_back(9);
-        for(unsigned int i = 256; i <= 279; i++)
-            ll_code_lengths.push_back(7);
-        for(unsigned int i = 280; i <= 287; i++)
-            ll_code_lengths.push_back(8);
-
-        //Construct a distance code similarly, with 0 - 1 having length 4 and 2 - 29 having length 5
-        //(This is irrelevant since we don't actually use distance codes in this example)
-        for(unsigned int i = 0; i <= 29; i++)
-            dist_code_lengths.push_back(5);
-    } else {
-        //type 2
-        stream.push_bits(2, 2); //Two bit block type (in this case, block type 2)
-        
-        std::vector<u32> result(SS_TABLE_SIZE, 0);
-        symbolCounts[256]++; //end of file symbol occurs once
-        HuffmanCodes(symbolCounts, SS_TABLE_SIZE, result);
-        enforceMaxLength(result, SS_TABLE_SIZE, MAX_CODE_LENGTH);
-        ll_code_lengths = result;
-
-
-        std::vector<u32> result2(DIST_TABLE_SIZE, 0);
-        HuffmanCodes(distCounts, DIST_TABLE_SIZE, result2);
-        enforceMaxLength(result2, DIST_TABLE_SIZE, MAX_CODE_LENGTH);
-        dist_code_lengths = result2;
-
-        int numSym = ll_code_lengths.size();
-        for(int i = ll_code_lengths.size() -1; i >= 0 && ll_code_lengths.at(i) == 0; i--) {
-            numSym--;
-        }
-
-        unsigned int HLIT = numSym - 257;
-
-        int numDistSym = dist_code_lengths.size();
-        for(int i = dist_code_lengths.size() -1; i >= 0 && dist_code_lengths.at(i) == 0; i--) {
-            numDistSym--;
-        }
-
-        std::list<CLSymbol> clsymbols;
-        write_cl_symbol_stream(ll_code_lengths, numSym, clsymbols);
-        write_cl_symbol_stream(dist_code_lengths, numDistSym, clsymbols);
-
-        std::vector<u32> result3(CL_TABLE_SIZE, 0);
-        HuffmanCodes(clCounts, CL_TABLE_SIZE, result3);
-        enforceMaxLength(result3, CL_TABLE_SIZE, 7);
-
-        std::vector<u32> cl_code_lengths = result3;
-        auto cl_code = construct_canonical_code(cl_code_lengths);
-
-        //Variables are named as in RFC 1951
-        assert(ll_code_lengths.size() >= 257); //There needs to be at least one use of symbol 256, so the ll_code_lengths table must have at least 257 elements
+//Read the whole stream into memory (the decoder works on a contiguous buffer)
+std::vector<u8> read_all(std::istream& input){
+    std::vector<u8> data;
+    const size_t CHUNK = 1 << 20;
+    size_t got = 0;
+    do {
+        data.resize(data.size() + CHUNK);
+        got = input.rdbuf()->sgetn((char*)data.data() + data.size() - CHUNK, CHUNK);
+        data.resize(data.size() - CHUNK + got);
+    } while (got == CHUNK);
+    return data;
+}
 
-        unsigned int HDIST = 0;
-        if (dist_code_lengths.size() == 0){
-            //Even if no distance codes are used, we are required to encode at least one.
-        }else{
-            HDIST = numDistSym - 1;
+//The compressed input, mapped directly if stdin is a regular file and read into memory otherwise
+class InputData {
+public:
+    InputData(std::istream& input, int fd){
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED){
+                mapped = (const u8*)p;
+                mapped_size = st.st_size;
+                return;
+            }
         }
-        
-        std::vector<u32> cl_permutation {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+        contents = read_all(input);
+    }
+    ~InputData(){
+        if (mapped)
+            munmap((void*)mapped, mapped_size);
+    }
+    const u8* data() const {
+        return mapped ? mapped : contents.data();
+    }
+    size_t size() const {
+        return mapped ? mapped_size : contents.size();
+    }
+private:
+    const u8* mapped {nullptr};
+    size_t mapped_size {0};
+    std::vector<u8> contents;
+};
 
-        unsigned int HCLEN = 19; 
-        int numClSym = cl_permutation.size();
-        for (unsigned int i = cl_permutation.size() - 1; i >= 0 && cl_code_lengths.at(cl_permutation.at(i)) == 0; i--){
-            numClSym--;
+int decompress(std::istream& input, std::ostream& output, Options const& options){
+    InputData data {input, STDIN_FILENO};
+    auto sink = [&](const u8* bytes, size_t n){
+        trace::Scope scope {"write", n};
+        output.write((const char*)bytes, n);
+    };
+    try {
+        if (options.format == deflate::Format::Zlib){
+            inflate::unzlib(data.data(), data.size(), sink, options.dictionary);
+        } else if (options.format == deflate::Format::Raw){
+            inflate::inflate_raw(data.data(), data.size(), sink, options.dictionary);
+        } else if (!options.index_file.empty()){
+            std::ifstream index_stream {options.index_file, std::ios::binary};
+            if (!index_stream)
+                throw gzindex::IndexError("cannot open " + options.index_file);
+            auto index = gzindex::Index::read(index_stream);
+            if (options.extract_range)
+                gzindex::extract(data.data(), data.size(), index, options.range_offset, options.range_length, sink);
+            else
+                parallel_inflate::gunzip_indexed(data.data(), data.size(), index, options.threads, sink);
+        } else if (options.threads > 1 && speculative_inflate::applies(data.data(), data.size())){
+            speculative_inflate::gunzip(data.data(), data.size(), options.threads, sink);
+        } else {
+            parallel_inflate::gunzip(data.data(), data.size(), options.threads, sink);
         }
-        HCLEN = numClSym - 4;
-
-        //Push HLIT, HDIST and HCLEN. These are all numbers so Rule #1 applies
-        stream.push_bits(HLIT, 5);
-        stream.push_bits(HDIST,5);
-        stream.push_bits(HCLEN,4);
-
-        //The lengths are written in a strange order, dictated by RFC 1951
-        //(This seems like a sadistic twist of the knife, but there is some amount of weird logic behind the ordering)
-
-        //Now push each CL code length in 3 bits (the lengths are numbers, so Rule #1 applies)
-        for (unsigned int i = 0; i < HCLEN+4; i++)
-            stream.push_bits(cl_code_lengths.at(cl_permutation.at(i)),3); 
-
-        for(auto it = clsymbols.begin(); it != clsymbols.end(); it++) {
-            auto code = cl_code[(*it).value];
-            auto bits = cl_code_lengths[(*it).value];
+    } catch (std::runtime_error const& e){
+        output.flush();
+        std::cerr << "gzcomp: " << e.what() << std::endl;
+        return 1;
+    }
+    output.flush();
+    return 0;
+}
 
-            for(int i = bits-1; i >= 0; i--)
-                stream.push_bit((code>>(unsigned int)i)&1);
-            
-            if((*it).numbits != 0) {
-                stream.push_bits((*it).offset, (*it).numbits);
+/* gzcomp train: build a preset dictionary from sample files */
+int train(int argc, char** argv){
+    size_t size = dictionary::MAX_SIZE;
+    std::vector<std::vector<u8>> samples;
+    for(int i = 2; i < argc; i++){
+        std::string arg {argv[i]};
+        if (arg == "--size" && i + 1 < argc){
+            try {
+                size = std::stoull(argv[++i]);
+            } catch (std::logic_error const&){
+                std::cerr << "gzcomp: bad dictionary size" << std::endl;
+                return 1;
             }
+            continue;
         }
+        std::ifstream file {arg, std::ios::binary};
+        if (!file){
+            std::cerr << "gzcomp: cannot open " << arg << std::endl;
+            return 1;
+        }
+        samples.push_back(read_all(file));
     }
+    if (samples.empty()){
+        std::cerr << "Usage: gzcomp train [--size BYTES] SAMPLE... > dictionary" << std::endl;
+        return 1;
+    }
+    auto dict = dictionary::train(samples, size);
+    std::cout.write((const char*)dict.data(), dict.size());
+    std::cout.flush();
+    return 0;
+}
 
-    auto ll_code = construct_canonical_code(ll_code_lengths);
-    auto dist_code = construct_canonical_code(dist_code_lengths);
-
-    bool dist = false;
-    for(auto iter = output.begin(); iter != output.end(); iter++){
-        if((*iter).isLength) {
-            dist = true;
-            Symbol l = (*iter);
-            //write symbol
-            u32 bits = ll_code_lengths.at(l.value);
-            u32 code = ll_code.at(l.value);
-            for(int i = bits-1; i >= 0; i--)
-                stream.push_bit((code>>(unsigned int)i)&1);
-            //write offset
-            bits = l.offbits;
-            code = l.offset;
-            stream.push_bits(code, bits);
-        } else if (dist) {
-            dist = false;
-            
-            Symbol l = (*iter);
-            //write symbol
-            u32 bits = dist_code_lengths.at(l.value);
-            u32 code = dist_code.at(l.value);
-                
-            for(int i = bits-1; i >= 0; i--)
-                stream.push_bit((code>>(unsigned int)i)&1);
-            //write offset
-            bits = l.offbits;
-            code = l.offset;
-            stream.push_bits(code, bits);
-            
+/* gzcomp --connect: have a running gzcomp --serve do the work */
+int client(Options const& options){
+    try {
+        int sock = server::connect_to(options.connect_socket);
+        u8 op = options.decompress ? server::OP_DECOMPRESS : server::OP_COMPRESS;
+        std::vector<u8> result;
+        if (options.send_fd){
+            result = server::call(sock, op, options.format, nullptr, 0, STDIN_FILENO);
         } else {
-            //write symbol
-            Symbol l = (*iter);
-            
-            u32 bits = ll_code_lengths.at(l.value);
-
-            u32 code = ll_code.at(l.value);
-
-            for(int i = bits-1; i >= 0; i--)
-                stream.push_bit((code>>(unsigned int)i)&1);
+            std::vector<u8> data = read_all(std::cin);
+            result = server::call(sock, op, options.format, data.data(), data.size());
         }
+        close(sock);
+        std::cout.write((const char*)result.data(), result.size());
+        std::cout.flush();
+    } catch (server::ServerError const& e){
+        std::cerr << "gzcomp: " << e.what() << std::endl;
+        return 1;
     }
-
-    //Throw in a 256 (EOB marker)
-    
-    u32 symbol = 256;
-    u32 bits = ll_code_lengths.at(symbol);
-    u32 code = ll_code.at(symbol);
-    for(int i = bits-1; i >= 0; i--)
-        stream.push_bit((code>>(unsigned int)i)&1);
+    return 0;
 }
 
-int main(){
-
-    //See output_stream.hpp for a description of the OutputBitStream class
-    OutputBitStream stream {std::cout};
-
-    init_symbol_table();
-    init_distance_table();
-
-    //Pre-cache the CRC table
-    auto crc_table = CRC::CRC_32().MakeTable();
-
-    //Push a basic gzip header
-    stream.push_bytes( 0x1f, 0x8b, //Magic Number
-        0x08, //Compression (0x08 = DEFLATE)
-        0x00, //Flags
-        0x00, 0x00, 0x00, 0x00, //MTIME (little endian)
-        0x00, //Extra flags
-        0x03 //OS (Linux)
-    );
-    
-
-    //Note that the types u8, u16 and u32 are defined in the output_stream.hpp header
-    u32 bytes_read {0};
-
-    char next_byte {}; //Note that we have to use a (signed) char here for compatibility with istream::get()
-    //We need to see ahead of the stream by one character (e.g. to know, once we fill up a block,
-    //whether there are more blocks coming), so at each step, next_byte will be the next byte from the stream
-
-    //Keep a running CRC of the data we read.
-    u32 crc {};
-    std::list<u8> buffer;
-    std::list<Symbol> output;
-    std::string s {};
-
-    //we maintain a map where the key is 3 character strings and the value is a list of iterators that begin with those three characters,
-    //this means finding backreferences is as easy as looking up the first three characters in the buffer in the map
-    std::unordered_map<std::string, std::list<std::list<u8>::iterator>> m; 
-
-    std::cin.get(next_byte);
-    bytes_read++;
-    crc = CRC::Calculate(&next_byte,1, crc_table); //Add the character we just read to the CRC (even though it is not in a block yet)
-    buffer.push_back(next_byte);
+void usage(){
+    std::cerr << "Usage: gzcomp [options] < input > output" << std::endl;
+    std::cerr << "       gzcomp [-k] [-p N] [--bgzf] FILE...     (writes FILE.gz for each FILE)" << std::endl;
+    std::cerr << "       gzcomp train [--size BYTES] SAMPLE... > dictionary" << std::endl;
+    std::cerr << "  -d                    decompress instead of compressing" << std::endl;
+    std::cerr << "  -1 ... -9             compress faster (-1, greedy) or smaller (-4 to -8 lazy, -9 optimal parsing);" << std::endl;
+    std::cerr << "                        without one, the original exhaustive greedy parse" << std::endl;
+    std::cerr << "  --target-mbps X       instead of a level, adjust the effort to compress X MB/s (per thread)" << std::endl;
+    std::cerr << "                        with the best ratio that allows, and raise it while the output is backed up" << std::endl;
+    std::cerr << "  -p N                  use N threads (decompression, or several files at once)" << std::endl;
+    std::cerr << "  -k, --keep            when compressing FILEs, keep the originals" << std::endl;
+    std::cerr << "  --bgzf                write BGZF (independent members of at most 64 KiB) for htslib/tabix" << std::endl;
+    std::cerr << "  --index FILE          when compressing, write a random access index to FILE;" << std::endl;
+    std::cerr << "                        with -d, use it to decompress in parallel (or to read a --range)" << std::endl;
+    std::cerr << "  --index-span MIB      distance between index checkpoints (default 1 MiB)" << std::endl;
+    std::cerr << "  --range OFFSET:LEN    with -d and --index, decompress only LEN bytes starting at OFFSET" << std::endl;
+    std::cerr << "  --flush-ms MS         flush the output once input has waited MS milliseconds" << std::endl;
+    std::cerr << "  --flush-bytes N       flush the output after every N bytes of input" << std::endl;
+    std::cerr << "  --full-flush          make flushes full flushes, which also reset the history" << std::endl;
+    std::cerr << "  --format FMT          gzip (the default), zlib, or raw deflate" << std::endl;
+    std::cerr << "  --dict FILE           preset dictionary (zlib or raw format only)" << std::endl;
+    std::cerr << "  --window-bits N       limit back-references to the last 2^N bytes, N from 9 to 15 (default 15)" << std::endl;
+    std::cerr << "  --mem-level N         match finder and block buffer size, 1 (least memory) to 9 (the default)" << std::endl;
+    std::cerr << "  --huge-pages          back the match finder's memory with transparent huge pages" << std::endl;
+    std::cerr << "  --stats               when compressing stdin, report what the compressor did as JSON on stderr" << std::endl;
+    std::cerr << "  --perf-counters       with --stats, add hardware events (cycles, cache misses...) per stage per MB" << std::endl;
+    std::cerr << "  --io MODE             when compressing, read and write with sync: read()/write() (the default)," << std::endl;
+    std::cerr << "                        uring: io_uring, with several requests in flight, or splice: vmsplice()" << std::endl;
+    std::cerr << "                        to hand the output to a pipe without copying it" << std::endl;
+    std::cerr << "  --cpu LEVEL           use the SIMD kernels of generic, sse4, avx2 or avx512 rather than the best" << std::endl;
+    std::cerr << "                        this CPU has (the output is the same at every level)" << std::endl;
+    std::cerr << "  --trace FILE          record what each thread did when, for chrome://tracing or ui.perfetto.dev" << std::endl;
+    std::cerr << "  --serve SOCKET        run as a compression server on a UNIX socket, with -p N threads" << std::endl;
+    std::cerr << "  --connect SOCKET      send stdin to a running server instead of compressing here" << std::endl;
+    std::cerr << "  --send-fd             with --connect, pass stdin itself to the server rather than its contents" << std::endl;
+}
 
-    //load the look aheads into the input buffer
-    while (buffer.size() < 258 && std::cin.get(next_byte)) {
-        crc = CRC::Calculate(&next_byte,1, crc_table, crc); //Add the character we just read to the CRC (even though it is not in a block yet)
-        buffer.push_back(next_byte);
-        bytes_read++;
+bool parse_options(int argc, char** argv, Options& options){
+    std::vector<std::string> args;
+    bool end_of_options = false;
+    for(int i = 1; i < argc; i++){
+        //--option=value is the same as --option value
+        std::string arg {argv[i]};
+        size_t equals = arg.find('=');
+        end_of_options = end_of_options || arg == "--";
+        if (!end_of_options && arg.compare(0, 2, "--") == 0 && equals != std::string::npos){
+            args.push_back(arg.substr(0, equals));
+            args.push_back(arg.substr(equals + 1));
+        } else {
+            args.push_back(arg);
+        }
     }
-
-    //LZSS encoding algorithm
-    std::list<u8>::iterator current = buffer.begin();
-    u32 count;
-    LenDist best;//store the best backreference we can find, or one that is good enough
-    while (1) {
-        std::list<u8>::iterator c{current};
-        best = LenDist{0,0};
-        if(buffer.size() >= 4) {
-            std::list<u8>::iterator x {current};
-            std::string key {3, 'a'};
-            for(auto it = key.begin(); it != key.end(); it++) {
-                *it = *x;
-                x++;
-            }
-            auto li = m.find(key);//check the map to see if we have seen a suitable 3 character substring to indicate a good backreference
-            if(li != m.end()){
-                //we found some, check them all and find one that is good enough, or just use the best one we find.
-                std::list<u8>::iterator currBest;
-                u32 currBestCount = 0;
-                for(auto listiterator = (*li).second.begin(); listiterator != (*li).second.end(); listiterator++) {
-                    std::list<u8>::iterator temp {(*listiterator)};
-                    std::list<u8>::iterator cur {current};
-                    count = 0;
-                    while(*temp == *cur && cur != buffer.end()) {
-                        count++;
-                        temp++;
-                        cur++;
-                    }
-                    if(count > currBestCount) {
-                        std::list<u8>::iterator temp2 {(*listiterator)};
-                        currBest = temp2;
-                        currBestCount = count;
-                        if(currBestCount >= THRESHOLD){
-                            break;
-                        }
-                    }
-                }
-                u32 dist = 0;
-                while(currBest != current){
-                    currBest++;
-                    dist++;
-                }
-                LenDist r {currBestCount,dist};
-                best = r;
-
+    bool only_files = false;
+    for(size_t i = 0; i < args.size(); i++){
+        std::string const& arg = args[i];
+        bool has_value = i + 1 < args.size();
+        try {
+            if (only_files || arg.empty() || arg[0] != '-'){
+                options.files.push_back(arg);
+            } else if (arg == "--"){
+                only_files = true;
+            } else if (arg == "-k" || arg == "--keep"){
+                options.keep = true;
+            } else if (arg == "-d" || arg == "--decompress"){
+                options.decompress = true;
+            } else if (arg.size() == 2 && arg[1] >= '1' && arg[1] <= '9'){
+                options.level = arg[1] - '0';
+            } else if (arg == "--target-mbps" && has_value){
+                options.target_mbps = std::stod(args[++i]);
+                if (!(options.target_mbps > 0))
+                    return false;
+            } else if (arg == "-p" && has_value){
+                options.threads = std::stoul(args[++i]);
+                if (options.threads == 0)
+                    return false;
+            } else if (arg == "--bgzf"){
+                options.bgzf = true;
+            } else if (arg == "--index" && has_value){
+                options.index_file = args[++i];
+            } else if (arg == "--index-span" && has_value){
+                options.index_span = std::stoull(args[++i]) << 20;
+                if (options.index_span == 0)
+                    return false;
+            } else if (arg == "--range" && has_value){
+                std::string const& range = args[++i];
+                size_t colon = range.find(':');
+                if (colon == std::string::npos)
+                    return false;
+                options.range_offset = std::stoull(range.substr(0, colon));
+                options.range_length = std::stoull(range.substr(colon + 1));
+                options.extract_range = true;
+            } else if (arg == "--flush-ms" && has_value){
+                options.flush_ms = std::stoull(args[++i]);
+            } else if (arg == "--flush-bytes" && has_value){
+                options.flush_bytes = std::stoull(args[++i]);
+            } else if (arg == "--full-flush"){
+                options.flush_mode = deflate::Flush::Full;
+            } else if (arg == "--format" && has_value){
+                std::string const& format = args[++i];
+                if (format == "gzip")
+                    options.format = deflate::Format::Gzip;
+                else if (format == "zlib")
+                    options.format = deflate::Format::Zlib;
+                else if (format == "raw")
+                    options.format = deflate::Format::Raw;
+                else
+                    return false;
+            } else if (arg == "--window-bits" && has_value){
+                options.window_bits = std::stoi(args[++i]);
+                options.memory_options = true;
+                if (options.window_bits < deflate::MIN_WINDOW_BITS || options.window_bits > deflate::MAX_WINDOW_BITS)
+                    return false;
+            } else if (arg == "--mem-level" && has_value){
+                options.mem_level = std::stoi(args[++i]);
+                options.memory_options = true;
+                if (options.mem_level < deflate::MIN_MEM_LEVEL || options.mem_level > deflate::MAX_MEM_LEVEL)
+                    return false;
+            } else if (arg == "--huge-pages"){
+                options.huge_pages = true;
+                options.memory_options = true;
+            } else if (arg == "--io" && has_value){
+                std::string const& io = args[++i];
+                if (io == "sync")
+                    options.io = pipeline::Io::Sync;
+                else if (io == "uring")
+                    options.io = pipeline::Io::Uring;
+                else if (io == "splice")
+                    options.io = pipeline::Io::Splice;
+                else
+                    return false;
+                options.io_option = true;
+            } else if (arg == "--cpu" && has_value){
+                if (!cpu::parse(args[++i], options.cpu_level))
+                    return false;
+                options.cpu_option = true;
+            } else if (arg == "--trace" && has_value){
+                options.trace_file = args[++i];
+            } else if (arg == "--stats"){
+                options.stats = true;
+            } else if (arg == "--perf-counters"){
+                options.perf_counters = true;
+            } else if (arg == "--dict" && has_value){
+                options.dictionary_file = args[++i];
+            } else if (arg == "--serve" && has_value){
+                options.serve_socket = args[++i];
+            } else if (arg == "--connect" && has_value){
+                options.connect_socket = args[++i];
+            } else if (arg == "--send-fd"){
+                options.send_fd = true;
+            } else {
+                return false;
             }
-
+        } catch (std::logic_error const&){
+            return false; //malformed number
         }
+    }
+    if (options.extract_range && (!options.decompress || options.index_file.empty()))
+        return false;
+    if (options.bgzf && (options.decompress || !options.index_file.empty()))
+        return false;
+    if ((options.flush_ms > 0 || options.flush_bytes > 0) && (options.decompress || options.bgzf))
+        return false;
+    //The other formats have no room for an index, and gzip has no way to name a dictionary
+    bool gzip = options.format == deflate::Format::Gzip;
+    if (!gzip && (options.bgzf || !options.index_file.empty()))
+        return false;
+    if (gzip && !options.dictionary_file.empty())
+        return false;
+    //The server takes the format with each request, and nothing else
+    bool remote = !options.serve_socket.empty() || !options.connect_socket.empty();
+    if (remote && (options.bgzf || !options.index_file.empty() || !options.dictionary_file.empty()
+        || options.flush_ms > 0 || options.flush_bytes > 0))
+        return false;
+    if (!options.serve_socket.empty() && !options.connect_socket.empty())
+        return false;
+    if (options.send_fd && options.connect_socket.empty())
+        return false;
+    //Files are compressed to FILE.gz with the plain settings (or as BGZF)
+    if (!options.files.empty() && (options.decompress || !gzip || !options.index_file.empty()
+        || options.flush_ms > 0 || options.flush_bytes > 0 || remote))
+        return false;
+    if (options.perf_counters && !options.stats)
+        return false;
+    if (options.keep && options.files.empty())
+        return false;
+    //The level and memory settings are for deflate::Compressor (BGZF blocks are small anyway)
+    bool effort = options.level != deflate::DEFAULT_LEVEL || options.target_mbps > 0;
+    if ((options.memory_options || effort) && (options.decompress || options.bgzf || remote))
+        return false;
+    if (options.level != deflate::DEFAULT_LEVEL && options.target_mbps > 0)
+        return false;
+    //Stats are kept by the one compressor of a plain stdin to stdout run
+    if (options.stats && (options.decompress || options.bgzf || remote || !options.files.empty()))
+        return false;
+    //The I/O backends belong to the pipeline, which compresses stdin or FILEs to deflate
+    if (options.io_option && (options.decompress || options.bgzf || remote || options.flush_ms > 0 || options.flush_bytes > 0))
+        return false;
+    //A server runs until it is killed, so its trace would never be written
+    if (!options.trace_file.empty() && !options.serve_socket.empty())
+        return false;
+    return true;
+}
 
-        int chars_to_add = 1; // no matter what we will need to add one char to the input buffer
-        if(best.length > 2) {
-            // we found a backreference, add the length and distance
-            Symbol s = symbols[best.length];
-            symbolCounts[s.value]++;
-            output.push_back(s);
-
-            Symbol d = distSymbols[best.distance];
-            distCounts[d.value]++;
-            output.push_back(d);
+int main(int argc, char** argv){
+    if (argc > 1 && std::string{argv[1]} == "train")
+        return train(argc, argv);
 
-            chars_to_add = best.length;// we need to add to the buffer as many characters as we consume
-        } else {
-            //no good back reference, just add the value
-            u8 val = *current;
-            symbolCounts[val]++;
-            output.push_back(Symbol{val, 0, 0, false});
+    Options options;
+    if (!parse_options(argc, argv, options)){
+        usage();
+        return 1;
+    }
+    if (options.cpu_option){
+        try {
+            cpu::select(options.cpu_level);
+        } catch (std::runtime_error const& e){
+            std::cerr << "gzcomp: " << e.what() << std::endl;
+            return 1;
         }
-
-        // Add the characters into the stream 
-        for(int i = chars_to_add; i > 0; i--) {
-            if (std::cin.get(next_byte)){
-                bytes_read++;
-                crc = CRC::Calculate(&next_byte,1, crc_table, crc); //Add the character we just read to the CRC (even though it is not in a block yet)
-                buffer.push_back(next_byte);
-            }
-            if(buffer.size() > MAX_BACKREF_DIST){//avoid having the buffer be too large and avoid having backreferences that are too long
-                std::string key {3, 'a'};
-                auto bi = buffer.begin();
-                for(auto it = key.begin(); it != key.end(); it++) {
-                    *it = *bi;
-                    bi++;
-                }
-                auto mi = m.find(key);
-                (*mi).second.pop_back();
-                if((*mi).second.empty()) {
-                    m.erase(key);//remove this reference from the map, it can't be used anymore because it is too far back
-                }
-                buffer.pop_front(); //can't make back references longer than this
-            }
-            if(buffer.size() >= 6) {
-                std::list<u8>::iterator x {current};
-                std::string key {3, 'a'};
-                //make a key of the first three chars of the input buffer
-                for(auto it = key.begin(); it != key.end(); it++) {
-                    *it = *x;
-                    x++;
-                }
-                std::list<u8>::iterator y {current};
-                auto li = m.find(key);
-                //if the key exists, add an iterator to it
-                //if not create a new list and add it
-                if(li == m.end()) {
-                    std::list<std::list<u8>::iterator> newlist {y};
-                    m.insert({key, newlist});
-                } else {
-                    (*li).second.push_front(y);
-                }
-            }
-            
-            if (current == buffer.end()) break;
-            current++;
-
+    }
+    if (!options.dictionary_file.empty()){
+        std::ifstream dict {options.dictionary_file, std::ios::binary};
+        if (!dict){
+            std::cerr << "gzcomp: cannot open " << options.dictionary_file << std::endl;
+            return 1;
         }
+        options.dictionary = read_all(dict);
+    }
 
-        if (current == buffer.end()) { 
-            break; //nothing left
-        } else if (output.size() > MAX_BLOCK_SIZE) {
-            write_block(stream, output, false, 2); //at least one thing left and we have a full block
-            output.clear();
-            for(int x = 0; x < SS_TABLE_SIZE; x++) symbolCounts[x] = 0;
-            for(int x = 0; x < DIST_TABLE_SIZE; x++) distCounts[x] = 0;
+    if (!options.serve_socket.empty()){
+        try {
+            server::serve(options.serve_socket, options.threads);
+        } catch (server::ServerError const& e){
+            std::cerr << "gzcomp: " << e.what() << std::endl;
+            return 1;
         }
+        return 0;
     }
 
-
-    //At this point, we've finished reading the input (no new characters remain), and we may have an incomplete block to write.
-    if (output.size() > 0){
-        if(output.size() < 200) { // not really worth it to write block type 2 for things less than 500 bytes in size
-            write_block(stream,output,true, 1);
-        } else {
-            write_block(stream,output,true, 2);
+    std::ofstream trace_stream;
+    if (!options.trace_file.empty()){
+        trace_stream.open(options.trace_file);
+        if (!trace_stream){
+            std::cerr << "gzcomp: cannot create " << options.trace_file << std::endl;
+            return 1;
         }
+        trace::start();
     }
-    //After the last block, restore byte alignment
-    stream.flush_to_byte();
-
-    //Now close out the bitstream by writing the CRC and the total number of bytes stored.
-    stream.push_u32(crc);
-    stream.push_u32(bytes_read);
-
-    return 0;
+    int status = 0;
+    if (!options.connect_socket.empty())
+        status = client(options);
+    else if (!options.files.empty())
+        status = compress_files(options);
+    else if (options.decompress)
+        status = decompress(std::cin, std::cout, options);
+    else {
+        try {
+            compress(std::cin, std::cout, options);
+        } catch (std::system_error const& e){
+            std::cerr << "gzcomp: " << e.what() << std::endl;
+            status = 1;
+        }
+    }
+    if (trace_stream.is_open())
+        trace::write(trace_stream);
+    return status;
 }
\ No newline at end of file
@@ -0,0 +1,160 @@
+/* gzindex.hpp
+
+   Random access into compressed output through a side-car index, in the
+   style of zlib's zran.c example.
+
+   While compressing, gzcomp can end the current block every N bytes of input
+   and record a checkpoint: the uncompressed offset, the bit offset in the .gz
+   file where the next block starts, and the (up to) 32 KiB of input preceding
+   that point. To read a range, the decoder jumps to the last checkpoint at or
+   before the start of the range, primes its history with the saved window and
+   inflates only from there.
+
+   Index file layout (all integers little endian):
+       8 bytes   magic "GZCIDX01"
+       u64       number of checkpoints
+       then for each checkpoint:
+       u64       uncompressed offset
+       u64       compressed offset in bits, from the start of the .gz file
+       u32       window size
+       ...       window bytes
+*/
+
+#ifndef GZINDEX_HPP
+#define GZINDEX_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+#include "inflate.hpp"
+
+namespace gzindex {
+
+using u8 = std::uint8_t;
+using u32 = std::uint32_t;
+using u64 = std::uint64_t;
+
+struct Checkpoint {
+    u64 out_offset;     //offset in the uncompressed data
+    u64 bit_offset;     //offset in the compressed file of the block starting here
+    std::vector<u8> window;
+};
+
+const char INDEX_MAGIC[8] = {'G', 'Z', 'C', 'I', 'D', 'X', '0', '1'};
+
+/* Thrown when an index file cannot be read */
+class IndexError: public std::runtime_error {
+public:
+    explicit IndexError(std::string const& what): std::runtime_error(what) {}
+};
+
+inline void write_u64(std::ostream& out, u64 v){
+    for(int i = 0; i < 8; i++)
+        out.put((char)(v >> (8*i)));
+}
+
+inline u64 read_u64(std::istream& in){
+    u64 v = 0;
+    for(int i = 0; i < 8; i++){
+        int c = in.get();
+        if (c == EOF)
+            throw IndexError("truncated index");
+        v |= (u64)(u8)c << (8*i);
+    }
+    return v;
+}
+
+class Index {
+public:
+    std::vector<Checkpoint> points;
+
+    void write(std::ostream& out) const {
+        out.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        write_u64(out, points.size());
+        for(auto const& p: points){
+            write_u64(out, p.out_offset);
+            write_u64(out, p.bit_offset);
+            u32 size = p.window.size();
+            for(int i = 0; i < 4; i++)
+                out.put((char)(size >> (8*i)));
+            out.write((const char*)p.window.data(), size);
+        }
+    }
+
+    static Index read(std::istream& in){
+        char magic[sizeof(INDEX_MAGIC)];
+        if (!in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), INDEX_MAGIC))
+            throw IndexError("not a gzcomp index");
+        Index index;
+        u64 count = read_u64(in);
+        for(u64 i = 0; i < count; i++){
+            Checkpoint p;
+            p.out_offset = read_u64(in);
+            p.bit_offset = read_u64(in);
+            u32 size = 0;
+            for(int j = 0; j < 4; j++){
+                int c = in.get();
+                if (c == EOF)
+                    throw IndexError("truncated index");
+                size |= (u32)(u8)c << (8*j);
+            }
+            if (size > inflate::WINDOW_SIZE)
+                throw IndexError("window too large");
+            p.window.resize(size);
+            if (!in.read((char*)p.window.data(), size))
+                throw IndexError("truncated index");
+            if (!index.points.empty() && p.out_offset < index.points.back().out_offset)
+                throw IndexError("checkpoints out of order");
+            index.points.push_back(std::move(p));
+        }
+        return index;
+    }
+
+    /* The last checkpoint at or before offset (or nullptr if there is none) */
+    Checkpoint const* find(u64 offset) const {
+        auto it = std::upper_bound(points.begin(), points.end(), offset, [](u64 o, Checkpoint const& p){
+            return o < p.out_offset;
+        });
+        if (it == points.begin())
+            return nullptr;
+        return &*(it - 1);
+    }
+};
+
+/* Decompress length bytes starting at uncompressed offset from the gzip data
+   gz[0..size), using the index to skip everything before the nearest checkpoint.
+   Returns the number of bytes passed to sink, which is less than length only if
+   the data ends first. */
+inline u64 extract(const u8* gz, size_t size, Index const& index, u64 offset, u64 length, inflate::Sink const& sink){
+    Checkpoint const* start = index.find(offset);
+    if (!start)
+        throw IndexError("no checkpoint before offset");
+    if (length == 0)
+        return 0;
+
+    inflate::Inflater inflater {gz, size};
+    inflater.seek_bits(start->bit_offset);
+    inflater.set_window(start->window.data(), start->window.size());
+
+    u64 skip = offset - start->out_offset;
+    u64 delivered = 0;
+    inflater.inflate([&](const u8* data, size_t n){
+        if (skip >= n){
+            skip -= n;
+            return;
+        }
+        data += skip;
+        n -= skip;
+        skip = 0;
+        size_t take = std::min<u64>(n, length - delivered);
+        if (take > 0)
+            sink(data, take);
+        delivered += take;
+    }, offset - start->out_offset + length);
+    return delivered;
+}
+
+}
+
+#endif
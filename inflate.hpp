@@ -0,0 +1,874 @@
+/* inflate.hpp
+
+   A table-driven DEFLATE decoder (RFC 1951) along with the gzip member
+   (RFC 1952) and zlib stream (RFC 1950) parsing needed to undo what gzcomp
+   produces.
+
+   The decoder keeps up to 64 bits of input in a bit buffer which is refilled
+   with a single unaligned 8 byte load whenever at least 8 bytes of input
+   remain. Huffman codes are decoded with a two level lookup table: the low
+   bits of the bit buffer index a primary table, and codes longer than the
+   primary table width are resolved through a small subtable. Each table entry
+   already contains the decoded literal, or the base and extra bit count of a
+   length/distance, so the inner loop never touches the code lengths.
+
+   Output goes into a buffer which always retains the last 32 KiB of history.
+   Whenever the buffer fills up, the new bytes are handed to a sink and the
+   history is slid back to the front of the buffer.
+
+   (As in output_stream.hpp, everything is inline in this header.)
+*/
+
+#ifndef INFLATE_HPP
+#define INFLATE_HPP
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "deflate_tables.hpp"
+#include "crc32.hpp"
+#include "cpu_dispatch.hpp"
+#include "adler32.hpp"
+
+namespace inflate {
+
+using u8 = std::uint8_t;
+using u16 = std::uint16_t;
+using u32 = std::uint32_t;
+using u64 = std::uint64_t;
+
+/* Thrown for any malformed or truncated input */
+class InflateError: public std::runtime_error {
+public:
+    explicit InflateError(std::string const& what): std::runtime_error(what) {}
+};
+
+/* Called with each run of decompressed bytes, in order */
+template<typename T>
+using BasicSink = std::function<void(const T* data, size_t size)>;
+using Sink = BasicSink<u8>;
+
+const u32 WINDOW_SIZE = 32768;
+
+/* Table entry layout:
+     bits 0-4    number of bits to consume for this entry
+     bits 5-7    flags (literal, end of block, subtable link)
+     bits 8-12   number of extra bits (or the subtable width for a link)
+     bit  14     invalid code
+     bits 16-31  literal value, length/distance base, or subtable offset */
+const u32 ENTRY_LITERAL = 1 << 5;
+const u32 ENTRY_EOB = 1 << 6;
+const u32 ENTRY_SUBTABLE = 1 << 7;
+const u32 ENTRY_INVALID = 1 << 14;
+
+const u32 LITLEN_TABLE_BITS = 10;
+const u32 DIST_TABLE_BITS = 8;
+const u32 PRECODE_TABLE_BITS = 7;
+
+/* Sizes from zlib's "enough" program for the given primary table widths,
+   which bound the table size for any complete or incomplete code. */
+const u32 LITLEN_TABLE_SIZE = 1334;
+const u32 DIST_TABLE_SIZE = 402;
+const u32 PRECODE_TABLE_SIZE = 128;
+
+const u32 NUM_LITLEN_SYMS = 288;
+const u32 NUM_DIST_SYMS = 32;
+const u32 NUM_PRECODE_SYMS = 19;
+const u32 MAX_CODE_LENGTH = 15;
+
+inline constexpr u32 make_entry(u32 value, u32 flags, u32 extra = 0){
+    return (value << 16) | (extra << 8) | flags;
+}
+
+/* Per symbol decode results, before the code length is filled in */
+inline constexpr std::array<u32, NUM_LITLEN_SYMS> make_litlen_results(){
+    std::array<u32, NUM_LITLEN_SYMS> r {};
+    for(u32 i = 0; i < 256; i++)
+        r[i] = make_entry(i, ENTRY_LITERAL);
+    r[256] = make_entry(0, ENTRY_EOB);
+    for(u32 i = 0; i < deflate_tables::NUM_LENGTH_CODES; i++)
+        r[257 + i] = make_entry(deflate_tables::length_base[i], 0, deflate_tables::length_extra[i]);
+    r[286] = r[287] = ENTRY_INVALID;
+    return r;
+}
+inline constexpr std::array<u32, NUM_DIST_SYMS> make_dist_results(){
+    std::array<u32, NUM_DIST_SYMS> r {};
+    for(u32 i = 0; i < deflate_tables::NUM_DIST_CODES; i++)
+        r[i] = make_entry(deflate_tables::dist_base[i], 0, deflate_tables::dist_extra[i]);
+    r[30] = r[31] = ENTRY_INVALID;
+    return r;
+}
+inline constexpr std::array<u32, NUM_PRECODE_SYMS> make_precode_results(){
+    std::array<u32, NUM_PRECODE_SYMS> r {};
+    for(u32 i = 0; i < NUM_PRECODE_SYMS; i++)
+        r[i] = make_entry(i, ENTRY_LITERAL);
+    return r;
+}
+
+constexpr std::array<u32, NUM_LITLEN_SYMS> litlen_results = make_litlen_results();
+constexpr std::array<u32, NUM_DIST_SYMS> dist_results = make_dist_results();
+constexpr std::array<u32, NUM_PRECODE_SYMS> precode_results = make_precode_results();
+
+/* Build a decode table for a canonical code given by lens[0..num_syms).
+   Returns false if the code is over-subscribed, or incomplete where that is
+   not allowed (RFC 1951 only tolerates an incomplete code with a single
+   codeword, which encoders emit when only one distance is used). */
+inline bool build_decode_table(u32* table, u32 table_size, u32 table_bits, u8 const* lens, u32 num_syms, u32 const* results){
+    u32 count[MAX_CODE_LENGTH + 1] = {};
+    for(u32 i = 0; i < num_syms; i++)
+        count[lens[i]]++;
+    count[0] = 0;
+
+    u32 max_len = 0;
+    int left = 1;
+    for(u32 len = 1; len <= MAX_CODE_LENGTH; len++){
+        left <<= 1;
+        left -= count[len];
+        if (left < 0)
+            return false; //over-subscribed
+        if (count[len] != 0)
+            max_len = len;
+    }
+    if (max_len == 0){
+        //No codes at all; any lookup is an error
+        for(u32 i = 0; i < (1u << table_bits); i++)
+            table[i] = ENTRY_INVALID;
+        return true;
+    }
+    if (left > 0 && !(max_len == 1 && count[1] == 1))
+        return false; //incomplete
+
+    //Sort the symbols by code length, then by symbol (i.e. canonical order)
+    u32 offsets[MAX_CODE_LENGTH + 2] = {};
+    for(u32 len = 1; len <= MAX_CODE_LENGTH; len++)
+        offsets[len + 1] = offsets[len] + count[len];
+    u16 sorted[NUM_LITLEN_SYMS];
+    for(u32 i = 0; i < num_syms; i++)
+        if (lens[i] != 0)
+            sorted[offsets[lens[i]]++] = i;
+    u32 num_codes = offsets[MAX_CODE_LENGTH + 1];
+
+    //Unused entries (incomplete codes) decode as errors
+    u32 primary_size = 1u << table_bits;
+    for(u32 i = 0; i < primary_size; i++)
+        table[i] = ENTRY_INVALID;
+
+    u32 code = 0; //next canonical code (MSB first)
+    u32 len = 0;
+    u32 next_free = primary_size;
+    u32 sub_prefix = ~0u;
+    u32 sub_start = 0;
+    u32 sub_bits = 0;
+    u32 remaining[MAX_CODE_LENGTH + 1];
+    std::memcpy(remaining, count, sizeof(count));
+
+    for(u32 i = 0; i < num_codes; i++){
+        u32 sym = sorted[i];
+        if (lens[sym] != len){
+            code <<= lens[sym] - len;
+            len = lens[sym];
+        }
+        //The bitstream is read LSB first, so index the table by the reversed code
+        u32 reversed = 0;
+        for(u32 b = 0; b < len; b++)
+            reversed |= ((code >> b) & 1) << (len - 1 - b);
+
+        if (len <= table_bits){
+            u32 entry = results[sym] | len;
+            for(u32 j = reversed; j < primary_size; j += 1u << len)
+                table[j] = entry;
+        } else {
+            u32 prefix = reversed & (primary_size - 1);
+            if (prefix != sub_prefix){
+                //Start a new subtable, as wide as needed for the codes sharing this prefix (as in zlib)
+                sub_prefix = prefix;
+                sub_bits = len - table_bits;
+                int avail = 1 << sub_bits;
+                while (sub_bits + table_bits < max_len){
+                    avail -= remaining[sub_bits + table_bits];
+                    if (avail <= 0)
+                        break;
+                    sub_bits++;
+                    avail <<= 1;
+                }
+                sub_start = next_free;
+                next_free += 1u << sub_bits;
+                if (next_free > table_size)
+                    return false;
+                for(u32 j = sub_start; j < next_free; j++)
+                    table[j] = ENTRY_INVALID;
+                table[prefix] = make_entry(sub_start, ENTRY_SUBTABLE, sub_bits) | table_bits;
+            }
+            u32 sub_len = len - table_bits;
+            u32 entry = results[sym] | sub_len;
+            for(u32 j = reversed >> table_bits; j < (1u << sub_bits); j += 1u << sub_len)
+                table[sub_start + j] = entry;
+        }
+        remaining[len]--;
+        code++;
+    }
+    return true;
+}
+
+struct FixedTables {
+    u32 litlen[LITLEN_TABLE_SIZE];
+    u32 dist[DIST_TABLE_SIZE];
+};
+
+/* Decode tables for block type 1, built on first use */
+inline FixedTables const& fixed_tables(){
+    static FixedTables const tables = []{
+        FixedTables t {};
+        u8 lens[NUM_LITLEN_SYMS];
+        for(u32 i = 0; i < 144; i++) lens[i] = 8;
+        for(u32 i = 144; i < 256; i++) lens[i] = 9;
+        for(u32 i = 256; i < 280; i++) lens[i] = 7;
+        for(u32 i = 280; i < 288; i++) lens[i] = 8;
+        build_decode_table(t.litlen, LITLEN_TABLE_SIZE, LITLEN_TABLE_BITS, lens, NUM_LITLEN_SYMS, litlen_results.data());
+        for(u32 i = 0; i < NUM_DIST_SYMS; i++) lens[i] = 5;
+        build_decode_table(t.dist, DIST_TABLE_SIZE, DIST_TABLE_BITS, lens, NUM_DIST_SYMS, dist_results.data());
+        return t;
+    }();
+    return tables;
+}
+
+/* The decoder. T is the type of an output symbol: u8 for ordinary
+   decompression, or u16 to decode with markers standing in for an unknown
+   window (see prime_markers()). */
+template<typename T>
+class BasicInflater {
+public:
+    /* The input must remain valid for the lifetime of the Inflater */
+    BasicInflater(const u8* data, size_t size): in_begin{data}, in_end{data + size}, in{data},
+        buffer(WINDOW_SIZE + OUT_CHUNK + OUT_SLACK) {
+        reset_output();
+        update_out_stop();
+    }
+
+    /* Decode DEFLATE blocks starting at the current position until the end of
+       the final block, passing the output to sink. Returns the number of bytes produced.
+       If max_out is given, decoding may stop (possibly in the middle of a block, and
+       slightly past max_out) once that many bytes have been produced. If stop_bit is
+       given, decoding stops at the first block boundary at or after that input bit offset. */
+    u64 inflate(BasicSink<T> const& sink, u64 max_out = UINT64_MAX, u64 stop_bit = UINT64_MAX){
+        u64 start_total = total_out();
+        stop_total = max_out == UINT64_MAX ? UINT64_MAX : start_total + max_out;
+        update_out_stop();
+        bool last = false;
+        final_block_done = false;
+        while (!last && !stopped() && bit_position() < stop_bit){
+            ensure_bits(3);
+            last = bitbuf & 1;
+            u32 type = (bitbuf >> 1) & 3;
+            consume(3);
+            if (type == 0)
+                stored_block(sink);
+            else if (type == 1)
+                huffman_block(fixed_tables().litlen, fixed_tables().dist, sink);
+            else if (type == 2){
+                read_dynamic_header();
+                huffman_block(litlen_table, dist_table, sink);
+            } else
+                throw InflateError("invalid block type");
+        }
+        final_block_done = last && !stopped();
+        check_overrun();
+        flush_output(sink);
+        return total_out() - start_total;
+    }
+
+    /* True if the last call to inflate() decoded the end of the final block */
+    bool finished() const {
+        return final_block_done;
+    }
+
+    /* Read one block header at the current position and check that it starts
+       a valid dynamic Huffman block (the tables are built as a side effect) */
+    bool dynamic_header_valid(){
+        try {
+            ensure_bits(3);
+            if ((bitbuf & 7) != 4) //not final, block type 2
+                return false;
+            consume(3);
+            read_dynamic_header();
+            return true;
+        } catch (InflateError const&) {
+            return false;
+        }
+    }
+
+    /* Discard any partial byte (the data after a final block is byte aligned) */
+    void align_to_byte(){
+        consume(bitsleft & 7);
+    }
+
+    /* Position in the input, in bits and in bytes (rounded up) */
+    u64 bit_position() const {
+        return (u64)(in - in_begin + overrun) * 8 - bitsleft;
+    }
+    size_t byte_position() const {
+        return (bit_position() + 7) / 8;
+    }
+
+    /* Restart reading at a byte offset, e.g. at the next gzip member */
+    void seek_byte(size_t offset){
+        if (offset > (size_t)(in_end - in_begin))
+            throw InflateError("unexpected end of input");
+        in = in_begin + offset;
+        bitbuf = 0;
+        bitsleft = 0;
+        overrun = 0;
+    }
+
+    /* Restart reading at an arbitrary bit offset (which must be the start of a block) */
+    void seek_bits(u64 offset){
+        seek_byte(offset / 8);
+        ensure_bits(8);
+        consume(offset % 8);
+    }
+
+    /* Forget the history, so the next stream cannot refer back into the previous one */
+    void reset_output(){
+        out = buffer.data();
+        flushed = out;
+        total_flushed = 0;
+    }
+
+    /* Replace the history with the given bytes (at most the last 32 KiB are kept),
+       e.g. to resume decoding from the middle of a stream */
+    void set_window(const u8* window, size_t size){
+        reset_output();
+        if (size > WINDOW_SIZE){
+            window += size - WINDOW_SIZE;
+            size = WINDOW_SIZE;
+        }
+        std::copy(window, window + size, buffer.data());
+        out += size;
+        flushed = out;
+    }
+
+    /* For decoding from the middle of a stream without knowing the history:
+       fill the history with markers, where marker MARKER_BASE + i stands for
+       byte i of the 32 KiB window before the starting point. Back-references
+       into the unknown history then copy markers, which can be replaced once
+       the window is known. */
+    static const u32 MARKER_BASE = 256;
+    void prime_markers(){
+        static_assert(sizeof(T) >= 2, "markers need wider output symbols");
+        reset_output();
+        for(u32 i = 0; i < WINDOW_SIZE; i++)
+            buffer[i] = MARKER_BASE + i;
+        out += WINDOW_SIZE;
+        flushed = out;
+    }
+
+    /* True if the last call to inflate() stopped early because of max_out */
+    bool stopped() const {
+        return total_out() >= stop_total;
+    }
+
+    u64 total_out() const {
+        return total_flushed + (out - flushed);
+    }
+
+private:
+    static constexpr u32 OUT_CHUNK = 1 << 20;
+    static constexpr u32 OUT_SLACK = deflate_tables::MAX_MATCH + 64;
+    /* The fast loop reads at most this many bytes past the current position */
+    static constexpr u32 FAST_INPUT_MARGIN = 16;
+
+    static u64 load_le64(const u8* p){
+        u64 v;
+        std::memcpy(&v, p, 8);
+        return v; //(assumes a little endian host)
+    }
+
+    /* Branchless refill: afterwards at least 56 bits are available. Any bits
+       loaded above bitsleft are the genuine next bits of the stream, so
+       reloading them later is harmless. */
+    void refill_fast(){
+        bitbuf |= load_le64(in) << bitsleft;
+        in += (63 - bitsleft) >> 3;
+        bitsleft |= 56;
+    }
+
+    /* Byte at a time refill for the end of the input. Reading past the end
+       supplies zero bytes, which is only an error if those bits get used. */
+    void refill_slow(){
+        while (bitsleft <= 56){
+            if (in < in_end)
+                bitbuf |= (u64)*in++ << bitsleft;
+            else
+                overrun++;
+            bitsleft += 8;
+        }
+    }
+
+    void ensure_bits(u32 n){
+        if (bitsleft < n){
+            if (in_end - in >= 8)
+                refill_fast();
+            else
+                refill_slow();
+        }
+    }
+
+    u32 bits(u32 n) const {
+        return bitbuf & ((1ull << n) - 1);
+    }
+
+    void consume(u32 n){
+        bitbuf >>= n;
+        bitsleft -= n;
+    }
+
+    void check_overrun() const {
+        if (overrun * 8 > bitsleft)
+            throw InflateError("unexpected end of input");
+    }
+
+    /* Look up the next symbol, consuming its codeword. Needs 15 bits available. */
+    u32 decode(u32 const* table, u32 table_bits){
+        u32 entry = table[bits(table_bits)];
+        if (entry & ENTRY_SUBTABLE){
+            consume(table_bits);
+            entry = table[(entry >> 16) + bits((entry >> 8) & 31)];
+        }
+        consume(entry & 31);
+        return entry;
+    }
+
+    /* Decode a length or distance value whose codeword has been consumed */
+    u32 decode_value(u32 entry){
+        u32 extra = (entry >> 8) & 31;
+        u32 v = (entry >> 16) + bits(extra);
+        consume(extra);
+        return v;
+    }
+
+    void flush_output(BasicSink<T> const& sink){
+        if (out > flushed){
+            sink(flushed, out - flushed);
+            total_flushed += out - flushed;
+        }
+        flushed = out;
+    }
+
+    /* Hand the buffered output to the sink and slide the history back to the front */
+    void make_room(BasicSink<T> const& sink){
+        flush_output(sink);
+        T* base = buffer.data();
+        if (out - base > WINDOW_SIZE){
+            std::memmove(base, out - WINDOW_SIZE, WINDOW_SIZE * sizeof(T));
+            out = base + WINDOW_SIZE;
+            flushed = out;
+        }
+    }
+
+    T* out_limit(){
+        return buffer.data() + WINDOW_SIZE + OUT_CHUNK;
+    }
+
+    /* The decode loops only look at the output position against out_stop, which
+       is the end of the buffer or the max_out point, whichever comes first */
+    void update_out_stop(){
+        out_stop = out_limit();
+        if (stop_total != UINT64_MAX){
+            u64 total = total_out();
+            if (stop_total <= total)
+                out_stop = out;
+            else if (stop_total - total < (u64)(out_stop - out))
+                out_stop = out + (stop_total - total);
+        }
+    }
+
+    /* Called when out reaches out_stop. Returns false if decoding should stop. */
+    bool out_stop_reached(BasicSink<T> const& sink){
+        if (stopped())
+            return false;
+        if (out >= out_limit())
+            make_room(sink);
+        update_out_stop();
+        return true;
+    }
+
+    void stored_block(BasicSink<T> const& sink){
+        align_to_byte();
+        //Give back any whole bytes still sitting in the bit buffer
+        u32 unread = bitsleft / 8;
+        if (unread <= overrun){
+            overrun -= unread;
+        } else {
+            in -= unread - overrun;
+            overrun = 0;
+        }
+        bitbuf = 0;
+        bitsleft = 0;
+        if (in_end - in < 4)
+            throw InflateError("unexpected end of input");
+        u32 len = in[0] | (in[1] << 8);
+        u32 nlen = in[2] | (in[3] << 8);
+        in += 4;
+        if (len != (~nlen & 0xffff))
+            throw InflateError("stored block length mismatch");
+        if ((size_t)(in_end - in) < len)
+            throw InflateError("unexpected end of input");
+        while (len > 0){
+            if (out >= out_stop && !out_stop_reached(sink)){
+                //Leave the rest of the block unread
+                in += len;
+                return;
+            }
+            u32 n = std::min<u64>(len, out_stop - out);
+            std::copy(in, in + n, out);
+            out += n;
+            in += n;
+            len -= n;
+        }
+    }
+
+    void read_dynamic_header(){
+        static const u8 cl_permutation[NUM_PRECODE_SYMS] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+        ensure_bits(14);
+        u32 hlit = bits(5) + 257;
+        consume(5);
+        u32 hdist = bits(5) + 1;
+        consume(5);
+        u32 hclen = bits(4) + 4;
+        consume(4);
+        if (hlit > 286 || hdist > 30)
+            throw InflateError("too many length or distance symbols");
+
+        u8 precode_lens[NUM_PRECODE_SYMS] = {};
+        for(u32 i = 0; i < hclen; i++){
+            ensure_bits(3);
+            precode_lens[cl_permutation[i]] = bits(3);
+            consume(3);
+        }
+        if (!build_decode_table(precode_table, PRECODE_TABLE_SIZE, PRECODE_TABLE_BITS, precode_lens, NUM_PRECODE_SYMS, precode_results.data()))
+            throw InflateError("invalid code lengths code");
+
+        //Literal/length and distance code lengths form one run-length coded sequence
+        u8 lens[NUM_LITLEN_SYMS + NUM_DIST_SYMS] = {};
+        u32 i = 0;
+        while (i < hlit + hdist){
+            ensure_bits(PRECODE_TABLE_BITS + 7);
+            u32 entry = decode(precode_table, PRECODE_TABLE_BITS);
+            if (entry & ENTRY_INVALID)
+                throw InflateError("invalid code length symbol");
+            u32 sym = entry >> 16;
+            if (sym < 16){
+                lens[i++] = sym;
+                continue;
+            }
+            u32 repeat;
+            u8 value = 0;
+            if (sym == 16){
+                if (i == 0)
+                    throw InflateError("repeat with no previous length");
+                value = lens[i - 1];
+                repeat = 3 + bits(2);
+                consume(2);
+            } else if (sym == 17){
+                repeat = 3 + bits(3);
+                consume(3);
+            } else {
+                repeat = 11 + bits(7);
+                consume(7);
+            }
+            if (i + repeat > hlit + hdist)
+                throw InflateError("code length repeat overflows");
+            while (repeat--)
+                lens[i++] = value;
+        }
+        check_overrun();
+        if (lens[256] == 0)
+            throw InflateError("missing end of block code");
+
+        if (!build_decode_table(litlen_table, LITLEN_TABLE_SIZE, LITLEN_TABLE_BITS, lens, hlit, litlen_results.data()))
+            throw InflateError("invalid literal/length code");
+        if (!build_decode_table(dist_table, DIST_TABLE_SIZE, DIST_TABLE_BITS, lens + hlit, hdist, dist_results.data()))
+            throw InflateError("invalid distance code");
+    }
+
+    /* Copy length symbols from distance symbols back. The fast path may write up
+       to 16 bytes past the end of the match, which the slack absorbs. */
+    static void copy_match(T* dst, u32 length, u32 distance){
+        const T* src = dst - distance;
+        T* end = dst + length;
+        const u32 wide = 16 / sizeof(T);
+        const u32 narrow = 8 / sizeof(T);
+        if (distance >= wide){
+            do {
+                std::memcpy(dst, src, 16);
+                dst += wide;
+                src += wide;
+            } while (dst < end);
+        } else if (distance >= narrow){
+            do {
+                std::memcpy(dst, src, 8);
+                dst += narrow;
+                src += narrow;
+            } while (dst < end);
+        } else if (distance == 1){
+            std::fill(dst, end, *src);
+        } else {
+            while (dst < end)
+                *dst++ = *src++;
+        }
+    }
+
+    void check_distance(u32 distance){
+        if (distance > (u64)(out - buffer.data()))
+            throw InflateError("distance too far back");
+    }
+
+    void huffman_block(u32 const* litlen, u32 const* dist, BasicSink<T> const& sink){
+        for(;;){
+            if (out >= out_stop && !out_stop_reached(sink))
+                return;
+
+            if (in_end - in >= FAST_INPUT_MARGIN){
+                //Fast path: one refill covers up to three literals, or one length/distance pair
+                refill_fast();
+                u32 entry = decode(litlen, LITLEN_TABLE_BITS);
+                if (entry & ENTRY_LITERAL){
+                    *out++ = entry >> 16;
+                    entry = decode(litlen, LITLEN_TABLE_BITS);
+                    if (entry & ENTRY_LITERAL){
+                        *out++ = entry >> 16;
+                        entry = decode(litlen, LITLEN_TABLE_BITS);
+                        if (entry & ENTRY_LITERAL){
+                            *out++ = entry >> 16;
+                            continue;
+                        }
+                    }
+                }
+                if (entry & (ENTRY_EOB | ENTRY_INVALID)){
+                    if (entry & ENTRY_INVALID)
+                        throw InflateError("invalid literal/length code");
+                    return;
+                }
+                if (bitsleft < 33)
+                    refill_fast();
+                u32 length = decode_value(entry);
+                entry = decode(dist, DIST_TABLE_BITS);
+                if (entry & ENTRY_INVALID)
+                    throw InflateError("invalid distance code");
+                u32 distance = decode_value(entry);
+                check_distance(distance);
+                copy_match(out, length, distance);
+                out += length;
+            } else {
+                //Careful path near the end of the input
+                ensure_bits(MAX_CODE_LENGTH);
+                u32 entry = decode(litlen, LITLEN_TABLE_BITS);
+                if (entry & ENTRY_LITERAL){
+                    check_overrun();
+                    *out++ = entry >> 16;
+                    continue;
+                }
+                if (entry & (ENTRY_EOB | ENTRY_INVALID)){
+                    check_overrun();
+                    if (entry & ENTRY_INVALID)
+                        throw InflateError("invalid literal/length code");
+                    return;
+                }
+                ensure_bits(33);
+                u32 length = decode_value(entry);
+                entry = decode(dist, DIST_TABLE_BITS);
+                if (entry & ENTRY_INVALID)
+                    throw InflateError("invalid distance code");
+                u32 distance = decode_value(entry);
+                check_overrun();
+                check_distance(distance);
+                copy_match(out, length, distance);
+                out += length;
+            }
+        }
+    }
+
+    const u8* in_begin;
+    const u8* in_end;
+    const u8* in;
+    u64 bitbuf {0};
+    u32 bitsleft {0};
+    u32 overrun {0}; //zero bytes supplied past the end of the input
+
+    std::vector<T> buffer;
+    T* out;
+    T* out_stop;
+    T* flushed;
+    u64 total_flushed;
+    u64 stop_total {UINT64_MAX};
+    bool final_block_done {false};
+
+    u32 litlen_table[LITLEN_TABLE_SIZE];
+    u32 dist_table[DIST_TABLE_SIZE];
+    u32 precode_table[PRECODE_TABLE_SIZE];
+};
+
+using Inflater = BasicInflater<u8>;
+
+/* gzip header flag bits (RFC 1952) */
+const u8 FTEXT = 1;
+const u8 FHCRC = 2;
+const u8 FEXTRA = 4;
+const u8 FNAME = 8;
+const u8 FCOMMENT = 16;
+
+/* Parse a gzip member header starting at data[pos], returning the offset of the deflate stream */
+inline size_t parse_gzip_header(const u8* data, size_t size, size_t pos){
+    auto need = [&](size_t n){
+        if (size - pos < n)
+            throw InflateError("truncated gzip header");
+    };
+    need(10);
+    if (data[pos] != 0x1f || data[pos + 1] != 0x8b)
+        throw InflateError("not in gzip format");
+    if (data[pos + 2] != 8)
+        throw InflateError("unknown compression method");
+    u8 flags = data[pos + 3];
+    if (flags & 0xe0)
+        throw InflateError("reserved gzip header flags set");
+    pos += 10;
+    if (flags & FEXTRA){
+        need(2);
+        size_t xlen = data[pos] | (data[pos + 1] << 8);
+        pos += 2;
+        need(xlen);
+        pos += xlen;
+    }
+    for(u8 f: {FNAME, FCOMMENT}){
+        if (flags & f){
+            while (true){
+                need(1);
+                if (data[pos++] == 0)
+                    break;
+            }
+        }
+    }
+    if (flags & FHCRC){
+        need(2);
+        pos += 2;
+    }
+    return pos;
+}
+
+inline u32 read_le32(const u8* p){
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+/* Decompress the single gzip member starting at data[pos] to sink, checking
+   its CRC-32 and length. Returns the offset just past the member's trailer.
+   The inflater must have been constructed over data[0..size). */
+inline size_t gunzip_member(Inflater& inflater, const u8* data, size_t size, size_t pos, Sink const& sink, u64* produced_out = nullptr){
+    inflater.seek_byte(parse_gzip_header(data, size, pos));
+    inflater.reset_output();
+    u32 crc = 0;
+    auto crc32_update = cpu::kernels().crc32;
+    u64 produced = inflater.inflate([&](const u8* bytes, size_t n){
+        crc = crc32_update(crc, bytes, n);
+        sink(bytes, n);
+    });
+    inflater.align_to_byte();
+    pos = inflater.byte_position();
+    if (size - pos < 8)
+        throw InflateError("truncated gzip trailer");
+    if (read_le32(data + pos) != crc)
+        throw InflateError("CRC-32 mismatch");
+    if (read_le32(data + pos + 4) != (u32)produced)
+        throw InflateError("length mismatch");
+    if (produced_out)
+        *produced_out = produced;
+    return pos + 8;
+}
+
+/* True if data[pos..size) starts like a gzip member */
+inline bool at_gzip_magic(const u8* data, size_t size, size_t pos){
+    return size - pos >= 2 && data[pos] == 0x1f && data[pos + 1] == 0x8b;
+}
+
+/* Decompress every gzip member in data[0..size) to sink, checking each
+   member's CRC-32 and length. Returns the total number of bytes produced. */
+inline u64 gunzip(const u8* data, size_t size, Sink const& sink){
+    Inflater inflater {data, size};
+    u64 total = 0;
+    size_t pos = 0;
+    do {
+        u64 produced = 0;
+        pos = gunzip_member(inflater, data, size, pos, sink, &produced);
+        total += produced;
+        //Concatenated members decompress to the concatenation of their contents
+    } while (at_gzip_magic(data, size, pos));
+    if (pos != size)
+        throw InflateError("trailing garbage after gzip data");
+    return total;
+}
+
+inline u32 read_be32(const u8* p){
+    return ((u32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* Decompress a zlib stream, checking its Adler-32. If the stream was
+   compressed with a preset dictionary, the same dictionary must be given. */
+inline u64 unzlib(const u8* data, size_t size, Sink const& sink, std::vector<u8> const& dictionary = {}){
+    if (size < 2)
+        throw InflateError("truncated zlib header");
+    u32 cmf = data[0];
+    u32 flg = data[1];
+    if ((cmf & 0x0f) != 8)
+        throw InflateError("unknown compression method");
+    if ((cmf >> 4) > 7 || (cmf * 256 + flg) % 31 != 0)
+        throw InflateError("incorrect zlib header");
+    size_t pos = 2;
+    if (flg & 0x20){
+        if (size < 6)
+            throw InflateError("truncated zlib header");
+        if (dictionary.empty())
+            throw InflateError("a preset dictionary is needed");
+        if (read_be32(data + pos) != adler32::update(adler32::INITIAL, dictionary.data(), dictionary.size()))
+            throw InflateError("wrong preset dictionary");
+        pos += 4;
+    }
+
+    Inflater inflater {data, size};
+    inflater.seek_byte(pos);
+    if (flg & 0x20)
+        inflater.set_window(dictionary.data(), dictionary.size());
+    u32 adler = adler32::INITIAL;
+    u64 produced = inflater.inflate([&](const u8* bytes, size_t n){
+        adler = adler32::update(adler, bytes, n);
+        sink(bytes, n);
+    });
+    inflater.align_to_byte();
+    pos = inflater.byte_position();
+    if (size - pos < 4)
+        throw InflateError("truncated zlib trailer");
+    if (read_be32(data + pos) != adler)
+        throw InflateError("Adler-32 mismatch");
+    if (pos + 4 != size)
+        throw InflateError("trailing garbage after zlib data");
+    return produced;
+}
+
+/* Decompress raw DEFLATE data, whose history starts out as the dictionary
+   (if any). There is no check value, so only malformed data is detected. */
+inline u64 inflate_raw(const u8* data, size_t size, Sink const& sink, std::vector<u8> const& dictionary = {}){
+    Inflater inflater {data, size};
+    inflater.set_window(dictionary.data(), dictionary.size());
+    u64 produced = inflater.inflate(sink);
+    inflater.align_to_byte();
+    if (inflater.byte_position() != size)
+        throw InflateError("trailing garbage after deflate data");
+    return produced;
+}
+
+}
+
+#endif
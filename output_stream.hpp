@@ -15,18 +15,26 @@
 
 #include <iostream>
 #include <cstdint>
+#include <vector>
 
 /* These definitions are more reliable for fixed width types than using "int" and assuming its width */
 using u8 = std::uint8_t;
 using u16 = std::uint16_t;
 using u32 = std::uint32_t;
+using u64 = std::uint64_t;
 
 
 
 class OutputBitStream{
 public:
     /* Constructor */
-    OutputBitStream( std::ostream& output_stream ): bitvec{0}, numbits{0}, outfile{output_stream} {
+    OutputBitStream( std::ostream& output_stream ): bitvec{0}, numbits{0}, outfile{&output_stream}, bytes{stream_buffer} {
+
+    }
+
+    /* Constructor for a stream which collects its output in memory. The owner
+       of output_bytes may remove bytes from it between pushes. */
+    OutputBitStream( std::vector<u8>& output_bytes ): bitvec{0}, numbits{0}, outfile{nullptr}, bytes{output_bytes} {
 
     }
 
@@ -34,6 +42,7 @@ public:
     virtual ~OutputBitStream(){
         if (numbits > 0)
             output_byte();
+        flush_stream();
     }
 
     /* Push an entire byte into the stream, with the least significant bit pushed first */
@@ -86,16 +95,45 @@ public:
             output_byte();
     }
 
+    /* Total number of bits pushed so far (including any partial byte) */
+    u64 bits_written() const {
+        return bytes_written*8 + numbits;
+    }
+
+    /* Discard any partial byte and start counting from zero again */
+    void reset(){
+        bitvec = 0;
+        numbits = 0;
+        bytes_written = 0;
+    }
+
+    /* Write any buffered bytes through to the output stream (if there is one) */
+    void flush_stream(){
+        if (outfile && !bytes.empty()){
+            outfile->write((const char*)bytes.data(), bytes.size());
+            bytes.clear();
+        }
+    }
+
 
 private:
+    /* Bytes are handed to the output stream in chunks of about this size */
+    static const size_t STREAM_BUFFER_SIZE = 1 << 16;
+
     void output_byte(){
-        outfile.put((unsigned char)bitvec);
+        bytes.push_back((unsigned char)bitvec);
         bitvec = 0;
         numbits = 0;
+        bytes_written++;
+        if (outfile && bytes.size() >= STREAM_BUFFER_SIZE)
+            flush_stream();
     }
     u32 bitvec;
     u32 numbits;
-    std::ostream& outfile;
+    u64 bytes_written {0};
+    std::ostream* outfile;
+    std::vector<u8> stream_buffer;
+    std::vector<u8>& bytes;
 };
 
 
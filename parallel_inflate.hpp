@@ -0,0 +1,325 @@
+/* parallel_inflate.hpp
+
+   Multi-threaded decompression of gzip files which are made of many
+   independent pieces: concatenated gzip members (e.g. BGZF), or a single
+   member with a gzcomp random access index (see gzindex.hpp).
+
+   The pieces are inflated on worker threads, and the results are handed to
+   the sink strictly in order through a bounded reorder buffer, so memory use
+   stays at a few pieces per thread no matter how large the file is. A
+   worker buffers at most MAX_BUFFERED bytes of a member; a larger one is
+   decoded again on the calling thread, straight to the sink.
+
+   Member boundaries come from the BGZF BSIZE fields when every member has
+   one. Otherwise every offset which looks like a gzip header is treated as a
+   candidate member start and decoded speculatively; while writing results in
+   order, only the candidates where the previous member actually ended are
+   used, and the rest (gzip magic bytes which happened to occur inside
+   compressed data) are discarded. Every member's CRC-32 and length are
+   checked by the worker which decoded it. With an index, each piece is the
+   stretch between two checkpoints, and the per-piece CRCs are combined with
+   crc32::combine() and checked against the trailer at the end.
+*/
+
+#ifndef PARALLEL_INFLATE_HPP
+#define PARALLEL_INFLATE_HPP
+
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "inflate.hpp"
+#include "gzindex.hpp"
+#include "crc32.hpp"
+#include "cpu_dispatch.hpp"
+#include "trace.hpp"
+
+namespace parallel_inflate {
+
+using u8 = std::uint8_t;
+using u32 = std::uint32_t;
+using u64 = std::uint64_t;
+
+/* Run work(i, state) for every i in [0, count) on a pool of threads, where
+   state is a per-thread object from make_state(), and call consume(i, result)
+   on the calling thread in increasing order of i. Workers never run more
+   than max_ahead tasks ahead of the consumer. Exceptions thrown by work are
+   rethrown from here when their result comes up for consumption. Tasks,
+   waits for them and consumption show up in a trace (see trace.hpp). */
+template<typename Result, typename MakeState, typename Work, typename Consume>
+void ordered_parallel(size_t count, unsigned threads, size_t max_ahead, MakeState const& make_state, Work const& work, Consume const& consume){
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::map<size_t, Result> ready;
+    std::map<size_t, std::exception_ptr> errors;
+    size_t next_task = 0;
+    size_t consumed = 0;
+    bool abort = false;
+
+    auto worker = [&]{
+        trace::name_thread("worker");
+        auto state = make_state();
+        while (true){
+            size_t i;
+            {
+                std::unique_lock<std::mutex> lock {mutex};
+                changed.wait(lock, [&]{
+                    return abort || next_task >= count || next_task < consumed + max_ahead;
+                });
+                if (abort || next_task >= count)
+                    return;
+                i = next_task++;
+            }
+            Result r {};
+            std::exception_ptr error;
+            try {
+                trace::Scope scope {"task"};
+                r = work(i, state);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            {
+                std::lock_guard<std::mutex> lock {mutex};
+                ready.emplace(i, std::move(r));
+                if (error)
+                    errors.emplace(i, error);
+            }
+            changed.notify_all();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    //Stop and join the workers however we leave this function
+    struct Joiner {
+        std::vector<std::thread>& pool;
+        std::mutex& mutex;
+        std::condition_variable& changed;
+        bool& abort;
+        ~Joiner(){
+            {
+                std::lock_guard<std::mutex> lock {mutex};
+                abort = true;
+            }
+            changed.notify_all();
+            for(auto& t: pool)
+                t.join();
+        }
+    } joiner {pool, mutex, changed, abort};
+    for(unsigned t = 0; t < threads; t++)
+        pool.emplace_back(worker);
+
+    for(size_t i = 0; i < count; i++){
+        Result r;
+        std::exception_ptr error;
+        {
+            trace::Scope scope {"wait for task"};
+            std::unique_lock<std::mutex> lock {mutex};
+            changed.wait(lock, [&]{ return ready.count(i) != 0; });
+            r = std::move(ready[i]);
+            ready.erase(i);
+            auto e = errors.find(i);
+            if (e != errors.end()){
+                error = e->second;
+                errors.erase(e);
+            }
+        }
+        if (error)
+            std::rethrow_exception(error);
+        {
+            trace::Scope scope {"consume"};
+            consume(i, r);
+        }
+        {
+            std::lock_guard<std::mutex> lock {mutex};
+            consumed++;
+        }
+        changed.notify_all();
+    }
+}
+
+/* Offsets of every member of a BGZF file, or an empty vector if the data is
+   not a well formed chain of BGZF members */
+inline std::vector<size_t> bgzf_members(const u8* data, size_t size){
+    std::vector<size_t> members;
+    size_t pos = 0;
+    while (pos < size){
+        //Fixed 18 byte header: FEXTRA with XLEN 6 holding a single "BC" subfield
+        if (size - pos < 18 || data[pos] != 0x1f || data[pos + 1] != 0x8b || data[pos + 2] != 8
+            || !(data[pos + 3] & inflate::FEXTRA) || data[pos + 10] != 6 || data[pos + 11] != 0
+            || data[pos + 12] != 'B' || data[pos + 13] != 'C' || data[pos + 14] != 2 || data[pos + 15] != 0)
+            return {};
+        members.push_back(pos);
+        pos += (size_t)(data[pos + 16] | (data[pos + 17] << 8)) + 1;
+    }
+    if (pos != size)
+        return {};
+    return members;
+}
+
+/* Every offset where a gzip member could start: the magic bytes, the DEFLATE
+   method, and no reserved flags */
+inline std::vector<size_t> candidate_members(const u8* data, size_t size){
+    std::vector<size_t> candidates;
+    size_t pos = 0;
+    while (pos + 4 <= size){
+        const u8* p = (const u8*)std::memchr(data + pos, 0x1f, size - pos - 3);
+        if (!p)
+            break;
+        pos = p - data;
+        if (p[1] == 0x8b && p[2] == 8 && (p[3] & 0xe0) == 0)
+            candidates.push_back(pos);
+        pos++;
+    }
+    return candidates;
+}
+
+/* Most output a worker holds for one member */
+const size_t MAX_BUFFERED = 4 << 20;
+
+/* Most output a BGZF member may have */
+const size_t BGZF_MAX_OUTPUT = 65536;
+
+struct MemberResult {
+    bool ok;
+    bool too_large;  //gave up at MAX_BUFFERED bytes
+    size_t end;
+    std::vector<u8> bytes;
+};
+
+/* Thrown from a worker's sink to stop decoding a member at MAX_BUFFERED */
+struct TooLarge {};
+
+/* Decompress a file of concatenated gzip members with the given number of threads */
+inline u64 gunzip(const u8* data, size_t size, unsigned threads, inflate::Sink const& sink){
+    std::vector<size_t> starts = bgzf_members(data, size);
+    bool exact = !starts.empty();
+    if (!exact)
+        starts = candidate_members(data, size);
+    if (threads <= 1 || starts.size() <= 1 || starts[0] != 0)
+        return inflate::gunzip(data, size, sink);
+
+    auto make_state = [&]{
+        return std::make_unique<inflate::Inflater>(data, size);
+    };
+    auto work = [&](size_t i, std::unique_ptr<inflate::Inflater>& inflater){
+        MemberResult r {false, false, 0, {}};
+        size_t start = starts[i];
+        if (exact){
+            //The trailer's ISIZE tells us how much room the output needs (if the file is honest)
+            size_t end = i + 1 < starts.size() ? starts[i + 1] : size;
+            r.bytes.reserve(std::min<size_t>(inflate::read_le32(data + end - 4), BGZF_MAX_OUTPUT));
+        }
+        try {
+            r.end = inflate::gunzip_member(*inflater, data, size, start, [&](const u8* bytes, size_t n){
+                if (r.bytes.size() + n > MAX_BUFFERED)
+                    throw TooLarge {};
+                r.bytes.insert(r.bytes.end(), bytes, bytes + n);
+            });
+            r.ok = true;
+        } catch (inflate::InflateError const&){
+            //Either a false candidate, or a real error which is reported below
+            r.bytes.clear();
+        } catch (TooLarge const&){
+            //Left to the calling thread, if this is a member at all
+            r.too_large = true;
+            r.bytes = {};
+        }
+        return r;
+    };
+
+    size_t pos = 0;
+    u64 total = 0;
+    inflate::Inflater inflater {data, size};
+    auto consume = [&](size_t i, MemberResult& r){
+        if (starts[i] != pos)
+            return; //inside a member we have already written (or past the data, if that ended early)
+        if (r.too_large){
+            u64 produced = 0;
+            pos = inflate::gunzip_member(inflater, data, size, pos, sink, &produced);
+            total += produced;
+            return;
+        }
+        if (!r.ok){
+            //Decode again here to report what went wrong
+            inflate::gunzip_member(inflater, data, size, pos, [](const u8*, size_t){});
+            throw inflate::InflateError("member failed to decompress");
+        }
+        sink(r.bytes.data(), r.bytes.size());
+        total += r.bytes.size();
+        pos = r.end;
+    };
+    ordered_parallel<MemberResult>(starts.size(), threads, 4 * threads, make_state, work, consume);
+
+    if (pos != size)
+        throw inflate::InflateError("trailing garbage after gzip data");
+    return total;
+}
+
+struct ChunkResult {
+    std::vector<u8> bytes;
+    u32 crc;
+    size_t trailer;
+};
+
+/* Decompress a single member file using the checkpoints of its index, with
+   the stretch between each pair of checkpoints inflated on its own thread */
+inline u64 gunzip_indexed(const u8* data, size_t size, gzindex::Index const& index, unsigned threads, inflate::Sink const& sink){
+    auto const& points = index.points;
+    if (points.empty() || points[0].out_offset != 0)
+        throw gzindex::IndexError("index does not start at the beginning of the data");
+
+    auto make_state = [&]{
+        return std::make_unique<inflate::Inflater>(data, size);
+    };
+    auto work = [&](size_t i, std::unique_ptr<inflate::Inflater>& inflater){
+        ChunkResult r {{}, 0, 0};
+        bool last = i + 1 == points.size();
+        u64 length = last ? UINT64_MAX : points[i + 1].out_offset - points[i].out_offset;
+        if (!last)
+            r.bytes.reserve(length + deflate_tables::MAX_MATCH);
+        inflater->seek_bits(points[i].bit_offset);
+        inflater->set_window(points[i].window.data(), points[i].window.size());
+        inflater->inflate([&](const u8* bytes, size_t n){
+            r.bytes.insert(r.bytes.end(), bytes, bytes + n);
+        }, length);
+        if (last){
+            inflater->align_to_byte();
+            r.trailer = inflater->byte_position();
+        } else {
+            if (r.bytes.size() < length)
+                throw inflate::InflateError("data ends before the next checkpoint");
+            r.bytes.resize(length);
+        }
+        r.crc = cpu::kernels().crc32(0, r.bytes.data(), r.bytes.size());
+        return r;
+    };
+
+    u32 crc = 0;
+    u64 total = 0;
+    size_t trailer = 0;
+    auto consume = [&](size_t, ChunkResult& r){
+        sink(r.bytes.data(), r.bytes.size());
+        crc = crc32::combine(crc, r.crc, r.bytes.size());
+        total += r.bytes.size();
+        trailer = r.trailer;
+    };
+    ordered_parallel<ChunkResult>(points.size(), std::max(threads, 1u), 2 * std::max(threads, 1u), make_state, work, consume);
+
+    if (size - trailer < 8)
+        throw inflate::InflateError("truncated gzip trailer");
+    if (inflate::read_le32(data + trailer) != crc)
+        throw inflate::InflateError("CRC-32 mismatch");
+    if (inflate::read_le32(data + trailer + 4) != (u32)total)
+        throw inflate::InflateError("length mismatch");
+    if (trailer + 8 != size)
+        throw inflate::InflateError("trailing garbage after gzip data");
+    return total;
+}
+
+}
+
+#endif
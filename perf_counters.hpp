@@ -0,0 +1,103 @@
+/* perf_counters.hpp
+
+   Hardware event counts for the calling thread from Linux perf_event_open:
+   cycles, instructions, L1 data cache read misses, last level cache misses,
+   branch misses and data TLB read misses, counted in user space only. A Counters object opens
+   them when it is constructed, and read() returns their totals so far, so
+   the events in a stretch of code are the difference of two reads.
+
+   A counter the kernel or the machine does not offer (no PMU in a virtual
+   machine, or perf_event_paranoid set too high) is left out: available()
+   says which ones are being counted, and their values read as 0. When more
+   counters are open than the PMU has registers the kernel takes turns, and
+   the totals are scaled up by the share of the time each one was running.
+*/
+
+#ifndef PERF_COUNTERS_HPP
+#define PERF_COUNTERS_HPP
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace perf_counters {
+
+using u32 = std::uint32_t;
+using u64 = std::uint64_t;
+
+enum Counter { CYCLES, INSTRUCTIONS, L1D_MISSES, LLC_MISSES, BRANCH_MISSES, DTLB_MISSES, NUM_COUNTERS };
+
+const char* const NAMES[NUM_COUNTERS] {"cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses", "dtlb_misses"};
+
+using Values = std::array<u64, NUM_COUNTERS>;
+
+class Counters {
+public:
+    Counters(){
+        const u64 l1d_read_miss = PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+        const u64 dtlb_read_miss = PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+        fds[CYCLES] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        fds[INSTRUCTIONS] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        fds[L1D_MISSES] = open(PERF_TYPE_HW_CACHE, l1d_read_miss);
+        fds[LLC_MISSES] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        fds[BRANCH_MISSES] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+        fds[DTLB_MISSES] = open(PERF_TYPE_HW_CACHE, dtlb_read_miss);
+    }
+
+    ~Counters(){
+        for(int fd: fds){
+            if (fd >= 0)
+                close(fd);
+        }
+    }
+
+    Counters(Counters const&) = delete;
+    Counters& operator=(Counters const&) = delete;
+
+    bool available(Counter c) const {
+        return fds[c] >= 0;
+    }
+
+    bool any_available() const {
+        for(int c = 0; c < NUM_COUNTERS; c++){
+            if (available((Counter)c))
+                return true;
+        }
+        return false;
+    }
+
+    /* The events counted since construction */
+    Values read() const {
+        Values v {};
+        for(int c = 0; c < NUM_COUNTERS; c++){
+            //value, time enabled, time running
+            u64 data[3];
+            if (fds[c] < 0 || ::read(fds[c], data, sizeof(data)) != sizeof(data))
+                continue;
+            v[c] = data[2] == 0 || data[2] == data[1] ? data[0] : (u64)((double)data[0] * data[1] / data[2]);
+        }
+        return v;
+    }
+
+private:
+    static int open(u32 type, u64 config){
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+
+    std::array<int, NUM_COUNTERS> fds;
+};
+
+}
+
+#endif
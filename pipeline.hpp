@@ -0,0 +1,480 @@
+/* pipeline.hpp
+
+   Compression of one stream from a file descriptor to another in three
+   stages on three threads: a reader fills input buffers, the calling thread
+   compresses them, and a writer drains the compressed output, so waiting
+   for the input or the output overlaps with compression instead of
+   stalling it. The stages pass buffers through bounded lock-free queues
+   (spsc_queue.hpp), and each kind of buffer goes round a loop of two
+   queues, from the stage which empties it back to the one which fills it.
+   An input buffer with nothing in it marks the end of the input, and a null
+   output buffer the end of the output.
+
+   The reader and writer do their I/O in one of three ways:
+
+     Io::Sync    plain read() and write(), one buffer at a time
+     Io::Uring   io_uring (uring.hpp): reads of a regular file are issued
+                 for every free buffer at once, at successive offsets, into
+                 buffers registered with the kernel, and writes to a regular
+                 file likewise; each batch goes to the kernel in one system
+                 call. Pipes and sockets get one request at a time, since
+                 the order they complete in is the order of the data.
+     Io::Splice  output to a pipe goes by vmsplice(), which hands the
+                 pages of the output buffers to the pipe instead of copying
+                 them in; anything else is done as with Io::Sync.
+
+   A spliced buffer belongs to the pipe until whatever reads the pipe has
+   taken its bytes, so before the compressor reuses it, hand_off() checks
+   with FIONREAD that the reader has got that far, and if not (the output
+   is backed up, where write() would have blocked instead) waits for it.
+   Buffers still unread at the end of a stream are left to the pipe and
+   never freed.
+
+   If io_uring cannot be set up, a Pipeline quietly uses Io::Sync.
+   A Pipeline keeps its buffers and rings for every stream it compresses.
+*/
+
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <memory>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "deflate.hpp"
+#include "spsc_queue.hpp"
+#include "trace.hpp"
+#include "uring.hpp"
+
+namespace pipeline {
+
+enum class Io { Sync, Uring, Splice };
+
+class Pipeline {
+public:
+    static const size_t COUNT = 4; //buffers of each kind
+    static const size_t INPUT_SIZE = 1 << 18;
+
+    explicit Pipeline(Io io = Io::Sync): mode{io} {
+        for(size_t i = 0; i < COUNT; i++){
+            input[i].data.reset(new char[INPUT_SIZE]);
+            input[i].index = i;
+        }
+        if (mode == Io::Uring){
+            try {
+                read_ring = std::make_unique<uring::Ring>(2 * COUNT);
+                write_ring = std::make_unique<uring::Ring>(2 * COUNT);
+                std::array<iovec, COUNT> buffers;
+                for(size_t i = 0; i < COUNT; i++)
+                    buffers[i] = iovec{input[i].data.get(), INPUT_SIZE};
+                fixed = read_ring->register_buffers(buffers.data(), COUNT);
+            } catch (std::system_error const&){
+                read_ring.reset();
+                write_ring.reset();
+                mode = Io::Sync;
+            }
+        }
+    }
+
+    /* The way I/O is actually being done */
+    Io io() const {
+        return mode;
+    }
+
+    /* Compress everything from in_fd as one member to out_fd, with a
+       compressor which has just been reset. Throws std::system_error if
+       reading or writing fails. */
+    void compress(deflate::Compressor& compressor, int in_fd, int out_fd){
+        InputQueue free_input, full_input;
+        OutputQueue free_output, full_output;
+        for(auto& b: input)
+            free_input.push(&b);
+        for(auto& b: output)
+            free_output.push(&b);
+        read_error = write_error = 0;
+        splice_fd = mode == Io::Splice && is_pipe(out_fd) ? out_fd : -1;
+        spliced = 0;
+        spliced_end.fill(0);
+
+        std::thread reader {[&]{
+            trace::name_thread("reader");
+            if (mode == Io::Uring)
+                read_uring(in_fd, free_input, full_input);
+            else
+                read_sync(in_fd, free_input, full_input);
+        }};
+        std::thread writer {[&]{
+            trace::name_thread("writer");
+            if (mode == Io::Uring)
+                write_uring(out_fd, free_output, full_output);
+            else if (splice_fd >= 0)
+                write_splice(out_fd, free_output, full_output);
+            else
+                write_sync(out_fd, free_output, full_output);
+        }};
+
+        //Trade the compressed bytes for an empty buffer (the writer's) rather than copying them.
+        //A compressor adapting to a target rate is told how long that took.
+        bool adapting = compressor.target() > 0;
+        auto hand_off = [&]{
+            auto& bytes = compressor.output_bytes();
+            if (bytes.empty())
+                return;
+            std::vector<u8>* b;
+            {
+                trace::Scope scope {"wait for output buffer"};
+                auto start = adapting ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+                b = free_output.pop();
+                if (splice_fd >= 0)
+                    wait_until_read(b);
+                if (adapting)
+                    compressor.add_output_wait(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            }
+            b->swap(bytes);
+            full_output.push(b);
+        };
+        while (true){
+            Input* b;
+            {
+                trace::Scope scope {"wait for input"};
+                b = full_input.pop();
+            }
+            if (b->size == 0)
+                break;
+            {
+                trace::Scope scope {"compress", b->size};
+                compressor.compress((const u8*)b->data.get(), b->size);
+            }
+            free_input.push(b);
+            hand_off();
+        }
+        {
+            trace::Scope scope {"finish"};
+            compressor.finish();
+        }
+        hand_off();
+        full_output.push(nullptr);
+        reader.join();
+        writer.join();
+        if (splice_fd >= 0){
+            for(auto& b: output){
+                if (!was_read(&b))
+                    abandon(b);
+            }
+        }
+        if (read_error)
+            throw std::system_error(read_error, std::generic_category(), "read");
+        if (write_error)
+            throw std::system_error(write_error, std::generic_category(), "write");
+    }
+
+private:
+    struct Input {
+        std::unique_ptr<char[]> data;
+        size_t size;
+        unsigned index; //among the registered buffers
+    };
+    using InputQueue = spsc_queue::Queue<Input*, COUNT>;
+    using OutputQueue = spsc_queue::Queue<std::vector<u8>*, COUNT>;
+
+    /* Where a regular file's next read or write goes, or -1 for anything
+       which has to be read or written in order through its file position */
+    static off_t start_offset(int fd, bool writing){
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+            return -1;
+        if (writing && (fcntl(fd, F_GETFL) & O_APPEND))
+            return -1;
+        return lseek(fd, 0, SEEK_CUR);
+    }
+
+    void read_sync(int fd, InputQueue& free_input, InputQueue& full_input){
+        while (true){
+            Input* b = free_input.pop();
+            trace::Scope scope {"read"};
+            b->size = 0;
+            while (b->size < INPUT_SIZE && !read_error){
+                ssize_t got = read(fd, b->data.get() + b->size, INPUT_SIZE - b->size);
+                if (got == 0)
+                    break;
+                if (got < 0 && errno != EINTR)
+                    read_error = errno;
+                else if (got > 0)
+                    b->size += got;
+            }
+            scope.set_bytes(b->size);
+            bool last = b->size < INPUT_SIZE; //at the end of the input, or after an error
+            full_input.push(b);
+            if (last){
+                if (b->size > 0){
+                    b = free_input.pop();
+                    b->size = 0;
+                    full_input.push(b);
+                }
+                return;
+            }
+        }
+    }
+
+    void write_sync(int fd, OutputQueue& free_output, OutputQueue& full_output){
+        while (std::vector<u8>* b = full_output.pop()){
+            trace::Scope scope {"write", b->size()};
+            size_t done = 0;
+            while (done < b->size() && !write_error){
+                ssize_t n = write(fd, b->data() + done, b->size() - done);
+                if (n < 0 && errno != EINTR)
+                    write_error = errno;
+                else if (n > 0)
+                    done += n;
+            }
+            b->clear();
+            free_output.push(b);
+        }
+    }
+
+    static bool is_pipe(int fd){
+        struct stat st;
+        return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+    }
+
+    void write_splice(int fd, OutputQueue& free_output, OutputQueue& full_output){
+        while (std::vector<u8>* b = full_output.pop()){
+            trace::Scope scope {"vmsplice", b->size()};
+            size_t done = 0;
+            while (done < b->size() && !write_error){
+                iovec v {b->data() + done, b->size() - done};
+                ssize_t n = vmsplice(fd, &v, 1, 0);
+                if (n < 0 && errno != EINTR)
+                    write_error = errno;
+                else if (n > 0)
+                    done += n;
+            }
+            spliced.fetch_add(done, std::memory_order_release);
+            spliced_end[b - output.data()] = spliced.load(std::memory_order_relaxed);
+            b->clear(); //keeps the storage, which hand_off() only writes to once it has been read
+            free_output.push(b);
+        }
+    }
+
+    /* Whether the pipe's reader has taken every byte spliced from b */
+    bool was_read(const std::vector<u8>* b) const {
+        u64 end = spliced_end[b - output.data()];
+        if (end == 0)
+            return true;
+        //Count what has been spliced before asking what is left, so bytes spliced in between only make it look less read
+        u64 total = spliced.load(std::memory_order_acquire);
+        int queued;
+        if (ioctl(splice_fd, FIONREAD, &queued) != 0)
+            return false;
+        return total - queued >= end;
+    }
+
+    void wait_until_read(std::vector<u8>* b){
+        trace::Scope scope {"wait for pipe reader"};
+        auto pause = std::chrono::microseconds(20);
+        while (!was_read(b)){
+            if (write_error){
+                //Nothing more will be read (the reader has gone), so let the pipe keep these pages
+                abandon(*b);
+                break;
+            }
+            std::this_thread::sleep_for(pause);
+            pause = std::min(2 * pause, std::chrono::microseconds(1000));
+        }
+        spliced_end[b - output.data()] = 0;
+    }
+
+    /* Give up the storage of a buffer the pipe may still hold pages of.
+       Freeing it would let the memory be reused while the pipe's reader
+       can still see it, so it is deliberately leaked. */
+    static void abandon(std::vector<u8>& b){
+        new std::vector<u8>(std::move(b));
+        b = std::vector<u8>();
+    }
+
+    /* A read or write in flight. The kernel knows it by its slot number. */
+    struct Request {
+        void* buffer;
+        size_t size;        //of the whole request
+        size_t done;        //bytes transferred so far
+        off_t offset;       //of the start of the request, or -1 to use the file position
+        unsigned buf_index; //of a registered buffer
+        bool finished;
+    };
+
+    static void queue(uring::Ring& ring, u8 opcode, int fd, Request const& r, size_t slot){
+        io_uring_sqe* sqe = ring.next_sqe(); //there is an entry for every slot, so never null
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->off = r.offset < 0 ? (u64)-1 : r.offset + r.done;
+        sqe->addr = (u64)r.buffer + r.done;
+        sqe->len = r.size - r.done;
+        sqe->buf_index = r.buf_index;
+        sqe->user_data = slot;
+    }
+
+    /* Keep a read in flight for every free buffer (one at a time from a
+       pipe), submitted in batches, and pass the buffers on in order as they fill */
+    void read_uring(int fd, InputQueue& free_input, InputQueue& full_input){
+        const u8 opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        off_t offset = start_offset(fd, false);
+        const bool ordered = offset < 0;
+        off_t position = offset; //just past the data passed on
+        std::array<Request, COUNT> requests;
+        std::array<Input*, COUNT> buffers;
+        size_t first = 0, count = 0; //the requests in flight, oldest first, in a ring of slots
+        bool end = false;
+        Input* spare = nullptr; //a buffer with nothing in it, for the end marker
+        while (true){
+            while (!end && count < (ordered ? 1 : COUNT)){
+                Input* b;
+                if (count == 0)
+                    b = free_input.pop();
+                else if (!free_input.try_pop(b))
+                    break;
+                size_t slot = (first + count++) % COUNT;
+                buffers[slot] = b;
+                requests[slot] = Request{b->data.get(), INPUT_SIZE, 0, ordered ? -1 : offset, b->index, false};
+                if (!ordered)
+                    offset += INPUT_SIZE;
+                queue(*read_ring, opcode, fd, requests[slot], slot);
+            }
+            if (count == 0)
+                break;
+            io_uring_cqe cqe;
+            {
+                trace::Scope scope {"wait for reads"};
+                read_ring->submit();
+                cqe = read_ring->wait_completion();
+            }
+            Request& r = requests[cqe.user_data];
+            if (cqe.res == -EINTR || cqe.res == -EAGAIN){
+                queue(*read_ring, opcode, fd, r, cqe.user_data);
+            } else if (cqe.res <= 0){
+                //The end of the input (any reads beyond it come back empty too), or an error
+                if (cqe.res < 0 && !read_error)
+                    read_error = -cqe.res;
+                r.finished = true;
+                end = true;
+            } else {
+                r.done += cqe.res;
+                r.finished = r.done == r.size;
+                if (!r.finished)
+                    queue(*read_ring, opcode, fd, r, cqe.user_data); //a short read: ask for the rest
+            }
+            while (count > 0 && requests[first].finished){
+                Input* b = buffers[first];
+                b->size = requests[first].done;
+                if (b->size > 0 && !read_error){
+                    position += b->size;
+                    full_input.push(b);
+                } else {
+                    spare = b;
+                }
+                first = (first + 1) % COUNT;
+                count--;
+            }
+        }
+        //Leave the file position where plain reads would have
+        if (!ordered)
+            lseek(fd, position, SEEK_SET);
+        Input* b = spare ? spare : free_input.pop();
+        b->size = 0;
+        full_input.push(b);
+    }
+
+    /* Keep a write in flight for every full buffer (one at a time to a
+       pipe), submitted in batches, and recycle each as it is written */
+    void write_uring(int fd, OutputQueue& free_output, OutputQueue& full_output){
+        off_t offset = start_offset(fd, true);
+        const bool ordered = offset < 0;
+        std::array<Request, COUNT> requests;
+        std::array<std::vector<u8>*, COUNT> buffers {};
+        size_t count = 0;
+        bool end = false;
+        auto recycle = [&](std::vector<u8>* b){
+            b->clear();
+            free_output.push(b);
+        };
+        while (true){
+            while (!end && count < (ordered ? 1 : COUNT)){
+                std::vector<u8>* b;
+                if (count == 0)
+                    b = full_output.pop();
+                else if (!full_output.try_pop(b))
+                    break;
+                if (!b){
+                    end = true;
+                } else if (write_error){
+                    recycle(b);
+                } else {
+                    size_t slot = std::find(buffers.begin(), buffers.end(), nullptr) - buffers.begin();
+                    buffers[slot] = b;
+                    requests[slot] = Request{b->data(), b->size(), 0, ordered ? -1 : offset, 0, false};
+                    if (!ordered)
+                        offset += b->size();
+                    queue(*write_ring, IORING_OP_WRITE, fd, requests[slot], slot);
+                    count++;
+                }
+            }
+            if (count == 0){
+                if (end)
+                    break;
+                continue;
+            }
+            io_uring_cqe cqe;
+            {
+                trace::Scope scope {"wait for writes"};
+                write_ring->submit();
+                cqe = write_ring->wait_completion();
+            }
+            Request& r = requests[cqe.user_data];
+            if (cqe.res == -EINTR || cqe.res == -EAGAIN){
+                queue(*write_ring, IORING_OP_WRITE, fd, r, cqe.user_data);
+                continue;
+            }
+            if (cqe.res <= 0){
+                if (!write_error)
+                    write_error = cqe.res < 0 ? -cqe.res : EIO;
+            } else {
+                r.done += cqe.res;
+                if (r.done < r.size){
+                    queue(*write_ring, IORING_OP_WRITE, fd, r, cqe.user_data); //a short write: send the rest
+                    continue;
+                }
+            }
+            recycle(buffers[cqe.user_data]);
+            buffers[cqe.user_data] = nullptr;
+            count--;
+        }
+        //Leave the file position where plain writes would have
+        if (!ordered && !write_error)
+            lseek(fd, offset, SEEK_SET);
+    }
+
+    Io mode;
+    std::array<Input, COUNT> input;
+    std::array<std::vector<u8>, COUNT> output;
+    std::unique_ptr<uring::Ring> read_ring;
+    std::unique_ptr<uring::Ring> write_ring;
+    bool fixed {false}; //whether the input buffers are registered with read_ring
+    int read_error {0};
+    std::atomic<int> write_error {0};   //also checked by the compressing thread when splicing
+    int splice_fd {-1};                 //the output pipe when splicing to one, else -1
+    std::atomic<u64> spliced {0};       //bytes spliced to it in this stream
+    std::array<u64, COUNT> spliced_end; //for each output buffer, the count just past its bytes, or 0
+};
+
+}
+
+#endif
@@ -0,0 +1,417 @@
+/* server.hpp
+
+   A compression service on a UNIX domain socket, so that callers which
+   compress many small things pay for process startup and table setup once
+   instead of per file.
+
+   The server runs a fixed pool of worker threads. Each worker owns a warm
+   deflate::Compressor and its buffers, accepts a connection, and serves
+   requests on it one after another until the client hangs up, or leaves
+   it idle for IDLE_TIMEOUT_SECONDS, so that a client which goes quiet
+   cannot keep the worker from everyone else. Messages of up to
+   small_deflate::MAX_INPUT bytes take the small message fast path.
+
+   Protocol (integers little endian). A request is a 16 byte header
+       u8   op        'c' to compress, 'd' to decompress
+       u8   format    0 gzip, 1 zlib, 2 raw deflate
+       u8   flags     bit 0: the data is in a file descriptor passed with
+                      the header (SCM_RIGHTS) instead of following it
+       u8   reserved
+       u32  reserved
+       u64  length    bytes of data following the header (0 with an fd)
+   and is answered with a 16 byte header
+       u8   status    0 ok, 1 error
+       7 bytes reserved
+       u64  length
+   followed by the output, or by an error message.
+*/
+
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "deflate.hpp"
+#include "small_deflate.hpp"
+#include "inflate.hpp"
+
+namespace server {
+
+using u8 = std::uint8_t;
+using u32 = std::uint32_t;
+using u64 = std::uint64_t;
+
+const u8 OP_COMPRESS = 'c';
+const u8 OP_DECOMPRESS = 'd';
+const u8 FLAG_FD = 1;
+const u8 STATUS_OK = 0;
+const u8 STATUS_ERROR = 1;
+const size_t HEADER_SIZE = 16;
+/* Larger requests (inline data, passed files, or decompressed output) are
+   refused rather than buffered: each worker holds a whole request in memory */
+const u64 MAX_REQUEST = (u64)1 << 28;
+/* A connection on which nothing can be read or written for this long is dropped */
+const int IDLE_TIMEOUT_SECONDS = 10;
+/* How long a worker waits to accept again after failing to (out of file descriptors, say) */
+const auto ACCEPT_BACKOFF = std::chrono::milliseconds(100);
+
+/* Thrown for socket failures and for requests the server refused */
+class ServerError: public std::runtime_error {
+public:
+    explicit ServerError(std::string const& what): std::runtime_error(what) {}
+};
+
+struct Request {
+    u8 op {OP_COMPRESS};
+    deflate::Format format {deflate::Format::Gzip};
+    u8 flags {0};
+    u64 length {0};
+};
+
+inline void put_u64(u8* p, u64 v){
+    for(int i = 0; i < 8; i++)
+        p[i] = v >> (8 * i);
+}
+
+inline u64 get_u64(const u8* p){
+    u64 v = 0;
+    for(int i = 0; i < 8; i++)
+        v |= (u64)p[i] << (8 * i);
+    return v;
+}
+
+/* Read exactly size bytes. Returns false if the peer closed the connection before any arrived. */
+inline bool read_full(int fd, void* buffer, size_t size){
+    u8* p = (u8*)buffer;
+    size_t done = 0;
+    while (done < size){
+        ssize_t n = read(fd, p + done, size - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw ServerError(std::string("read failed: ") + std::strerror(errno));
+        if (n == 0){
+            if (done == 0)
+                return false;
+            throw ServerError("connection closed in the middle of a message");
+        }
+        done += n;
+    }
+    return true;
+}
+
+inline void write_full(int fd, const void* buffer, size_t size){
+    const u8* p = (const u8*)buffer;
+    while (size > 0){
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw ServerError(std::string("write failed: ") + std::strerror(errno));
+        p += n;
+        size -= n;
+    }
+}
+
+/* Everything readable from fd, from its current position to the end, up to MAX_REQUEST bytes */
+inline std::vector<u8> read_fd(int fd){
+    std::vector<u8> data;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)){
+        if ((u64)st.st_size > MAX_REQUEST)
+            throw ServerError("request too large");
+        data.reserve(st.st_size);
+    }
+    u8 chunk[1 << 16];
+    while (true){
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw ServerError(std::string("cannot read the passed file: ") + std::strerror(errno));
+        if (n == 0)
+            return data;
+        if (data.size() + n > MAX_REQUEST)
+            throw ServerError("request too large");
+        data.insert(data.end(), chunk, chunk + n);
+    }
+}
+
+/* Send a request header, with passed_fd attached if it is not -1 */
+inline void send_header(int sock, Request const& request, int passed_fd = -1){
+    u8 header[HEADER_SIZE] = {request.op, (u8)request.format, request.flags};
+    put_u64(header + 8, request.length);
+    iovec iov {header, sizeof(header)};
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    if (passed_fd >= 0){
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(c), &passed_fd, sizeof(int));
+    }
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        throw ServerError(std::string("send failed: ") + std::strerror(errno));
+    if ((size_t)n < sizeof(header))
+        write_full(sock, header + n, sizeof(header) - n);
+}
+
+/* Receive a request header along with any file descriptor passed with it
+   (-1 if none). Returns false when the client has hung up. */
+inline bool receive_header(int sock, Request& request, int& passed_fd){
+    u8 header[HEADER_SIZE];
+    iovec iov {header, sizeof(header)};
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    passed_fd = -1;
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        throw ServerError(std::string("receive failed: ") + std::strerror(errno));
+    if (n == 0)
+        return false;
+    for(cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)){
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+            std::memcpy(&passed_fd, CMSG_DATA(c), sizeof(int));
+    }
+    if ((size_t)n < sizeof(header))
+        read_full(sock, header + n, sizeof(header) - n);
+    request.op = header[0];
+    request.format = (deflate::Format)header[1];
+    request.flags = header[2];
+    request.length = get_u64(header + 8);
+    return true;
+}
+
+/* Send the response header and body, with a single system call if the socket takes them */
+inline void send_response(int sock, u8 status, const u8* data, size_t size){
+    u8 header[HEADER_SIZE] = {status};
+    put_u64(header + 8, size);
+    iovec iov[2] = {{header, sizeof(header)}, {(void*)data, size}};
+    msghdr msg {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        throw ServerError(std::string("write failed: ") + std::strerror(errno));
+    size_t sent = n;
+    if (sent < sizeof(header)){
+        write_full(sock, header + sent, sizeof(header) - sent);
+        sent = sizeof(header);
+    }
+    write_full(sock, data + (sent - sizeof(header)), size - (sent - sizeof(header)));
+}
+
+/* Open a connection to the server at path */
+inline int connect_to(std::string const& path){
+    sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+        throw ServerError("socket path too long");
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        throw ServerError(std::string("socket failed: ") + std::strerror(errno));
+    if (connect(sock, (sockaddr*)&addr, sizeof(addr)) < 0){
+        int e = errno;
+        close(sock);
+        throw ServerError("cannot connect to " + path + ": " + std::strerror(e));
+    }
+    return sock;
+}
+
+/* Client side of one request: send data (or passed_fd, if it is not -1)
+   and return the server's output */
+inline std::vector<u8> call(int sock, u8 op, deflate::Format format, const u8* data, size_t size, int passed_fd = -1){
+    Request request {op, format, (u8)(passed_fd >= 0 ? FLAG_FD : 0), passed_fd >= 0 ? 0 : (u64)size};
+    send_header(sock, request, passed_fd);
+    if (passed_fd < 0)
+        write_full(sock, data, size);
+    u8 header[HEADER_SIZE];
+    if (!read_full(sock, header, sizeof(header)))
+        throw ServerError("server closed the connection");
+    std::vector<u8> body(get_u64(header + 8));
+    read_full(sock, body.data(), body.size());
+    if (header[0] != STATUS_OK)
+        throw ServerError(std::string(body.begin(), body.end()));
+    return body;
+}
+
+/* The per-thread state of the server: a compressor and buffers kept warm between requests */
+class Worker {
+public:
+    /* Serve requests on sock until the client hangs up */
+    void serve(int sock){
+        while (true){
+            Request request;
+            int passed_fd = -1;
+            if (!receive_header(sock, request, passed_fd))
+                return;
+            //A request whose data cannot be read leaves the connection out of step, so it ends it
+            bool in_step = false;
+            std::string error;
+            try {
+                if (request.flags & FLAG_FD){
+                    if (passed_fd < 0)
+                        throw ServerError("no file descriptor was passed");
+                    in_step = true;
+                    input = read_fd(passed_fd);
+                } else {
+                    if (request.length > MAX_REQUEST)
+                        throw ServerError("request too large");
+                    input.resize(request.length);
+                    read_full(sock, input.data(), input.size());
+                    in_step = true;
+                }
+                handle(request);
+            } catch (std::exception const& e){
+                //Including running out of memory, which fails this request rather than the server
+                error = e.what();
+            }
+            if (passed_fd >= 0)
+                close(passed_fd);
+            if (error.empty())
+                send_response(sock, STATUS_OK, output.data(), output.size());
+            else
+                send_response(sock, STATUS_ERROR, (const u8*)error.data(), error.size());
+            if (!in_step)
+                return;
+        }
+    }
+
+private:
+    void handle(Request const& request){
+        if ((u8)request.format > (u8)deflate::Format::Raw)
+            throw ServerError("unknown format");
+        output.clear();
+        if (request.op == OP_COMPRESS){
+            if (input.size() <= small_deflate::MAX_INPUT){
+                output.resize(small_deflate::bound(input.size()));
+                output.resize(small_deflate::compress(input.data(), input.size(), output.data(), output.size(), request.format));
+                return;
+            }
+            compressor.set_format(request.format);
+            compressor.reset();
+            compressor.compress(input.data(), input.size());
+            compressor.finish();
+            output.swap(compressor.output_bytes());
+        } else if (request.op == OP_DECOMPRESS){
+            auto sink = [&](const u8* bytes, size_t n){
+                if (output.size() + n > MAX_REQUEST)
+                    throw ServerError("decompressed output too large");
+                output.insert(output.end(), bytes, bytes + n);
+            };
+            if (request.format == deflate::Format::Gzip)
+                inflate::gunzip(input.data(), input.size(), sink);
+            else if (request.format == deflate::Format::Zlib)
+                inflate::unzlib(input.data(), input.size(), sink);
+            else
+                inflate::inflate_raw(input.data(), input.size(), sink);
+        } else {
+            throw ServerError("unknown operation");
+        }
+    }
+
+    deflate::Compressor compressor;
+    std::vector<u8> input;
+    std::vector<u8> output;
+};
+
+/* Make reads and writes on sock fail once it has been idle for IDLE_TIMEOUT_SECONDS */
+inline void set_idle_timeout(int sock){
+    timeval t {IDLE_TIMEOUT_SECONDS, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &t, sizeof(t));
+}
+
+/* Listen on path (replacing any stale socket file) and serve with the given
+   number of threads until the listening socket fails. Throws ServerError then. */
+inline void serve(std::string const& path, unsigned threads){
+    sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+        throw ServerError("socket path too long");
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0)
+        throw ServerError(std::string("socket failed: ") + std::strerror(errno));
+    unlink(path.c_str());
+    if (bind(listener, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 128) < 0){
+        int e = errno;
+        close(listener);
+        throw ServerError("cannot listen on " + path + ": " + std::strerror(e));
+    }
+
+    //Every worker accepts on the shared listening socket, and owns the connection until it closes
+    std::vector<std::thread> pool;
+    for(unsigned t = 0; t < std::max(threads, 1u); t++){
+        pool.emplace_back([listener]{
+            Worker worker;
+            bool failing = false;
+            while (true){
+                int sock = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+                if (sock < 0){
+                    int e = errno;
+                    if (e == EINTR || e == ECONNABORTED)
+                        continue;
+                    if (e == EBADF || e == EINVAL || e == ENOTSOCK){
+                        std::fprintf(stderr, "gzcomp: accept failed: %s\n", std::strerror(e));
+                        return;
+                    }
+                    //Out of file descriptors or memory, which may pass: report it once and keep trying
+                    if (!failing)
+                        std::fprintf(stderr, "gzcomp: accept failed: %s, retrying\n", std::strerror(e));
+                    failing = true;
+                    std::this_thread::sleep_for(ACCEPT_BACKOFF);
+                    continue;
+                }
+                failing = false;
+                set_idle_timeout(sock);
+                try {
+                    worker.serve(sock);
+                } catch (std::exception const&){
+                    //The client went away mid-request (or the response could not be made); drop the connection
+                }
+                close(sock);
+            }
+        });
+    }
+    for(auto& t: pool)
+        t.join();
+    close(listener);
+    throw ServerError("stopped accepting connections on " + path);
+}
+
+}
+
+#endif
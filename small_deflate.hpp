@@ -0,0 +1,270 @@
+/* small_deflate.hpp
+
+   A fast path for compressing one small message (up to 16 KiB) in a single
+   call, for workloads of many short payloads where the fixed costs of
+   deflate::Compressor (its exhaustive match search and per-block Huffman
+   code construction) outweigh the actual compression.
+
+   Everything here works on the caller's buffers and the stack: the match
+   finder is a hash table of 16 bit positions sized to the input (at most 4
+   KiB of it needs clearing), chained through a second array for a short
+   search, and the output is one block of fixed Huffman codes whose bit
+   patterns, lengths and extra bits all come from tables generated at
+   compile time. No heap memory is allocated. If the input turns out not to
+   compress, a stored block is written instead.
+*/
+
+#ifndef SMALL_DEFLATE_HPP
+#define SMALL_DEFLATE_HPP
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include "deflate.hpp"
+#include "deflate_tables.hpp"
+#include "crc32.hpp"
+#include "cpu_dispatch.hpp"
+#include "adler32.hpp"
+
+namespace small_deflate {
+
+using u8 = std::uint8_t;
+using u16 = std::uint16_t;
+using u32 = std::uint32_t;
+using u64 = std::uint64_t;
+
+/* The largest input compress() accepts */
+const size_t MAX_INPUT = 16384;
+
+const u32 MAX_HASH_BITS = 12;
+const u32 MAX_CHAIN = 8;
+
+/* Output space compress() needs for size bytes of input: fixed Huffman
+   codes take at most 9 bits per byte, plus the block header and the largest wrapper */
+constexpr size_t bound(size_t size){
+    return size + size / 8 + 32;
+}
+
+/* A code ready to push: the bits (first bit in the LSB) and how many there are */
+struct Code {
+    u32 bits;
+    u32 length;
+};
+
+constexpr u32 reverse_bits(u32 code, u32 length){
+    u32 r = 0;
+    for(u32 i = 0; i < length; i++)
+        r |= ((code >> i) & 1) << (length - 1 - i);
+    return r;
+}
+
+/* The fixed literal/length code (RFC 1951, section 3.2.6) */
+constexpr Code fixed_litlen(u32 symbol){
+    if (symbol < 144)
+        return {reverse_bits(0x30 + symbol, 8), 8};
+    if (symbol < 256)
+        return {reverse_bits(0x190 + symbol - 144, 9), 9};
+    if (symbol < 280)
+        return {reverse_bits(symbol - 256, 7), 7};
+    return {reverse_bits(0xc0 + symbol - 280, 8), 8};
+}
+
+constexpr std::array<Code, 256> make_literal_codes(){
+    std::array<Code, 256> t {};
+    for(u32 i = 0; i < 256; i++)
+        t[i] = fixed_litlen(i);
+    return t;
+}
+
+/* Indexed by (length - 3): the length symbol's code followed by its extra bits */
+constexpr std::array<Code, deflate_tables::MAX_MATCH - deflate_tables::MIN_MATCH + 1> make_length_codes(){
+    using namespace deflate_tables;
+    std::array<Code, MAX_MATCH - MIN_MATCH + 1> t {};
+    for(u32 length = MIN_MATCH; length <= MAX_MATCH; length++){
+        u16 entry = length_entry(length);
+        u32 code = entry_code(entry);
+        Code c = fixed_litlen(FIRST_LENGTH_SYMBOL + code);
+        c.bits |= (length - length_base[code]) << c.length;
+        c.length += entry_extra_bits(entry);
+        t[length - MIN_MATCH] = c;
+    }
+    return t;
+}
+
+/* Indexed by distance code: the 5 bit code, before the extra bits */
+constexpr std::array<Code, deflate_tables::NUM_DIST_CODES> make_distance_codes(){
+    std::array<Code, deflate_tables::NUM_DIST_CODES> t {};
+    for(u32 code = 0; code < deflate_tables::NUM_DIST_CODES; code++)
+        t[code] = {reverse_bits(code, 5), 5};
+    return t;
+}
+
+constexpr auto literal_codes = make_literal_codes();
+constexpr auto length_codes = make_length_codes();
+constexpr auto distance_codes = make_distance_codes();
+constexpr Code end_of_block = fixed_litlen(256);
+
+/* LSB-first bit writer straight into the output buffer */
+class BitWriter {
+public:
+    explicit BitWriter(u8* out): out{out} {}
+
+    void put(u32 bits, u32 length){
+        bitbuf |= (u64)bits << bitcount;
+        bitcount += length;
+        if (bitcount >= 32){
+            u32 word = (u32)bitbuf;
+            std::memcpy(out, &word, 4); //(assumes a little endian host)
+            out += 4;
+            bitbuf >>= 32;
+            bitcount -= 32;
+        }
+    }
+
+    /* Write out the remaining bits, padded to a whole byte */
+    u8* finish(){
+        while (bitcount > 0){
+            *out++ = (u8)bitbuf;
+            bitbuf >>= 8;
+            bitcount = bitcount > 8 ? bitcount - 8 : 0;
+        }
+        return out;
+    }
+
+private:
+    u8* out;
+    u64 bitbuf {0};
+    u32 bitcount {0};
+};
+
+inline u32 hash3(const u8* p, u32 bits){
+    u32 v = (u32)p[0] << 16 | (u32)p[1] << 8 | p[2];
+    return (v * 2654435761u) >> (32 - bits);
+}
+
+/* Length of the common prefix of a and b, up to limit bytes */
+inline u32 match_length(const u8* a, const u8* b, u32 limit){
+    u32 n = 0;
+    while (n + 8 <= limit){
+        u64 x, y;
+        std::memcpy(&x, a + n, 8);
+        std::memcpy(&y, b + n, 8);
+        if (x != y)
+            return n + (__builtin_ctzll(x ^ y) >> 3);
+        n += 8;
+    }
+    while (n < limit && a[n] == b[n])
+        n++;
+    return n;
+}
+
+/* Encode data as one final fixed Huffman block starting at out. Returns the end of the block. */
+inline u8* fixed_block(const u8* data, size_t size, u8* out){
+    u32 hash_bits = 8;
+    while (hash_bits < MAX_HASH_BITS && (1u << hash_bits) < size)
+        hash_bits++;
+    u16 head[1 << MAX_HASH_BITS];
+    u16 prev[MAX_INPUT];
+    std::memset(head, 0, sizeof(u16) << hash_bits);
+
+    BitWriter writer {out};
+    writer.put(1 | (1 << 1), 3); //BFINAL, block type 1
+    auto insert = [&](size_t pos){
+        u32 h = hash3(data + pos, hash_bits);
+        prev[pos] = head[h];
+        head[h] = pos + 1; //0 means empty
+    };
+
+    size_t i = 0;
+    while (i < size){
+        u32 best_length = 0;
+        u32 best_distance = 0;
+        if (i + deflate_tables::MIN_MATCH <= size){
+            u32 h = hash3(data + i, hash_bits);
+            u32 candidate = head[h];
+            u32 limit = std::min<size_t>(deflate_tables::MAX_MATCH, size - i);
+            for(u32 chain = 0; candidate != 0 && chain < MAX_CHAIN; chain++){
+                u32 pos = candidate - 1;
+                candidate = prev[pos];
+                //Only a match which also agrees one byte past the best so far can beat it
+                if (data[pos + best_length] != data[i + best_length])
+                    continue;
+                u32 length = match_length(data + pos, data + i, limit);
+                if (length > best_length){
+                    best_length = length;
+                    best_distance = i - pos;
+                    if (length == limit)
+                        break;
+                }
+            }
+            insert(i);
+        }
+        if (best_length >= deflate_tables::MIN_MATCH){
+            Code length = length_codes[best_length - deflate_tables::MIN_MATCH];
+            writer.put(length.bits, length.length);
+            u16 entry = deflate_tables::dist_entry(best_distance);
+            u32 code = deflate_tables::entry_code(entry);
+            Code distance = distance_codes[code];
+            writer.put(distance.bits | ((best_distance - deflate_tables::dist_base[code]) << distance.length),
+                distance.length + deflate_tables::entry_extra_bits(entry));
+            for(size_t j = i + 1; j < i + best_length && j + deflate_tables::MIN_MATCH <= size; j++)
+                insert(j);
+            i += best_length;
+        } else {
+            Code literal = literal_codes[data[i]];
+            writer.put(literal.bits, literal.length);
+            i++;
+        }
+    }
+    writer.put(end_of_block.bits, end_of_block.length);
+    return writer.finish();
+}
+
+/* Compress data[0..size) as one complete stream in the given format into
+   out[0..capacity). Returns the number of bytes written, or 0 if size is
+   over MAX_INPUT or capacity is under bound(size). */
+inline size_t compress(const u8* data, size_t size, u8* out, size_t capacity, deflate::Format format = deflate::Format::Gzip){
+    if (size > MAX_INPUT || capacity < bound(size))
+        return 0;
+    u8* p = out;
+    if (format == deflate::Format::Gzip){
+        const u8 header[10] = {0x1f, 0x8b, 0x08, 0, 0, 0, 0, 0, 0, 0x03};
+        std::memcpy(p, header, sizeof(header));
+        p += sizeof(header);
+    } else if (format == deflate::Format::Zlib){
+        *p++ = 0x78;
+        *p++ = 0x9c;
+    }
+
+    //If the fixed Huffman block comes out no smaller than the input, store it instead
+    u8* block_end = fixed_block(data, size, p);
+    if ((size_t)(block_end - p) < size + 5){
+        p = block_end;
+    } else {
+        *p++ = 1; //BFINAL, stored
+        *p++ = size & 0xff;
+        *p++ = size >> 8;
+        *p++ = ~size & 0xff;
+        *p++ = (~size >> 8) & 0xff;
+        std::memcpy(p, data, size);
+        p += size;
+    }
+
+    auto push_le32 = [&](u32 v){
+        for(int i = 0; i < 4; i++)
+            *p++ = v >> (8 * i);
+    };
+    if (format == deflate::Format::Gzip){
+        push_le32(cpu::kernels().crc32(0, data, size));
+        push_le32(size);
+    } else if (format == deflate::Format::Zlib){
+        u32 adler = adler32::update(adler32::INITIAL, data, size);
+        for(int i = 3; i >= 0; i--)
+            *p++ = adler >> (8 * i);
+    }
+    return p - out;
+}
+
+}
+
+#endif
@@ -0,0 +1,298 @@
+/* speculative_inflate.hpp
+
+   Multi-threaded decompression of a single gzip member with no index, in the
+   style of pugz and rapidgzip.
+
+   The compressed data is cut into chunks of a few MiB. For each chunk after
+   the first, a worker guesses where the first block inside it starts by
+   trying every bit offset which could hold a dynamic Huffman block header,
+   and decodes from there up to the first block boundary in the next chunk.
+   The history before the guessed start is unknown, so the worker decodes
+   into 16 bit symbols with its window filled with markers: a back-reference
+   into the unknown history copies marker MARKER_BASE + i (byte i of the 32
+   KiB before the start) instead of a byte.
+
+   The chunks are then chained together in order. A chunk's guess is only
+   used if it starts exactly where the previous chunk stopped; otherwise
+   (no dynamic block near the chunk start, or a false header which happened
+   to decode) the chunk is decoded again from the right place with the known
+   window, on the calling thread and straight to the sink. Once the last 32
+   KiB before a chunk is known, its markers are replaced with real bytes and
+   its CRC-32 is computed on the worker threads, and the per-chunk CRCs are
+   combined to check the trailer.
+
+   A worker gives up on a chunk whose output passes MAX_EXPANSION symbols
+   per compressed byte, so data which compresses very well (long runs of
+   zeros, say) is decoded serially rather than held in memory.
+*/
+
+#ifndef SPECULATIVE_INFLATE_HPP
+#define SPECULATIVE_INFLATE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "inflate.hpp"
+#include "parallel_inflate.hpp"
+#include "crc32.hpp"
+#include "cpu_dispatch.hpp"
+
+namespace speculative_inflate {
+
+using u8 = std::uint8_t;
+using u16 = std::uint16_t;
+using u32 = std::uint32_t;
+using u64 = std::uint64_t;
+
+using Decoder = inflate::BasicInflater<u16>;
+
+/* Compressed bytes per chunk */
+const size_t CHUNK_SIZE = 4 << 20;
+
+/* Most symbols a worker buffers per compressed byte of its chunk */
+const size_t MAX_EXPANSION = 4;
+
+/* True if data is big enough to split into chunks and not BGZF (whose
+   members parallel_inflate::gunzip() can find exactly). Counting gzip magic
+   bytes says nothing here: they turn up by chance inside compressed data
+   every hundred MB or so. If the first member ends early, gunzip() goes on
+   with parallel_inflate::gunzip() for the rest. */
+inline bool applies(const u8* data, size_t size, size_t chunk_size = CHUNK_SIZE){
+    return size >= 2 * chunk_size && parallel_inflate::bgzf_members(data, size).empty();
+}
+
+/* Cheap test of whether the bits at bit offset b could start a non-final
+   dynamic block: the block type, the symbol counts, and a complete code
+   lengths code */
+inline bool plausible_header(const u8* data, size_t size, u64 b){
+    const u64 HEADER_BITS = 17 + 19 * 3;
+    if (b / 8 + (HEADER_BITS + 7) / 8 + 1 > size)
+        return false;
+    auto peek = [&](u64 at, u32 n){
+        u64 v;
+        std::memcpy(&v, data + at / 8, 8);
+        return (u32)(v >> (at % 8)) & ((1u << n) - 1);
+    };
+    if (peek(b, 3) != 4 || peek(b + 3, 5) > 29 || peek(b + 8, 5) > 29)
+        return false;
+    u32 hclen = peek(b + 13, 4) + 4;
+    u32 kraft = 0;
+    for(u32 i = 0; i < hclen; i++){
+        u32 len = peek(b + 17 + 3 * i, 3);
+        if (len)
+            kraft += 128 >> len;
+    }
+    return kraft == 128;
+}
+
+struct Chunk {
+    u64 start_bit {UINT64_MAX};  //where decoding started, UINT64_MAX if no block start was found
+    u64 end_bit {0};             //where decoding stopped
+    bool finished {false};       //decoded the final block
+    std::vector<u16> symbols;
+    std::vector<u8> window;      //the 32 KiB before the chunk, once known
+    u32 crc {0};
+};
+
+/* Decode from start_bit to the first block boundary at or after stop_bit,
+   unless that takes more than max_symbols, in which case the chunk is left
+   with no start (start_bit UINT64_MAX) and no symbols */
+inline void decode_chunk(Decoder& decoder, Chunk& chunk, u64 start_bit, u64 stop_bit, u64 max_symbols){
+    chunk.symbols.clear();
+    chunk.start_bit = start_bit;
+    decoder.seek_bits(start_bit);
+    decoder.inflate([&](const u16* symbols, size_t n){
+        chunk.symbols.insert(chunk.symbols.end(), symbols, symbols + n);
+    }, max_symbols, stop_bit);
+    chunk.end_bit = decoder.bit_position();
+    chunk.finished = decoder.finished();
+    if (decoder.stopped()){
+        chunk.symbols = {};
+        chunk.start_bit = UINT64_MAX;
+    }
+}
+
+/* Find the first bit offset in [from, to) where a dynamic block decodes
+   cleanly up to stop_bit, and decode it with an unknown window */
+inline void guess_chunk(const u8* data, size_t size, Decoder& decoder, Chunk& chunk, u64 from, u64 to, u64 stop_bit, u64 max_symbols){
+    for(u64 b = from; b < to; b++){
+        if (!plausible_header(data, size, b))
+            continue;
+        decoder.seek_bits(b);
+        if (!decoder.dynamic_header_valid())
+            continue;
+        try {
+            decoder.prime_markers();
+            decode_chunk(decoder, chunk, b, stop_bit, max_symbols);
+            return;
+        } catch (inflate::InflateError const&){
+            //A false header, try the next offset
+        }
+    }
+    chunk.symbols.clear();
+    chunk.start_bit = UINT64_MAX;
+}
+
+/* Replace the markers in symbols[0..n) with bytes from window (the bytes
+   before the chunk, of which there may be fewer than 32 KiB at the start of
+   the stream). out may overlap symbols as long as it does not start after it. */
+inline void resolve(const u16* symbols, size_t n, u8* out, std::vector<u8> const& window){
+    const u32 missing = inflate::WINDOW_SIZE - window.size();
+    if (missing == 0){
+        //Every symbol is valid: one table lookup each
+        std::vector<u8> lookup(Decoder::MARKER_BASE + inflate::WINDOW_SIZE);
+        for(u32 i = 0; i < Decoder::MARKER_BASE; i++)
+            lookup[i] = i;
+        std::copy(window.begin(), window.end(), lookup.begin() + Decoder::MARKER_BASE);
+        for(size_t i = 0; i < n; i++)
+            out[i] = lookup[symbols[i]];
+        return;
+    }
+    for(size_t i = 0; i < n; i++){
+        u32 s = symbols[i];
+        if (s >= Decoder::MARKER_BASE){
+            s -= Decoder::MARKER_BASE;
+            if (s < missing)
+                throw inflate::InflateError("distance too far back");
+            s = window[s - missing];
+        }
+        out[i] = s;
+    }
+}
+
+/* The window after a chunk: the last 32 KiB of the window before it followed by its output */
+inline std::vector<u8> next_window(std::vector<u8> const& window, std::vector<u16> const& symbols){
+    size_t n = symbols.size();
+    size_t take = std::min<size_t>(n, inflate::WINDOW_SIZE);
+    size_t keep = std::min<size_t>(window.size(), inflate::WINDOW_SIZE - take);
+    std::vector<u8> next(keep + take);
+    std::copy(window.end() - keep, window.end(), next.begin());
+    resolve(symbols.data() + n - take, take, next.data() + keep, window);
+    return next;
+}
+
+/* Decompress the gzip member at the start of data[0..size) with the given
+   number of threads, followed by any further members. Returns the total
+   number of bytes passed to sink. */
+inline u64 gunzip(const u8* data, size_t size, unsigned threads, inflate::Sink const& sink, size_t chunk_size = CHUNK_SIZE){
+    threads = std::max(threads, 1u);
+    const u64 first_bit = inflate::parse_gzip_header(data, size, 0) * 8;
+    const u64 chunk_bits = (u64)chunk_size * 8;
+    const size_t count = (size * 8 - first_bit + chunk_bits - 1) / chunk_bits;
+    auto chunk_start = [&](size_t i){
+        return first_bit + i * chunk_bits;
+    };
+    auto chunk_stop = [&](size_t i){
+        return i + 1 < count ? chunk_start(i + 1) : UINT64_MAX;
+    };
+    const u64 max_symbols = (u64)MAX_EXPANSION * chunk_size;
+
+    //Speculative decoding, run ahead on the worker threads, until the member turns out to have ended
+    std::atomic<bool> ended {false};
+    auto make_state = [&]{
+        return std::make_unique<Decoder>(data, size);
+    };
+    auto guess = [&](size_t i, std::unique_ptr<Decoder>& decoder){
+        auto chunk = std::make_unique<Chunk>();
+        if (ended)
+            return chunk;
+        if (i == 0){
+            decoder->set_window(nullptr, 0);
+            decode_chunk(*decoder, *chunk, first_bit, chunk_stop(0), max_symbols);
+        } else {
+            guess_chunk(data, size, *decoder, *chunk, chunk_start(i), chunk_stop(i) == UINT64_MAX ? size * 8 : chunk_stop(i), chunk_stop(i), max_symbols);
+        }
+        return chunk;
+    };
+
+    //Marker replacement and checksums for a batch of chained chunks
+    std::vector<std::unique_ptr<Chunk>> batch;
+    u32 crc = 0;
+    u64 total = 0;
+    auto write_batch = [&]{
+        auto resolve_chunk = [&](size_t i, int&){
+            Chunk& c = *batch[i];
+            u8* bytes = (u8*)c.symbols.data();
+            resolve(c.symbols.data(), c.symbols.size(), bytes, c.window);
+            c.crc = cpu::kernels().crc32(0, bytes, c.symbols.size());
+            return 0;
+        };
+        auto write = [&](size_t i, int){
+            Chunk& c = *batch[i];
+            sink((const u8*)c.symbols.data(), c.symbols.size());
+            crc = crc32::combine(crc, c.crc, c.symbols.size());
+            total += c.symbols.size();
+            c.symbols = {};
+        };
+        parallel_inflate::ordered_parallel<int>(batch.size(), threads, batch.size(), []{ return 0; }, resolve_chunk, write);
+        batch.clear();
+    };
+
+    //Chain the chunks in order, decoding again wherever a guess was wrong
+    Decoder decoder {data, size};
+    std::vector<u8> window;
+    u64 next_bit = first_bit;
+    bool finished = false;
+    std::vector<u8> bytes;
+    auto decode_serially = [&](size_t i){
+        decoder.set_window(window.data(), window.size());
+        decoder.seek_bits(next_bit);
+        auto crc32_update = cpu::kernels().crc32;
+        decoder.inflate([&](const u16* symbols, size_t n){
+            //With the window known, every symbol is a byte
+            bytes.assign(symbols, symbols + n);
+            sink(bytes.data(), n);
+            crc = crc32_update(crc, bytes.data(), n);
+            total += n;
+            window.insert(window.end(), bytes.begin(), bytes.end());
+            if (window.size() > 2 * inflate::WINDOW_SIZE)
+                window.erase(window.begin(), window.end() - inflate::WINDOW_SIZE);
+        }, UINT64_MAX, chunk_stop(i));
+        if (window.size() > inflate::WINDOW_SIZE)
+            window.erase(window.begin(), window.end() - inflate::WINDOW_SIZE);
+        next_bit = decoder.bit_position();
+        finished = decoder.finished();
+        ended = finished;
+    };
+    auto chain = [&](size_t i, std::unique_ptr<Chunk>& chunk){
+        if (finished)
+            return;
+        if (chunk->start_bit != next_bit){
+            //Whatever comes before goes to the sink first
+            write_batch();
+            decode_serially(i);
+            return;
+        }
+        chunk->window = window;
+        window = next_window(window, chunk->symbols);
+        next_bit = chunk->end_bit;
+        finished = chunk->finished;
+        ended = finished;
+        batch.push_back(std::move(chunk));
+        if (batch.size() >= threads || finished)
+            write_batch();
+    };
+    parallel_inflate::ordered_parallel<std::unique_ptr<Chunk>>(count, threads, 2 * threads, make_state, guess, chain);
+    if (!finished)
+        throw inflate::InflateError("unexpected end of input");
+
+    size_t pos = (next_bit + 7) / 8;
+    if (size - pos < 8)
+        throw inflate::InflateError("truncated gzip trailer");
+    if (inflate::read_le32(data + pos) != crc)
+        throw inflate::InflateError("CRC-32 mismatch");
+    if (inflate::read_le32(data + pos + 4) != (u32)total)
+        throw inflate::InflateError("length mismatch");
+    pos += 8;
+    if (pos == size)
+        return total;
+    if (!inflate::at_gzip_magic(data, size, pos))
+        throw inflate::InflateError("trailing garbage after gzip data");
+    return total + parallel_inflate::gunzip(data + pos, size - pos, threads, sink);
+}
+
+}
+
+#endif
@@ -0,0 +1,127 @@
+/* spsc_queue.hpp
+
+   A bounded ring queue between exactly one producer thread and one
+   consumer thread, for passing buffers between the stages of a pipeline.
+   try_push() and try_pop() never block or lock: each side owns one index,
+   and publishes it with a release store which the other side reads with
+   an acquire load. The indices sit on separate cache lines so the two
+   threads do not contend for one.
+
+   push() and pop() wait for room or for an item. They spin briefly (a
+   stage which is only a little behind catches up without a system call),
+   then sleep on a futex until the other side makes progress, so an idle
+   stage costs no CPU time. The other side only makes the wake-up call
+   when someone is asleep.
+*/
+
+#ifndef SPSC_QUEUE_HPP
+#define SPSC_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace spsc_queue {
+
+using u32 = std::uint32_t;
+
+/* Tell the CPU this is a spin-wait loop (only x86 has a hint for it here) */
+inline void spin_pause(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/* A counter one thread can sleep on until another thread bumps it */
+class Signal {
+public:
+    u32 value() const {
+        return count.load(std::memory_order_acquire);
+    }
+
+    /* Sleep unless the count has moved on from seen */
+    void wait(u32 seen){
+        sleepers.fetch_add(1, std::memory_order_seq_cst);
+        syscall(SYS_futex, &count, FUTEX_WAIT_PRIVATE, seen, nullptr, nullptr, 0);
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void notify(){
+        count.fetch_add(1, std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_seq_cst) != 0)
+            syscall(SYS_futex, &count, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+private:
+    std::atomic<u32> count {0};
+    std::atomic<u32> sleepers {0};
+};
+
+/* Holds up to CAPACITY (a power of two) items of the trivially copyable type T */
+template<typename T, size_t CAPACITY>
+class Queue {
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "capacity must be a power of two");
+public:
+    bool try_push(T const& item){
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == CAPACITY)
+            return false;
+        slots[t & (CAPACITY - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        pushed.notify();
+        return true;
+    }
+
+    bool try_pop(T& item){
+        size_t h = head.load(std::memory_order_relaxed);
+        if (tail.load(std::memory_order_acquire) == h)
+            return false;
+        item = slots[h & (CAPACITY - 1)];
+        head.store(h + 1, std::memory_order_release);
+        popped.notify();
+        return true;
+    }
+
+    void push(T const& item){
+        wait_for(popped, [&]{ return try_push(item); });
+    }
+
+    T pop(){
+        T item;
+        wait_for(pushed, [&]{ return try_pop(item); });
+        return item;
+    }
+
+private:
+    static const int SPINS = 64;
+
+    template<typename Try>
+    static void wait_for(Signal& progress, Try const& attempt){
+        for(int i = 0; i < SPINS; i++){
+            if (attempt())
+                return;
+            spin_pause();
+        }
+        while (true){
+            //Any progress after this read makes wait() return at once, so no wake-up is lost
+            u32 seen = progress.value();
+            if (attempt())
+                return;
+            progress.wait(seen);
+        }
+    }
+
+    alignas(64) std::atomic<size_t> head {0};   //next slot to pop, written by the consumer
+    alignas(64) std::atomic<size_t> tail {0};   //next slot to push, written by the producer
+    alignas(64) Signal pushed;
+    alignas(64) Signal popped;
+    T slots[CAPACITY];
+};
+
+}
+
+#endif
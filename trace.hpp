@@ -0,0 +1,159 @@
+/* trace.hpp
+
+   A timeline of what each thread spent its time on, for finding stalls and
+   load imbalance (gzcomp --trace FILE). Code marks a stretch of work with
+   a Scope:
+
+       trace::Scope scope {"compress", size};
+
+   which records one event, from the Scope's construction to its
+   destruction, with a name and an optional byte count. write() puts out
+   every thread's events in the Chrome trace-event format, which
+   chrome://tracing and ui.perfetto.dev display as one track per thread.
+
+   Each thread records into a ring buffer of its own (set up the first time
+   it records anything), so recording takes no locks. When a thread records
+   more than EVENTS_PER_THREAD events, the oldest are overwritten, and the
+   number lost goes into the file. Until start() is called, a Scope does
+   nothing beyond testing one flag.
+*/
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace trace {
+
+using u64 = std::uint64_t;
+using Clock = std::chrono::steady_clock;
+
+const size_t EVENTS_PER_THREAD = 1 << 15;
+
+struct Event {
+    const char* name;   //a string literal
+    u64 begin_ns;       //since start()
+    u64 end_ns;
+    u64 bytes;          //0 if there is no byte count
+};
+
+struct ThreadLog {
+    size_t tid;
+    std::string name;
+    std::unique_ptr<Event[]> events {new Event[EVENTS_PER_THREAD]};
+    u64 recorded {0};
+};
+
+/* Every thread's log, kept after the thread exits so write() can still see it */
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadLog>> threads;
+    Clock::time_point origin;
+};
+
+inline std::atomic<bool> enabled {false};
+
+inline Registry& registry(){
+    static Registry r;
+    return r;
+}
+
+inline u64 now_ns(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - registry().origin).count();
+}
+
+inline ThreadLog& this_thread(){
+    thread_local ThreadLog* log = nullptr;
+    if (!log){
+        auto& r = registry();
+        std::lock_guard<std::mutex> lock {r.mutex};
+        size_t tid = r.threads.size() + 1;
+        r.threads.push_back(std::make_unique<ThreadLog>(ThreadLog{tid, "thread " + std::to_string(tid)}));
+        log = r.threads.back().get();
+    }
+    return *log;
+}
+
+/* Start recording, with times counted from now. The calling thread is named "main". */
+inline void start(){
+    registry().origin = Clock::now();
+    enabled.store(true, std::memory_order_relaxed);
+    this_thread().name = "main";
+}
+
+/* Name the calling thread's track (when recording) */
+inline void name_thread(std::string const& name){
+    if (enabled.load(std::memory_order_relaxed))
+        this_thread().name = name;
+}
+
+inline void record(const char* name, u64 begin_ns, u64 end_ns, u64 bytes){
+    ThreadLog& log = this_thread();
+    log.events[log.recorded++ % EVENTS_PER_THREAD] = Event{name, begin_ns, end_ns, bytes};
+}
+
+class Scope {
+public:
+    explicit Scope(const char* name, u64 bytes = 0): name{name}, bytes{bytes},
+        active{enabled.load(std::memory_order_relaxed)}, begin_ns{active ? now_ns() : 0} {}
+
+    ~Scope(){
+        if (active)
+            record(name, begin_ns, now_ns(), bytes);
+    }
+
+    /* For work whose size is only known once it is done, such as a read */
+    void set_bytes(u64 n){
+        bytes = n;
+    }
+
+    Scope(Scope const&) = delete;
+    Scope& operator=(Scope const&) = delete;
+
+private:
+    const char* name;
+    u64 bytes;
+    bool active;
+    u64 begin_ns;
+};
+
+/* Write every thread's events as a Chrome trace-event JSON object. The
+   threads must have stopped recording. */
+inline void write(std::ostream& out){
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock {r.mutex};
+    auto us = [](u64 ns){
+        return std::to_string(ns / 1000) + "." + std::to_string(ns % 1000 + 1000).substr(1);
+    };
+    u64 dropped = 0;
+    bool first = true;
+    out << "{\"traceEvents\": [";
+    for(auto const& t: r.threads){
+        out << (first ? "" : ",") << "\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << t->tid
+            << ", \"args\": {\"name\": \"" << t->name << "\"}}";
+        first = false;
+        u64 kept = std::min<u64>(t->recorded, EVENTS_PER_THREAD);
+        dropped += t->recorded - kept;
+        for(u64 i = t->recorded - kept; i < t->recorded; i++){
+            Event const& e = t->events[i % EVENTS_PER_THREAD];
+            out << ",\n  {\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << t->tid
+                << ", \"ts\": " << us(e.begin_ns) << ", \"dur\": " << us(e.end_ns - e.begin_ns);
+            if (e.bytes)
+                out << ", \"args\": {\"bytes\": " << e.bytes << "}";
+            out << "}";
+        }
+    }
+    out << "\n], \"displayTimeUnit\": \"ns\", \"otherData\": {\"dropped_events\": " << dropped << "}}\n";
+}
+
+}
+
+#endif
@@ -0,0 +1,182 @@
+/* uring.hpp
+
+   A minimal io_uring (Linux 5.6 and later) made directly from the system
+   calls, without liburing. A Ring maps the kernel's submission and
+   completion queues; the caller fills in submission entries from
+   next_sqe(), hands the whole batch to the kernel with one submit(), and
+   collects completions with pop_completion() or wait_completion().
+
+   register_buffers() pins a set of buffers in the kernel once, so reads
+   into them (IORING_OP_READ_FIXED) skip mapping the pages on every call.
+
+   Only one thread may use a Ring at a time. The constructor throws
+   std::system_error if the kernel has no io_uring (or it is blocked, as
+   seccomp profiles often do), which callers take as the cue to fall back
+   to plain read() and write().
+*/
+
+#ifndef URING_HPP
+#define URING_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <system_error>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace uring {
+
+using u32 = std::uint32_t;
+
+class Ring {
+public:
+    explicit Ring(unsigned entries){
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        fd = syscall(SYS_io_uring_setup, entries, &params);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), "io_uring_setup");
+        try {
+            map_rings(params);
+        } catch (...) {
+            release();
+            throw;
+        }
+    }
+
+    ~Ring(){
+        release();
+    }
+
+    Ring(Ring const&) = delete;
+    Ring& operator=(Ring const&) = delete;
+
+    /* Pin count buffers for fixed reads and writes, referred to by their
+       index. Returns false if the kernel refuses (e.g. RLIMIT_MEMLOCK). */
+    bool register_buffers(const iovec* buffers, unsigned count){
+        return syscall(SYS_io_uring_register, fd, IORING_REGISTER_BUFFERS, buffers, count) == 0;
+    }
+
+    /* A cleared submission entry to fill in, or null if the queue is full.
+       Nothing reaches the kernel until submit(). */
+    io_uring_sqe* next_sqe(){
+        if (tail - sq_head->load(std::memory_order_acquire) >= sq_entries)
+            return nullptr;
+        u32 slot = tail & sq_mask;
+        io_uring_sqe* sqe = &sqes[slot];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_array[slot] = slot;
+        tail++;
+        return sqe;
+    }
+
+    /* Pass every entry filled in since the last call to the kernel, and wait
+       until at least wait_for completions are ready */
+    void submit(unsigned wait_for = 0){
+        sq_tail->store(tail, std::memory_order_release);
+        while (true){
+            unsigned pending = tail - submitted;
+            int done = syscall(SYS_io_uring_enter, fd, pending, wait_for, wait_for ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (done >= 0){
+                submitted += done;
+                if (submitted == tail)
+                    return;
+                wait_for = 0;
+            } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY){
+                throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+            }
+        }
+    }
+
+    bool pop_completion(io_uring_cqe& cqe){
+        u32 head = cq_head->load(std::memory_order_relaxed);
+        if (head == cq_tail->load(std::memory_order_acquire))
+            return false;
+        cqe = cqes[head & cq_mask];
+        cq_head->store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    io_uring_cqe wait_completion(){
+        io_uring_cqe cqe;
+        while (!pop_completion(cqe))
+            submit(1);
+        return cqe;
+    }
+
+private:
+    /* Map the submission queue, the completion queue (the same mapping on
+       newer kernels) and the submission entries */
+    void map_rings(io_uring_params const& params){
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+            sq_size = cq_size = std::max(sq_size, cq_size);
+        sq_ring = map(sq_size, IORING_OFF_SQ_RING);
+        cq_ring = single_mmap ? sq_ring : map(cq_size, IORING_OFF_CQ_RING);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)map(sqes_size, IORING_OFF_SQES);
+
+        sq_head = (std::atomic<u32>*)(sq_ring + params.sq_off.head);
+        sq_tail = (std::atomic<u32>*)(sq_ring + params.sq_off.tail);
+        sq_mask = *(u32*)(sq_ring + params.sq_off.ring_mask);
+        sq_array = (u32*)(sq_ring + params.sq_off.array);
+        sq_entries = params.sq_entries;
+        cq_head = (std::atomic<u32>*)(cq_ring + params.cq_off.head);
+        cq_tail = (std::atomic<u32>*)(cq_ring + params.cq_off.tail);
+        cq_mask = *(u32*)(cq_ring + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq_ring + params.cq_off.cqes);
+        tail = sq_tail->load(std::memory_order_relaxed);
+        submitted = tail;
+    }
+
+    unsigned char* map(size_t size, off_t offset){
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+        if (p == MAP_FAILED)
+            throw std::system_error(errno, std::generic_category(), "io_uring mmap");
+        return (unsigned char*)p;
+    }
+
+    void release(){
+        if (sqes)
+            munmap(sqes, sqes_size);
+        if (cq_ring && cq_ring != sq_ring)
+            munmap(cq_ring, cq_size);
+        if (sq_ring)
+            munmap(sq_ring, sq_size);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    int fd {-1};
+    unsigned char* sq_ring {nullptr};
+    unsigned char* cq_ring {nullptr};
+    io_uring_sqe* sqes {nullptr};
+    size_t sq_size {0};
+    size_t cq_size {0};
+    size_t sqes_size {0};
+
+    std::atomic<u32>* sq_head;
+    std::atomic<u32>* sq_tail;
+    u32 sq_mask;
+    u32* sq_array;
+    u32 sq_entries;
+    std::atomic<u32>* cq_head;
+    std::atomic<u32>* cq_tail;
+    u32 cq_mask;
+    io_uring_cqe* cqes;
+
+    u32 tail {0};       //entries filled in (ours until stored to sq_tail)
+    u32 submitted {0};  //entries the kernel has consumed
+};
+
+}
+
+#endif
@@ -17,8 +17,12 @@ do
     ./gzcomp < $filename > validate_temp.bin
     gzip -d < validate_temp.bin > validate_output_temp.txt
     diff -qs $filename validate_output_temp.txt > /dev/null
+    GZIP_RESULT=$?
+    #Also check that our own decompressor agrees
+    ./gzcomp -d < validate_temp.bin | cmp -s $filename -
+    OWN_RESULT=$?
 
-    if [ "$?" -ne "0" ]
+    if [ "$GZIP_RESULT" -ne "0" ] || [ "$OWN_RESULT" -ne "0" ]
     then 
         echo FAILED
         FAILED=$[ $FAILED + 1 ]
@@ -32,4 +36,45 @@ do
     rm validate_output_temp.txt validate_temp.bin
 done
 
+#Parallel decompression must not hold data which compresses very well in memory:
+#2 GiB of zeros has to decompress with -p 4 in 1 GB of address space
+echo Checking memory use of gzcomp -d -p 4 on 2 GiB of zeros
+head -c 2G /dev/zero | gzip -1 > validate_temp.bin
+(ulimit -v 1000000; ./gzcomp -d -p 4 < validate_temp.bin) | cmp -s - <(head -c 2G /dev/zero)
+if [ "$?" -ne "0" ]
+then
+    echo FAILED
+    FAILED=$[ $FAILED + 1 ]
+else
+    echo Passed
+    PASSED=$[ $PASSED + 1 ]
+fi
+rm validate_temp.bin
+
+#Each level must compress every file to no more than the level below it
+echo Checking that -1 to -9 are in order of size
+ORDERED=0
+for filename in `find ./test_data -type f`
+do
+    LASTSIZE=
+    for level in 1 2 3 4 5 6 7 8 9
+    do
+        SIZE=`./gzcomp -$level < $filename | wc -c`
+        if [ -n "$LASTSIZE" ] && [ "$SIZE" -gt "$LASTSIZE" ]
+        then
+            echo $filename: -$level gives $SIZE bytes, -$[ $level - 1 ] gave $LASTSIZE
+            ORDERED=1
+        fi
+        LASTSIZE=$SIZE
+    done
+done
+if [ "$ORDERED" -ne "0" ]
+then
+    echo FAILED
+    FAILED=$[ $FAILED + 1 ]
+else
+    echo Passed
+    PASSED=$[ $PASSED + 1 ]
+fi
+
 echo ${PASSED}/$[ $PASSED + $FAILED ] passed, ${FAILED}/$[ $PASSED + $FAILED ] failed